@@ -0,0 +1,410 @@
+/*
+ * File:   ac.h
+ * Author: andrewchoi
+ *
+ * Compiled arithmetic circuit and the functions that load and evaluate it.
+ */
+
+#ifndef AC_H
+#define AC_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+/*
+ * CONSTANTS
+ */
+#define NODE_SAFETY_MARGIN 20 //Adds 20 to the AC size that user specified
+#define INITIAL_EDGE_NUMBER 4096 //Initial capacity of the child index array
+#define AC_ENGINE_CACHE 0 //Cache-propagation, '*' nodes push derivatives to their children
+#define AC_ENGINE_PULL 1 //Cache-propagation, every node pulls its derivative from its parents
+#define AC_ENGINE_BIT 2 //Bit-encoded propagation, no product registers
+#define AC_ENGINE_AUTO 3 //Chosen from the circuit's statistics (see ac_analyze.c)
+#define AC_FAN_IN_BUCKETS 8 //Fan-in histogram buckets <=1, <=2, <=4, ..., <=64, >64
+#define AC_REUSE_BUCKETS 24 //Reuse distance histogram buckets <1, <2, <4, ..., >=2^22
+#define AC_ORDER_FILE 0 //Nodes in the order of the .ac file
+#define AC_ORDER_DFS 1 //Depth-first post-order from the root
+#define AC_ORDER_LEVEL 2 //Level by level from the leaves
+#define AC_NUM_ORDERS 3
+#define AC_SCHEDULE_LEVEL 0 //Thread pool runs level by level with barriers
+#define AC_SCHEDULE_DATAFLOW 1 //Thread pool runs tasks when their inputs are done (see ac_dataflow.c)
+#define AC_OUTPUT_TEXT 0 //Human readable lines
+#define AC_OUTPUT_NONE 1 //Nothing
+#define AC_OUTPUT_ROOT 2 //CSV of the output per query
+#define AC_OUTPUT_MARGINALS 3 //CSV of the marginals per query
+#define AC_OUTPUT_CSV 4 //CSV of every node per query
+#define AC_OUTPUT_BINARY 5 //Raw values and derivatives per query
+#define AC_NUM_OUTPUTS 6
+#define AC_CODE_PREFIX "circuit" //Function prefix of generated code written by main
+#define AC_MAX_NUMBER_LENGTH 32 //Longest number ac_format_double writes
+#define AC_LANES 8 //Doubles per SIMD vector (one AVX-512 or two AVX2 registers)
+#define AC_BLOCK_VECTORS 2 //SIMD vectors per node visit in batched evaluation
+#define AC_BLOCK_SIZE (AC_LANES * AC_BLOCK_VECTORS) //Instances per node visit
+
+/*
+ * TYPES
+ */
+
+/* SIMD vector of AC_LANES doubles (GCC/Clang vector extension).
+   Compile with -march=native (or -mavx2 / -mavx512f) to get the wide
+   instructions, otherwise the compiler splits it into SSE2 operations. */
+typedef double ac_vec __attribute__((vector_size(AC_LANES * sizeof(double))));
+
+/*
+ * STRUCTURES
+ */
+
+/* Compiled circuit
+   Every per-node field is an array indexed by node index.
+   The children of node i are childIndex[childStart[i]] up to
+   childIndex[childStart[i+1] - 1]; leaves have no children.
+   The indicator leaves of variable x are varLeaf[varLeafStart[x]] up to
+   varLeaf[varLeafStart[x+1] - 1]. */
+struct circuit {
+  /*Number of nodes, the root is the last node*/
+  int numNodes;
+  /*Number of child references over all nodes*/
+  int numEdges;
+  /*Number of variables and their cardinalities (from the '(' header)*/
+  int numVars;
+  int *varCard;
+  /*Node type can be 'n' or 'v' for leaf nodes
+    Node type can be '+' or '*' for non-leaf nodes */
+  char *nodeType;
+  /*Variable index and value of 'v' leaves, -1 for every other node*/
+  int *varIndex;
+  int *varValue;
+  /*Value of the node*/
+  double *vr;
+  /*Derivative of the node*/
+  double *dr;
+  /*Bit flag of '*' nodes, true means there is exactly one child that is zero*/
+  bool *flag;
+  /*CSR child offsets (numNodes + 1 entries) and child indices*/
+  int *childStart;
+  int *childIndex;
+  /*Transposed CSR: the parents of node i are parentIndex[parentStart[i]]
+    up to parentIndex[parentStart[i+1] - 1], parentPos holds the position
+    of node i in the child list of that parent*/
+  int *parentStart;
+  int *parentIndex;
+  int *parentPos;
+  /*Indicator leaves grouped by variable (numVars + 1 offsets)*/
+  int *varLeafStart;
+  int *varLeaf;
+  /*Topological levels: leaves are on level 0, every other node is one
+    level above its highest child. The nodes of level l are
+    levelNode[levelStart[l]] up to levelNode[levelStart[l+1] - 1].*/
+  int numLevels;
+  int *levelStart;
+  int *levelNode;
+  /*Product registers of all '*' nodes in one arena sized at compile time.
+    A '*' node i with w children owns 2 * (w + 1) slots from prStart[i]:
+    the left products prL[0..w] followed by the right products prR[0..w].
+    prStart is -1 for every other node. pr is NULL while the engine does
+    not use registers.*/
+  int *prStart;
+  double *pr;
+  /*Derivative engine used by ac_backward (AC_ENGINE_*)*/
+  int engine;
+  /*Mapped .acb file holding the read-only arrays, NULL if they are
+    allocated (see ac_binary.c)*/
+  void *mapping;
+  size_t mappingLength;
+};
+
+/* Batch of evidence instances evaluated together
+   Instances are grouped in blocks of AC_BLOCK_SIZE. Within a block every
+   node holds AC_BLOCK_VECTORS SIMD vectors, one lane per instance, so a
+   single visit of a node's child list serves the whole block.
+   The value of node i for instance k is
+   vr[(block * numNodes + i) * AC_BLOCK_VECTORS + vector][lane]
+   with block = k / AC_BLOCK_SIZE, vector and lane the rest of k. */
+struct circuit_batch {
+  const struct circuit *ac;
+  /*Number of instances and of blocks they occupy*/
+  int numInstances;
+  int numBlocks;
+  /*Values and derivatives of every node for every instance*/
+  ac_vec *vr;
+  ac_vec *dr;
+  /*Prefix products of the widest '*' node, reused by every node*/
+  ac_vec *scratch;
+};
+
+/* Scaled values for evaluation without underflow
+   Every value, derivative and product register is a mantissa with a power
+   of two exponent: the value of node i is vr[i] * 2^vrExp[i]. The product
+   registers use the layout of the circuit's pr arena. */
+struct circuit_scaled {
+  const struct circuit *ac;
+  double *vr;
+  int *vrExp;
+  double *dr;
+  int *drExp;
+  double *pr;
+  int *prExp;
+};
+
+/* Structural statistics of a compiled circuit (see ac_analyze.c) */
+struct circuit_stats {
+  int numNodes;
+  int numSums;
+  int numProducts;
+  int numConstants;
+  int numZeroConstants;
+  int numIndicators;
+  int numLevels;
+  int maxLevelWidth;
+  /*Children of '+' and '*' nodes*/
+  long sumEdges;
+  long productEdges;
+  /*'*' nodes per fan-in bucket, bucket b holds fan-ins up to 2^b*/
+  int fanInHistogram[AC_FAN_IN_BUCKETS];
+  int maxFanIn;
+  double registerBytes;
+  /*Expected '*' edges whose node has no zero child, and exactly one*/
+  double edgesWithoutZero;
+  double edgesWithOneZero;
+};
+
+/* Reuse distances of the node reads of an upward pass (see ac_analyze.c)
+   The distance of a read is the number of distinct nodes read or written
+   since the last access to the same node. */
+struct reuse_stats {
+  long numReads;
+  /*Reads of a node not accessed before*/
+  long coldReads;
+  double meanDistance;
+  long medianDistance;
+  long p90Distance;
+  /*Reads per bucket, bucket b holds distances below 2^b*/
+  long histogram[AC_REUSE_BUCKETS];
+  /*Share of the reads whose distance fits the L1 and the L2 cache*/
+  double l1Share;
+  double l2Share;
+};
+
+/* Generated passes of one circuit loaded from a shared object
+   (see ac_codegen.c) */
+struct circuit_code {
+  void *library;
+  void (*forward)(double *vr);
+  void (*backward)(const double *vr, double *dr);
+};
+
+/* Destination of query results (see ac_output.c) */
+struct output_sink {
+  const struct circuit *ac;
+  /*AC_OUTPUT_* format and the file it goes to*/
+  int format;
+  FILE *file;
+  /*Formatted text not written yet*/
+  char *buffer;
+  size_t length;
+  /*Marginal table filled by the caller before each query, NULL if the
+    format has no marginals*/
+  double *marginals;
+  /*Variables whose marginals are written, NULL for all*/
+  const bool *variables;
+};
+
+/* State kept between queries for incremental re-evaluation
+   Holds the current evidence, the queue of nodes still to visit and the
+   nodes the last upward step recomputed. The values, derivatives and
+   product registers themselves stay in the circuit. */
+struct incremental {
+  struct circuit *ac;
+  /*Current evidence assignment*/
+  int *evidence;
+  /*Binary heap of queued node indices*/
+  int *heap;
+  int heapSize;
+  bool *queued;
+  /*Nodes recomputed by the last upward step*/
+  int *recomputed;
+  int numRecomputed;
+};
+
+/* Downward pass restricted to a set of query variables (see ac_query.c)
+   The cone holds the query variables' indicator leaves and all their
+   ancestors in reverse index order, so every parent comes before its
+   children. */
+struct circuit_query {
+  struct circuit *ac;
+  /*Query variables without repeats, and a flag per circuit variable*/
+  int numQueryVars;
+  int *queryVar;
+  bool *isQueryVar;
+  /*Ancestor cone*/
+  int numCone;
+  int *coneNode;
+};
+
+struct pool_worker;
+struct dataflow;
+
+/* Thread pool for level-synchronous evaluation
+   The calling thread takes part as worker 0. Every level is split into
+   contiguous chunks, one per worker, with a barrier between levels.
+   In the downward pass each worker scatters derivatives into its own row
+   of threadDr; the owner of a node sums the rows when it reaches the
+   node, so the hot path needs no atomics. The dataflow schedule replaces
+   the level barriers with a task graph (see ac_dataflow.c). */
+struct thread_pool {
+  struct circuit *ac;
+  int numThreads;
+  /*Workers 1 .. numThreads-1 (worker 0 is the caller)*/
+  struct pool_worker *workers;
+  pthread_barrier_t barrier;
+  /*Pass the workers run next*/
+  int task;
+  /*Private derivative accumulators, numThreads rows of numNodes*/
+  double *threadDr;
+  /*AC_SCHEDULE_* and the tasks of the dataflow schedule (NULL until used)*/
+  int schedule;
+  struct dataflow *dataflow;
+};
+
+/*
+ * FUNCTIONS
+ */
+
+/* ac_parse.c */
+struct circuit* ac_parse(const char *filename, int size);
+struct circuit* ac_load(const char *filename, int size);
+int ac_save_text(const struct circuit *ac, const char *filename);
+
+/* ac_binary.c */
+int ac_save_binary(const struct circuit *ac, const char *filename);
+bool ac_is_binary(const void *data, size_t length);
+struct circuit* ac_map_binary(void *data, size_t length, const char *filename);
+void ac_unmap_binary(struct circuit *ac);
+
+/* ac_circuit.c */
+struct circuit* ac_allocate(int size);
+void ac_resize(struct circuit *ac, int size);
+void ac_compile(struct circuit *ac);
+struct circuit* ac_renumber(const struct circuit *ac, const int *order, int numNodes, int *position);
+int ac_register_count(const struct circuit *ac);
+void ac_set_engine(struct circuit *ac, int engine);
+void ac_set_evidence(struct circuit *ac, const int *evidence);
+int ac_parse_evidence(const char *line, const struct circuit *ac, int *evidence);
+int ac_read_evidence(FILE *ev_file, const struct circuit *ac, int *evidence);
+int ac_free(struct circuit *ac);
+
+/* ac_simplify.c */
+struct circuit* ac_simplify(const struct circuit *ac, int maxFanIn, int *remap);
+struct circuit* ac_specialize(const struct circuit *ac, const int *evidence, int maxFanIn, int *remap);
+void ac_fixed_marginals(const struct circuit *ac, const int *evidence, double *marginals);
+
+/* ac_reorder.c */
+int ac_order_by_name(const char *name);
+const char* ac_order_name(int nodeOrder);
+struct circuit* ac_reorder(const struct circuit *ac, int nodeOrder, int *remap);
+
+/* ac_propagate.c */
+void bit_forward_node(struct circuit *ac, int i);
+void bit_backward_node(const struct circuit *ac, int i, double parentdr, double *dr);
+void bit_forwardpropagation(struct circuit *ac);
+void bit_backpropagation(struct circuit *ac);
+void cache_forward_node(struct circuit *ac, int i);
+void cache_backward_node(const struct circuit *ac, int i, double parentdr, double *dr);
+void cache_forwardpropagation(struct circuit *ac);
+void cache_backpropagation(struct circuit *ac);
+double pull_backward_node(const struct circuit *ac, int i);
+void pull_backpropagation(struct circuit *ac);
+int ac_engine_by_name(const char *name);
+const char* ac_engine_name(int engine);
+void ac_forward(struct circuit *ac);
+void ac_backward(struct circuit *ac);
+int ac_marginal_count(const struct circuit *ac);
+double ac_marginals(const struct circuit *ac, double *marginals);
+void ac_print_nodes(const struct circuit *ac);
+
+/* ac_batch.c */
+struct circuit_batch* ac_batch_create(const struct circuit *ac, int numInstances);
+void ac_batch_set_evidence(struct circuit_batch *batch, int instance, const int *evidence);
+void ac_batch_forward(struct circuit_batch *batch);
+void ac_batch_backward(struct circuit_batch *batch);
+void ac_batch_evaluate(struct circuit_batch *batch);
+void ac_batch_evaluate_instances(struct circuit_batch *batch, int numInstances);
+double ac_batch_value(const struct circuit_batch *batch, int node, int instance);
+double ac_batch_derivative(const struct circuit_batch *batch, int node, int instance);
+double ac_batch_marginals(const struct circuit_batch *batch, int instance, double *marginals);
+void ac_batch_free(struct circuit_batch *batch);
+
+/* ac_incremental.c */
+struct incremental* ac_incremental_create(struct circuit *ac, const int *evidence);
+void ac_incremental_set_variable(struct incremental *inc, int var, int value);
+void ac_incremental_set_evidence(struct incremental *inc, const int *evidence);
+void ac_incremental_forward(struct incremental *inc);
+void ac_incremental_backward(struct incremental *inc);
+void ac_incremental_free(struct incremental *inc);
+
+/* ac_prune.c */
+void ac_pruned_forward(struct circuit *ac);
+void ac_pruned_backward(struct circuit *ac);
+
+/* ac_query.c */
+struct circuit_query* ac_query_create(struct circuit *ac, const int *vars, int numVars);
+void ac_query_backward(struct circuit_query *query);
+double ac_query_marginals(const struct circuit_query *query, double *marginals);
+double ac_query_coverage(const struct circuit_query *query);
+void ac_query_free(struct circuit_query *query);
+
+/* ac_scaled.c */
+struct circuit_scaled* ac_scaled_create(const struct circuit *ac);
+void ac_scaled_forward(struct circuit_scaled *sc);
+void ac_scaled_backward(struct circuit_scaled *sc);
+double ac_scaled_log10_value(const struct circuit_scaled *sc, int node);
+double ac_scaled_log10_derivative(const struct circuit_scaled *sc, int node);
+double ac_scaled_marginals(const struct circuit_scaled *sc, double *marginals);
+void ac_scaled_store(const struct circuit_scaled *sc, struct circuit *ac);
+void ac_scaled_free(struct circuit_scaled *sc);
+
+/* ac_analyze.c */
+void ac_analyze(const struct circuit *ac, struct circuit_stats *stats);
+int ac_choose_engine(const struct circuit_stats *stats, int numThreads, FILE *log);
+void ac_reuse_distance(const struct circuit *ac, struct reuse_stats *stats);
+void ac_print_reuse(const struct reuse_stats *stats, const char *label, FILE *log);
+
+/* ac_codegen.c */
+int ac_codegen(const struct circuit *ac, const char *prefix, const char *filename);
+struct circuit_code* ac_code_load(const char *library, const char *prefix, const struct circuit *ac);
+void ac_code_forward(const struct circuit_code *code, struct circuit *ac);
+void ac_code_backward(const struct circuit_code *code, struct circuit *ac);
+void ac_code_free(struct circuit_code *code);
+
+/* ac_output.c */
+int ac_output_by_name(const char *name);
+int ac_format_double(char *out, double x);
+struct output_sink* ac_output_open(const struct circuit *ac, int format, const char *filename,
+				   bool withMarginals);
+bool ac_output_needs_nodes(const struct output_sink *sink);
+void ac_output_query(struct output_sink *sink, int query, double log10Output,
+		     const double *vr, const double *dr);
+int ac_output_close(struct output_sink *sink);
+
+/* ac_server.c */
+int ac_serve(struct circuit **acs, const char **names, int numCircuits, const char *socketPath);
+
+/* ac_parallel.c */
+struct thread_pool* ac_pool_create(struct circuit *ac, int numThreads);
+void ac_parallel_forward(struct thread_pool *pool);
+void ac_parallel_backward(struct thread_pool *pool);
+void ac_pool_set_schedule(struct thread_pool *pool, int schedule);
+int ac_schedule_by_name(const char *name);
+const char* ac_schedule_name(int schedule);
+void ac_pool_free(struct thread_pool *pool);
+
+/* ac_dataflow.c */
+struct dataflow* dataflow_create(const struct circuit *ac, int numThreads);
+int dataflow_task_count(const struct dataflow *flow);
+void dataflow_forward(struct thread_pool *pool, int id);
+void dataflow_backward(struct thread_pool *pool, int id);
+void dataflow_free(struct dataflow *flow);
+
+#endif /* AC_H */
@@ -0,0 +1,295 @@
+/*
+ * File:   ac_analyze.c
+ * Author: andrewchoi
+ *
+ * Structural statistics of a compiled circuit and the choice of engine
+ * they suggest. The cost model counts the work per '*' edge of one
+ * upward and one downward pass:
+ *   cache  two multiplies and two register writes up, two register reads
+ *          and two multiplies down, plus a miss per register slot once
+ *          the arena no longer fits the last level cache
+ *   bit    one multiply up, one division down for a node without zero
+ *          children, a second multiply pass for a node with one zero
+ *          child and nothing for a node with more
+ * Zero children are estimated from the share of zero constants and of
+ * indicators, half of whose variables are assumed observed. With more
+ * than one thread the register engines pull, so no per-thread rows have
+ * to be summed. '+' edges cost the same in every engine and are left out.
+ *
+ * Reuse distances are measured on the access sequence of an upward pass
+ * in index order (the children of a node, then the node) with a Fenwick
+ * tree over the access times, which counts the distinct nodes between
+ * two accesses to the same node in O(log n).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "ac.h"
+
+#define MULTIPLY_COST 1.0
+#define DIVISION_COST 8.0 //Division latency in multiplies
+#define REGISTER_COST 1.0 //Register access that hits the cache
+#define REGISTER_MISS_COST 4.0 //Register access that goes to memory
+#define OBSERVED_SHARE 0.5 //Assumed share of observed variables
+#define DEFAULT_CACHE_SIZE (8 << 20)
+#define DEFAULT_L1_SIZE (32 << 10)
+#define DEFAULT_L2_SIZE (1 << 20)
+
+/*
+ * Size of the last level data cache in bytes
+ */
+static long cache_size(void) {
+  long size = -1;
+#ifdef _SC_LEVEL3_CACHE_SIZE
+  size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+#endif
+#ifdef _SC_LEVEL2_CACHE_SIZE
+  if (size <= 0) {
+    size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+  }
+#endif
+  return (size > 0) ? size : DEFAULT_CACHE_SIZE;
+}
+
+/*
+ * Size of the L1 data cache and of the L2 cache in bytes
+ */
+static long l1_size(void) {
+  long size = -1;
+#ifdef _SC_LEVEL1_DCACHE_SIZE
+  size = sysconf(_SC_LEVEL1_DCACHE_SIZE);
+#endif
+  return (size > 0) ? size : DEFAULT_L1_SIZE;
+}
+
+static long l2_size(void) {
+  long size = -1;
+#ifdef _SC_LEVEL2_CACHE_SIZE
+  size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+  return (size > 0) ? size : DEFAULT_L2_SIZE;
+}
+
+/*
+ * Gather the statistics of a compiled circuit
+ */
+void ac_analyze(const struct circuit *ac, struct circuit_stats *stats) {
+  double zeroChance, indicatorZeroChance;
+  double sumCard = 0;
+
+  memset(stats, 0, sizeof(struct circuit_stats));
+  stats->numNodes = ac->numNodes;
+  stats->numLevels = ac->numLevels;
+  for (int l = 0; l < ac->numLevels; l++) {
+    int width = ac->levelStart[l+1] - ac->levelStart[l];
+    if (width > stats->maxLevelWidth) {
+      stats->maxLevelWidth = width;
+    }
+  }
+
+  for (int x = 0; x < ac->numVars; x++) {
+    sumCard += ac->varCard[x];
+  }
+  /*An observed variable zeroes all but one of its indicators*/
+  indicatorZeroChance = (ac->numVars > 0 && sumCard > 0)
+    ? OBSERVED_SHARE * (1 - ac->numVars / sumCard) : 0;
+
+  for (int i = 0; i < ac->numNodes; i++) {
+    int w = ac->childStart[i+1] - ac->childStart[i];
+    if (ac->nodeType[i] == 'n') {
+      stats->numConstants++;
+      stats->numZeroConstants += (ac->vr[i] == 0);
+    }
+    else if (ac->nodeType[i] == 'v') {
+      stats->numIndicators++;
+    }
+    else if (ac->nodeType[i] == '+') {
+      stats->numSums++;
+      stats->sumEdges += w;
+    }
+    else if (ac->nodeType[i] == '*') {
+      int bucket = 0;
+      while (bucket < AC_FAN_IN_BUCKETS - 1 && (1 << bucket) < w) {
+	bucket++;
+      }
+      stats->numProducts++;
+      stats->productEdges += w;
+      stats->fanInHistogram[bucket]++;
+      if (w > stats->maxFanIn) {
+	stats->maxFanIn = w;
+      }
+    }
+  }
+  stats->registerBytes = (double)ac_register_count(ac) * sizeof(double);
+
+  /*Expected zero children per '*' node, leaves only*/
+  for (int i = 0; i < ac->numNodes; i++) {
+    double none = 1, one = 0;
+    if (ac->nodeType[i] != '*') {
+      continue;
+    }
+    for (int e = ac->childStart[i]; e < ac->childStart[i+1]; e++) {
+      int c = ac->childIndex[e];
+      if (ac->nodeType[c] == 'n') {
+	zeroChance = (ac->vr[c] == 0) ? 1 : 0;
+      }
+      else if (ac->nodeType[c] == 'v') {
+	zeroChance = indicatorZeroChance;
+      }
+      else {
+	continue;
+      }
+      one = one * (1 - zeroChance) + none * zeroChance;
+      none *= (1 - zeroChance);
+    }
+    int w = ac->childStart[i+1] - ac->childStart[i];
+    stats->edgesWithoutZero += none * w;
+    stats->edgesWithOneZero += one * w;
+  }
+}
+
+/*
+ * Pick the engine the cost model expects to be fastest for 'numThreads'
+ * threads, and log the statistics and the reasons to 'log' (if not NULL)
+ */
+int ac_choose_engine(const struct circuit_stats *stats, int numThreads, FILE *log) {
+  long cacheBytes = cache_size();
+  bool registersFit = stats->registerBytes <= cacheBytes;
+  double registerCost = registersFit ? REGISTER_COST : REGISTER_MISS_COST;
+  double cacheCost = stats->productEdges * (4 * MULTIPLY_COST + 4 * registerCost);
+  double bitCost = stats->productEdges * MULTIPLY_COST
+    + stats->edgesWithoutZero * DIVISION_COST + stats->edgesWithOneZero * MULTIPLY_COST;
+  int engine;
+
+  if (bitCost < cacheCost) {
+    engine = AC_ENGINE_BIT;
+  }
+  else {
+    engine = (numThreads > 1) ? AC_ENGINE_PULL : AC_ENGINE_CACHE;
+  }
+
+  if (log != NULL) {
+    fprintf(log, "circuit: %d nodes (%d '+', %d '*', %d constants of which %d zero, %d indicators), %d levels, widest %d\n",
+	    stats->numNodes, stats->numSums, stats->numProducts, stats->numConstants,
+	    stats->numZeroConstants, stats->numIndicators, stats->numLevels, stats->maxLevelWidth);
+    fprintf(log, "'*' fan-in:");
+    for (int b = 0; b < AC_FAN_IN_BUCKETS; b++) {
+      if (stats->fanInHistogram[b] > 0) {
+	fprintf(log, (b < AC_FAN_IN_BUCKETS - 1) ? " <=%d: %d" : " >%d: %d",
+		(b < AC_FAN_IN_BUCKETS - 1) ? 1 << b : 1 << (b - 1), stats->fanInHistogram[b]);
+      }
+    }
+    fprintf(log, " (max %d)\n", stats->maxFanIn);
+    fprintf(log, "engine: %s; estimated cost per query cache %.3g, bit %.3g; register arena %.1f MB %s the %.1f MB cache; %.0f%% of '*' edges expect one zero child, %.0f%% none\n",
+	    ac_engine_name(engine), cacheCost, bitCost, stats->registerBytes / (1 << 20),
+	    registersFit ? "fits" : "exceeds", (double)cacheBytes / (1 << 20),
+	    stats->productEdges > 0 ? 100 * stats->edgesWithOneZero / stats->productEdges : 0,
+	    stats->productEdges > 0 ? 100 * stats->edgesWithoutZero / stats->productEdges : 0);
+    if (engine == AC_ENGINE_PULL) {
+      fprintf(log, "engine: pull rather than cache, %d threads need no private derivative rows\n", numThreads);
+    }
+  }
+  return engine;
+}
+
+/*
+ * Record one access at 'time' to 'node' and return its reuse distance,
+ * -1 for the first access. 'tree' is a Fenwick tree over the access
+ * times marking the last access to every node.
+ */
+static long access_node(int *tree, long numTimes, long *last, int node, long time) {
+  long distance = -1;
+
+  if (last[node] >= 0) {
+    /*Marks after the last access = distinct nodes since*/
+    long after = 0;
+    for (long t = time; t > 0; t -= t & -t) {
+      after += tree[t];
+    }
+    for (long t = last[node] + 1; t > 0; t -= t & -t) {
+      after -= tree[t];
+    }
+    distance = after;
+    for (long t = last[node] + 1; t <= numTimes; t += t & -t) {
+      tree[t]--;
+    }
+  }
+  for (long t = time + 1; t <= numTimes; t += t & -t) {
+    tree[t]++;
+  }
+  last[node] = time;
+  return distance;
+}
+
+/*
+ * Measure the reuse distances of the node reads of an upward pass
+ */
+void ac_reuse_distance(const struct circuit *ac, struct reuse_stats *stats) {
+  long numTimes = (long)ac->numEdges + ac->numNodes;
+  int *tree = (int*)calloc(numTimes + 1, sizeof(int));
+  long *last = (long*)malloc(sizeof(long) * ac->numNodes);
+  long l1Nodes = l1_size() / sizeof(double);
+  long l2Nodes = l2_size() / sizeof(double);
+  long l1Reads = 0, l2Reads = 0;
+  double total = 0;
+  long time = 0;
+
+  memset(stats, 0, sizeof(struct reuse_stats));
+  for (int i = 0; i < ac->numNodes; i++) {
+    last[i] = -1;
+  }
+  for (int i = 0; i < ac->numNodes; i++) {
+    for (int e = ac->childStart[i]; e < ac->childStart[i+1]; e++) {
+      long distance = access_node(tree, numTimes, last, ac->childIndex[e], time++);
+      int bucket = 0;
+      stats->numReads++;
+      if (distance < 0) {
+	stats->coldReads++;
+	continue;
+      }
+      while (bucket < AC_REUSE_BUCKETS - 1 && (1L << bucket) <= distance) {
+	bucket++;
+      }
+      stats->histogram[bucket]++;
+      total += distance;
+      l1Reads += (distance < l1Nodes);
+      l2Reads += (distance < l2Nodes);
+    }
+    access_node(tree, numTimes, last, i, time++);
+  }
+
+  long warmReads = stats->numReads - stats->coldReads;
+  if (warmReads > 0) {
+    /*Median and 90th percentile to the bucket*/
+    long seen = 0;
+    stats->meanDistance = total / warmReads;
+    stats->medianDistance = -1;
+    stats->p90Distance = -1;
+    for (int b = 0; b < AC_REUSE_BUCKETS; b++) {
+      seen += stats->histogram[b];
+      if (stats->medianDistance < 0 && 2 * seen >= warmReads) {
+	stats->medianDistance = 1L << b;
+      }
+      if (stats->p90Distance < 0 && 10 * seen >= 9 * warmReads) {
+	stats->p90Distance = 1L << b;
+      }
+    }
+    stats->l1Share = (double)l1Reads / warmReads;
+    stats->l2Share = (double)l2Reads / warmReads;
+  }
+  free(last);
+  free(tree);
+}
+
+/*
+ * Log reuse distance statistics as one line
+ */
+void ac_print_reuse(const struct reuse_stats *stats, const char *label, FILE *log) {
+  fprintf(log, "reuse distance (%s): %ld reads, %ld cold, mean %.0f, median <%ld, p90 <%ld nodes; %.1f%% within L1, %.1f%% within L2\n",
+	  label, stats->numReads, stats->coldReads, stats->meanDistance, stats->medianDistance,
+	  stats->p90Distance, 100 * stats->l1Share, 100 * stats->l2Share);
+}
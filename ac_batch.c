@@ -0,0 +1,289 @@
+/*
+ * File:   ac_batch.c
+ * Author: andrewchoi
+ *
+ * Batched evaluation of many evidence instances over one compiled circuit.
+ * Every node holds a block of AC_BLOCK_SIZE values, one SIMD lane per
+ * instance, so the child index traversal of a node is paid once per block
+ * instead of once per instance. The '*' derivatives are computed from
+ * prefix products in a scratch buffer and a running suffix product, so no
+ * product registers are stored per node.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ac.h"
+
+#define V AC_BLOCK_VECTORS
+
+/*
+ * Allocate an aligned array of 'count' SIMD vectors
+ */
+static ac_vec* allocate_vectors(size_t count) {
+  void *vectors = NULL;
+  if (posix_memalign(&vectors, sizeof(ac_vec), sizeof(ac_vec) * (count > 0 ? count : 1)) != 0) {
+    return NULL;
+  }
+  return (ac_vec*)vectors;
+}
+
+/*
+ * Create a batch of 'numInstances' instances for a compiled circuit.
+ * Every instance starts with the leaf values currently held by the circuit.
+ */
+struct circuit_batch* ac_batch_create(const struct circuit *ac, int numInstances) {
+  struct circuit_batch *batch = (struct circuit_batch*)malloc(sizeof(struct circuit_batch));
+  int maxFanIn = 0;
+
+  batch->ac = ac;
+  batch->numInstances = numInstances;
+  batch->numBlocks = (numInstances + AC_BLOCK_SIZE - 1) / AC_BLOCK_SIZE;
+
+  size_t blockLength = (size_t)ac->numNodes * V;
+  batch->vr = allocate_vectors(blockLength * batch->numBlocks);
+  batch->dr = allocate_vectors(blockLength * batch->numBlocks);
+
+  for (int i = 0; i < ac->numNodes; i++) {
+    int fanIn = ac->childStart[i+1] - ac->childStart[i];
+    if (fanIn > maxFanIn) {
+      maxFanIn = fanIn;
+    }
+  }
+  batch->scratch = allocate_vectors((size_t)(maxFanIn + 1) * V);
+
+  /*Broadcast the leaf values to every lane*/
+  for (int b = 0; b < batch->numBlocks; b++) {
+    ac_vec *vr = batch->vr + b * blockLength;
+    for (int i = 0; i < ac->numNodes; i++) {
+      ac_vec leaf = {0};
+      leaf += ac->vr[i];
+      for (int v = 0; v < V; v++) {
+	vr[i * V + v] = leaf;
+      }
+    }
+  }
+  return batch;
+}
+
+/*
+ * Set the indicator leaves of one instance from an evidence assignment,
+ * with the same conventions as ac_set_evidence
+ */
+void ac_batch_set_evidence(struct circuit_batch *batch, int instance, const int *evidence) {
+  const struct circuit *ac = batch->ac;
+  int block = instance / AC_BLOCK_SIZE;
+  int vector = (instance % AC_BLOCK_SIZE) / AC_LANES;
+  int lane = instance % AC_LANES;
+  ac_vec *vr = batch->vr + (size_t)block * ac->numNodes * V + vector;
+
+  for (int x = 0; x < ac->numVars; x++) {
+    for (int l = ac->varLeafStart[x]; l < ac->varLeafStart[x+1]; l++) {
+      int leaf = ac->varLeaf[l];
+      if (evidence == NULL) {
+	vr[leaf * V][lane] = ac->varValue[leaf];
+      }
+      else {
+	vr[leaf * V][lane] = (evidence[x] < 0 || evidence[x] == ac->varValue[leaf]);
+      }
+    }
+  }
+}
+
+/*
+ * Upward pass for one block of instances
+ */
+static void forward_block(struct circuit_batch *batch, int b) {
+  const struct circuit *ac = batch->ac;
+  const int *childStart = ac->childStart;
+  const int *childIndex = ac->childIndex;
+  ac_vec zero = {0};
+  ac_vec one = zero + 1;
+  ac_vec *vr = batch->vr + (size_t)b * ac->numNodes * V;
+
+  for (int i = 0; i < ac->numNodes; i++) {
+    ac_vec acc[V];
+
+    if (ac->nodeType[i] == '+') {
+      for (int v = 0; v < V; v++) {
+	acc[v] = zero;
+      }
+      for (int e = childStart[i]; e < childStart[i+1]; e++) {
+	const ac_vec *child = vr + childIndex[e] * V;
+	for (int v = 0; v < V; v++) {
+	  acc[v] += child[v];
+	}
+      }
+    }
+    else if (ac->nodeType[i] == '*') {
+      for (int v = 0; v < V; v++) {
+	acc[v] = one;
+      }
+      for (int e = childStart[i]; e < childStart[i+1]; e++) {
+	const ac_vec *child = vr + childIndex[e] * V;
+	for (int v = 0; v < V; v++) {
+	  acc[v] *= child[v];
+	}
+      }
+    }
+    else {
+      continue;
+    }
+    for (int v = 0; v < V; v++) {
+      vr[i * V + v] = acc[v];
+    }
+  }
+}
+
+/*
+ * Downward pass for one block of instances
+ */
+static void backward_block(struct circuit_batch *batch, int b) {
+  const struct circuit *ac = batch->ac;
+  const int *childStart = ac->childStart;
+  const int *childIndex = ac->childIndex;
+  ac_vec *prefix = batch->scratch;
+  ac_vec zero = {0};
+  ac_vec one = zero + 1;
+  const ac_vec *vr = batch->vr + (size_t)b * ac->numNodes * V;
+  ac_vec *dr = batch->dr + (size_t)b * ac->numNodes * V;
+
+  memset(dr, 0, sizeof(ac_vec) * (size_t)ac->numNodes * V);
+  for (int v = 0; v < V; v++) {
+    dr[(ac->numNodes - 1) * V + v] = one;
+  }
+
+  for (int i = ac->numNodes - 1; i >= 0; i--) {
+    const ac_vec *parentdr = dr + i * V;
+    int start = childStart[i];
+    int w = childStart[i+1] - start;
+
+    if (ac->nodeType[i] == '+') {
+      for (int e = start; e < start + w; e++) {
+	ac_vec *child = dr + childIndex[e] * V;
+	for (int v = 0; v < V; v++) {
+	  child[v] += parentdr[v];
+	}
+      }
+    }
+    else if (ac->nodeType[i] == '*') {
+      ac_vec suffix[V];
+
+      /*prefix[k] is the product of the children left of position k*/
+      for (int v = 0; v < V; v++) {
+	prefix[v] = parentdr[v];
+	suffix[v] = one;
+      }
+      for (int k = 1; k < w; k++) {
+	const ac_vec *child = vr + childIndex[start + k - 1] * V;
+	for (int v = 0; v < V; v++) {
+	  prefix[k * V + v] = prefix[(k-1) * V + v] * child[v];
+	}
+      }
+      /*Walk back from the right, multiplying in the suffix product*/
+      for (int k = w - 1; k >= 0; k--) {
+	int cIndex = childIndex[start + k];
+	for (int v = 0; v < V; v++) {
+	  dr[cIndex * V + v] += prefix[k * V + v] * suffix[v];
+	  suffix[v] *= vr[cIndex * V + v];
+	}
+      }
+    }
+  }
+}
+
+/*
+ * Upward pass for every instance of the batch
+ */
+void ac_batch_forward(struct circuit_batch *batch) {
+  for (int b = 0; b < batch->numBlocks; b++) {
+    forward_block(batch, b);
+  }
+}
+
+/*
+ * Downward pass for every instance of the batch.
+ * Needs the values of the last upward pass.
+ */
+void ac_batch_backward(struct circuit_batch *batch) {
+  for (int b = 0; b < batch->numBlocks; b++) {
+    backward_block(batch, b);
+  }
+}
+
+/*
+ * Both passes for every instance of the batch. The downward pass of a
+ * block runs right after its upward pass, while the block's values are
+ * still in cache.
+ */
+void ac_batch_evaluate(struct circuit_batch *batch) {
+  ac_batch_evaluate_instances(batch, batch->numInstances);
+}
+
+/*
+ * Both passes for the first 'numInstances' instances only, so a batch
+ * can be sized for the largest group and serve smaller ones. The rest of
+ * the last block used is evaluated along.
+ */
+void ac_batch_evaluate_instances(struct circuit_batch *batch, int numInstances) {
+  int numBlocks = (numInstances + AC_BLOCK_SIZE - 1) / AC_BLOCK_SIZE;
+
+  if (numBlocks > batch->numBlocks) {
+    numBlocks = batch->numBlocks;
+  }
+  for (int b = 0; b < numBlocks; b++) {
+    forward_block(batch, b);
+    backward_block(batch, b);
+  }
+}
+
+/*
+ * Value of a node for one instance of the batch
+ */
+double ac_batch_value(const struct circuit_batch *batch, int node, int instance) {
+  size_t block = instance / AC_BLOCK_SIZE;
+  int vector = (instance % AC_BLOCK_SIZE) / AC_LANES;
+  return batch->vr[(block * batch->ac->numNodes + node) * V + vector][instance % AC_LANES];
+}
+
+/*
+ * Partial derivative of the root with respect to a node for one instance
+ */
+double ac_batch_derivative(const struct circuit_batch *batch, int node, int instance) {
+  size_t block = instance / AC_BLOCK_SIZE;
+  int vector = (instance % AC_BLOCK_SIZE) / AC_LANES;
+  return batch->dr[(block * batch->ac->numNodes + node) * V + vector][instance % AC_LANES];
+}
+
+/*
+ * Posterior marginals of one instance, laid out as for ac_marginals.
+ * Returns P(e) of the instance.
+ */
+double ac_batch_marginals(const struct circuit_batch *batch, int instance, double *marginals) {
+  const struct circuit *ac = batch->ac;
+  double root = ac_batch_value(batch, ac->numNodes - 1, instance);
+  int offset = 0;
+
+  for (int x = 0; x < ac->numVars; x++) {
+    for (int v = 0; v < ac->varCard[x]; v++) {
+      marginals[offset + v] = 0;
+    }
+    for (int l = ac->varLeafStart[x]; l < ac->varLeafStart[x+1]; l++) {
+      int leaf = ac->varLeaf[l];
+      if (ac->varValue[leaf] < ac->varCard[x] && root != 0) {
+	marginals[offset + ac->varValue[leaf]] += ac_batch_derivative(batch, leaf, instance)
+	  * ac_batch_value(batch, leaf, instance) / root;
+      }
+    }
+    offset += ac->varCard[x];
+  }
+  return root;
+}
+
+void ac_batch_free(struct circuit_batch *batch) {
+  free(batch->scratch);
+  free(batch->dr);
+  free(batch->vr);
+  free(batch);
+}
@@ -0,0 +1,384 @@
+/*
+ * File:   ac_binary.c
+ * Author: andrewchoi
+ *
+ * Compact binary circuit format (.acb). A compiled circuit is written as a
+ * versioned header followed by its arrays, each aligned to 64 bytes:
+ * variable cardinalities, node types, variables and values of the
+ * indicator leaves, leaf constants, child CSR, indicators per variable,
+ * parent CSR, topological levels and product register offsets.
+ * Loading maps the file and points the circuit straight at the mapped
+ * arrays; only the values, derivatives, flags and product registers that
+ * evaluation writes are allocated. Worker processes that map the same
+ * file share its pages through the page cache. Before use, the section
+ * lengths are checked against the header counts and every index in the
+ * arrays against what it refers to, so a corrupt file is rejected.
+ * The file uses the byte order of the machine that wrote it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "ac.h"
+
+#define ACB_MAGIC "ACB\0"
+#define ACB_VERSION 1
+#define ACB_BYTE_ORDER 0x01020304 //Reads back differently on a foreign byte order
+#define ACB_ALIGNMENT 64
+
+/* Sections of the file, in file order */
+enum acb_section {
+  ACB_VAR_CARD,
+  ACB_NODE_TYPE,
+  ACB_VAR_INDEX,
+  ACB_VAR_VALUE,
+  ACB_LEAF_VALUE,
+  ACB_CHILD_START,
+  ACB_CHILD_INDEX,
+  ACB_VAR_LEAF_START,
+  ACB_VAR_LEAF,
+  ACB_PARENT_START,
+  ACB_PARENT_INDEX,
+  ACB_PARENT_POS,
+  ACB_LEVEL_START,
+  ACB_LEVEL_NODE,
+  ACB_PR_START,
+  ACB_NUM_SECTIONS
+};
+
+struct acb_header {
+  char magic[4];
+  uint32_t version;
+  uint32_t byteOrder;
+  int32_t numNodes;
+  int32_t numEdges;
+  int32_t numVars;
+  int32_t numLevels;
+  int32_t numRegisters;
+  /*Byte offset and length of every section*/
+  uint64_t offset[ACB_NUM_SECTIONS];
+  uint64_t length[ACB_NUM_SECTIONS];
+};
+
+/*
+ * Write a compiled circuit to an .acb file
+ */
+int ac_save_binary(const struct circuit *ac, const char *filename) {
+  struct acb_header header;
+  const void *section[ACB_NUM_SECTIONS];
+  static const char padding[ACB_ALIGNMENT];
+  FILE *acb_file;
+  uint64_t position;
+  int numLeaves = ac->varLeafStart[ac->numVars];
+  int status = EXIT_SUCCESS;
+
+  /*Leaf constants, and the file values of the indicators*/
+  double *leafValue = (double*)calloc(ac->numNodes, sizeof(double));
+  for (int i = 0; i < ac->numNodes; i++) {
+    if (ac->nodeType[i] == 'n') {
+      leafValue[i] = ac->vr[i];
+    }
+    else if (ac->nodeType[i] == 'v') {
+      leafValue[i] = ac->varValue[i];
+    }
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, ACB_MAGIC, 4);
+  header.version = ACB_VERSION;
+  header.byteOrder = ACB_BYTE_ORDER;
+  header.numNodes = ac->numNodes;
+  header.numEdges = ac->numEdges;
+  header.numVars = ac->numVars;
+  header.numLevels = ac->numLevels;
+  header.numRegisters = ac_register_count(ac);
+
+  section[ACB_VAR_CARD] = ac->varCard;
+  header.length[ACB_VAR_CARD] = sizeof(int) * ac->numVars;
+  section[ACB_NODE_TYPE] = ac->nodeType;
+  header.length[ACB_NODE_TYPE] = sizeof(char) * ac->numNodes;
+  section[ACB_VAR_INDEX] = ac->varIndex;
+  header.length[ACB_VAR_INDEX] = sizeof(int) * ac->numNodes;
+  section[ACB_VAR_VALUE] = ac->varValue;
+  header.length[ACB_VAR_VALUE] = sizeof(int) * ac->numNodes;
+  section[ACB_LEAF_VALUE] = leafValue;
+  header.length[ACB_LEAF_VALUE] = sizeof(double) * ac->numNodes;
+  section[ACB_CHILD_START] = ac->childStart;
+  header.length[ACB_CHILD_START] = sizeof(int) * (ac->numNodes + 1);
+  section[ACB_CHILD_INDEX] = ac->childIndex;
+  header.length[ACB_CHILD_INDEX] = sizeof(int) * ac->numEdges;
+  section[ACB_VAR_LEAF_START] = ac->varLeafStart;
+  header.length[ACB_VAR_LEAF_START] = sizeof(int) * (ac->numVars + 1);
+  section[ACB_VAR_LEAF] = ac->varLeaf;
+  header.length[ACB_VAR_LEAF] = sizeof(int) * numLeaves;
+  section[ACB_PARENT_START] = ac->parentStart;
+  header.length[ACB_PARENT_START] = sizeof(int) * (ac->numNodes + 1);
+  section[ACB_PARENT_INDEX] = ac->parentIndex;
+  header.length[ACB_PARENT_INDEX] = sizeof(int) * ac->numEdges;
+  section[ACB_PARENT_POS] = ac->parentPos;
+  header.length[ACB_PARENT_POS] = sizeof(int) * ac->numEdges;
+  section[ACB_LEVEL_START] = ac->levelStart;
+  header.length[ACB_LEVEL_START] = sizeof(int) * (ac->numLevels + 1);
+  section[ACB_LEVEL_NODE] = ac->levelNode;
+  header.length[ACB_LEVEL_NODE] = sizeof(int) * ac->numNodes;
+  section[ACB_PR_START] = ac->prStart;
+  header.length[ACB_PR_START] = sizeof(int) * ac->numNodes;
+
+  position = (sizeof(header) + ACB_ALIGNMENT - 1) / ACB_ALIGNMENT * ACB_ALIGNMENT;
+  for (int k = 0; k < ACB_NUM_SECTIONS; k++) {
+    header.offset[k] = position;
+    position += (header.length[k] + ACB_ALIGNMENT - 1) / ACB_ALIGNMENT * ACB_ALIGNMENT;
+  }
+
+  acb_file = fopen(filename, "wb");
+  if (!acb_file) {
+    fprintf(stderr, "Unable to write file %s\n", filename);
+    free(leafValue);
+    return (EXIT_FAILURE);
+  }
+
+  position = fwrite(&header, sizeof(header), 1, acb_file) * sizeof(header);
+  for (int k = 0; k < ACB_NUM_SECTIONS; k++) {
+    if (fwrite(padding, 1, header.offset[k] - position, acb_file) != header.offset[k] - position
+	|| fwrite(section[k], 1, header.length[k], acb_file) != header.length[k]) {
+      status = EXIT_FAILURE;
+      break;
+    }
+    position = header.offset[k] + header.length[k];
+  }
+  if (fclose(acb_file) != 0 || status != EXIT_SUCCESS) {
+    fprintf(stderr, "Unable to write file %s\n", filename);
+    status = EXIT_FAILURE;
+  }
+  free(leafValue);
+  return (status);
+}
+
+/*
+ * True if a mapped file starts with the .acb magic
+ */
+bool ac_is_binary(const void *data, size_t length) {
+  return length >= 4 && memcmp(data, ACB_MAGIC, 4) == 0;
+}
+
+/*
+ * True if every section lies within the file and has the length its
+ * count in the header requires, so no array is read past its section
+ */
+static bool sections_valid(const struct acb_header *header, size_t length) {
+  uint64_t expected[ACB_NUM_SECTIONS];
+  uint64_t numNodes = (uint64_t)header->numNodes;
+  uint64_t numEdges = (uint64_t)header->numEdges;
+  uint64_t numVars = (uint64_t)header->numVars;
+  const int *varLeafStart;
+
+  if (header->numNodes < 1 || header->numEdges < 0 || header->numVars < 0 || header->numLevels < 0
+      || header->numRegisters < 0) {
+    return false;
+  }
+  for (int k = 0; k < ACB_NUM_SECTIONS; k++) {
+    if (header->offset[k] % ACB_ALIGNMENT != 0 || header->offset[k] > length
+	|| header->length[k] > length - header->offset[k]) {
+      return false;
+    }
+  }
+
+  expected[ACB_VAR_CARD] = sizeof(int) * numVars;
+  expected[ACB_NODE_TYPE] = sizeof(char) * numNodes;
+  expected[ACB_VAR_INDEX] = sizeof(int) * numNodes;
+  expected[ACB_VAR_VALUE] = sizeof(int) * numNodes;
+  expected[ACB_LEAF_VALUE] = sizeof(double) * numNodes;
+  expected[ACB_CHILD_START] = sizeof(int) * (numNodes + 1);
+  expected[ACB_CHILD_INDEX] = sizeof(int) * numEdges;
+  expected[ACB_VAR_LEAF_START] = sizeof(int) * (numVars + 1);
+  expected[ACB_VAR_LEAF] = 0; //Checked below, once its count can be read
+  expected[ACB_PARENT_START] = sizeof(int) * (numNodes + 1);
+  expected[ACB_PARENT_INDEX] = sizeof(int) * numEdges;
+  expected[ACB_PARENT_POS] = sizeof(int) * numEdges;
+  expected[ACB_LEVEL_START] = sizeof(int) * ((uint64_t)header->numLevels + 1);
+  expected[ACB_LEVEL_NODE] = sizeof(int) * numNodes;
+  expected[ACB_PR_START] = sizeof(int) * numNodes;
+  for (int k = 0; k < ACB_NUM_SECTIONS; k++) {
+    if (k != ACB_VAR_LEAF && header->length[k] != expected[k]) {
+      return false;
+    }
+  }
+
+  /*One indicator leaf per entry*/
+  varLeafStart = (const int*)((const char*)header + header->offset[ACB_VAR_LEAF_START]);
+  return varLeafStart[numVars] >= 0
+    && header->length[ACB_VAR_LEAF] == sizeof(int) * (uint64_t)varLeafStart[numVars];
+}
+
+/*
+ * True if an offset array of 'count' + 1 entries starts at 0, never
+ * decreases and ends at 'total'
+ */
+static bool offsets_valid(const int *start, int count, int total) {
+  if (start[0] != 0 || start[count] != total) {
+    return false;
+  }
+  for (int k = 0; k < count; k++) {
+    if (start[k+1] < start[k]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * True if the arrays of a mapped circuit only refer to what exists:
+ * children come before their node, the parent lists are the transposed
+ * child lists, every indicator leaf list and level holds valid nodes,
+ * and the product registers of every '*' node lie in the arena. A
+ * corrupt file would otherwise be read out of bounds by the first pass.
+ */
+static bool contents_valid(const struct circuit *ac, int numRegisters) {
+  int numLeaves = ac->varLeafStart[ac->numVars];
+  bool *placed;
+  bool valid = true;
+
+  for (int x = 0; x < ac->numVars; x++) {
+    if (ac->varCard[x] < 0) {
+      return false;
+    }
+  }
+  if (!offsets_valid(ac->childStart, ac->numNodes, ac->numEdges)
+      || !offsets_valid(ac->parentStart, ac->numNodes, ac->numEdges)
+      || !offsets_valid(ac->varLeafStart, ac->numVars, numLeaves)
+      || !offsets_valid(ac->levelStart, ac->numLevels, ac->numNodes)) {
+    return false;
+  }
+
+  for (int i = 0; i < ac->numNodes; i++) {
+    int w = ac->childStart[i+1] - ac->childStart[i];
+    char type = ac->nodeType[i];
+    if (type == 'v') {
+      if (w != 0 || ac->varIndex[i] < 0 || ac->varIndex[i] >= ac->numVars || ac->varValue[i] < 0) {
+	return false;
+      }
+    }
+    else if ((type == 'n' && w != 0) || (type != 'n' && type != '+' && type != '*')) {
+      return false;
+    }
+    if (type == '*' ? ac->prStart[i] < 0 || ac->prStart[i] > numRegisters - 2 * (w + 1)
+	: ac->prStart[i] != -1) {
+      return false;
+    }
+    for (int e = ac->childStart[i]; e < ac->childStart[i+1]; e++) {
+      if (ac->childIndex[e] < 0 || ac->childIndex[e] >= i) {
+	return false;
+      }
+    }
+    for (int k = ac->parentStart[i]; k < ac->parentStart[i+1]; k++) {
+      int parent = ac->parentIndex[k];
+      int pos = ac->parentPos[k];
+      if (parent <= i || parent >= ac->numNodes || pos < 0
+	  || pos >= ac->childStart[parent+1] - ac->childStart[parent]
+	  || ac->childIndex[ac->childStart[parent] + pos] != i) {
+	return false;
+      }
+    }
+  }
+
+  for (int x = 0; x < ac->numVars; x++) {
+    for (int l = ac->varLeafStart[x]; l < ac->varLeafStart[x+1]; l++) {
+      int leaf = ac->varLeaf[l];
+      if (leaf < 0 || leaf >= ac->numNodes || ac->nodeType[leaf] != 'v' || ac->varIndex[leaf] != x) {
+	return false;
+      }
+    }
+  }
+
+  /*Every node on exactly one level*/
+  placed = (bool*)calloc(ac->numNodes, sizeof(bool));
+  for (int k = 0; valid && k < ac->numNodes; k++) {
+    int i = ac->levelNode[k];
+    valid = (i >= 0 && i < ac->numNodes && !placed[i]);
+    if (valid) {
+      placed[i] = true;
+    }
+  }
+  free(placed);
+  return valid;
+}
+
+/*
+ * Build a circuit over a mapped .acb file. On success the circuit owns
+ * the mapping and unmaps it in ac_free; on failure the caller keeps it.
+ */
+struct circuit* ac_map_binary(void *data, size_t length, const char *filename) {
+  const struct acb_header *header = (const struct acb_header*)data;
+  const char *base = (const char*)data;
+  struct circuit *ac;
+
+  if (length < sizeof(struct acb_header) || header->version != ACB_VERSION
+      || header->byteOrder != ACB_BYTE_ORDER) {
+    fprintf(stderr, "Unsupported binary circuit %s\n", filename);
+    return NULL;
+  }
+  if (!sections_valid(header, length)) {
+    fprintf(stderr, "Truncated binary circuit %s\n", filename);
+    return NULL;
+  }
+
+  ac = (struct circuit*)calloc(1, sizeof(struct circuit));
+  ac->mapping = data;
+  ac->mappingLength = length;
+  ac->numNodes = header->numNodes;
+  ac->numEdges = header->numEdges;
+  ac->numVars = header->numVars;
+  ac->numLevels = header->numLevels;
+
+  /*Read-only arrays are used in place*/
+  ac->varCard = (int*)(base + header->offset[ACB_VAR_CARD]);
+  ac->nodeType = (char*)(base + header->offset[ACB_NODE_TYPE]);
+  ac->varIndex = (int*)(base + header->offset[ACB_VAR_INDEX]);
+  ac->varValue = (int*)(base + header->offset[ACB_VAR_VALUE]);
+  ac->childStart = (int*)(base + header->offset[ACB_CHILD_START]);
+  ac->childIndex = (int*)(base + header->offset[ACB_CHILD_INDEX]);
+  ac->varLeafStart = (int*)(base + header->offset[ACB_VAR_LEAF_START]);
+  ac->varLeaf = (int*)(base + header->offset[ACB_VAR_LEAF]);
+  ac->parentStart = (int*)(base + header->offset[ACB_PARENT_START]);
+  ac->parentIndex = (int*)(base + header->offset[ACB_PARENT_INDEX]);
+  ac->parentPos = (int*)(base + header->offset[ACB_PARENT_POS]);
+  ac->levelStart = (int*)(base + header->offset[ACB_LEVEL_START]);
+  ac->levelNode = (int*)(base + header->offset[ACB_LEVEL_NODE]);
+  ac->prStart = (int*)(base + header->offset[ACB_PR_START]);
+
+  if (!contents_valid(ac, header->numRegisters)) {
+    fprintf(stderr, "Corrupt binary circuit %s\n", filename);
+    free(ac);
+    return NULL;
+  }
+  /*The register count must match the layout the arrays imply*/
+  if (ac_register_count(ac) != header->numRegisters) {
+    fprintf(stderr, "Binary circuit %s has %d product registers, its nodes need %d\n", filename,
+	    header->numRegisters, ac_register_count(ac));
+    free(ac);
+    return NULL;
+  }
+
+  /*Evaluation state is private to the process*/
+  ac->vr = (double*)malloc(sizeof(double) * ac->numNodes);
+  memcpy(ac->vr, base + header->offset[ACB_LEAF_VALUE], sizeof(double) * ac->numNodes);
+  ac->dr = (double*)calloc(ac->numNodes, sizeof(double));
+  ac->flag = (bool*)calloc(ac->numNodes, sizeof(bool));
+  ac->pr = (double*)calloc(header->numRegisters + 1, sizeof(double));
+  return ac;
+}
+
+/*
+ * Release a circuit built by ac_map_binary
+ */
+void ac_unmap_binary(struct circuit *ac) {
+  free(ac->pr);
+  free(ac->flag);
+  free(ac->dr);
+  free(ac->vr);
+  munmap(ac->mapping, ac->mappingLength);
+  free(ac);
+}
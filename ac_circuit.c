@@ -0,0 +1,384 @@
+/*
+ * File:   ac_circuit.c
+ * Author: andrewchoi
+ *
+ * Compiling, evidence handling and deallocation of circuits.
+ * A circuit is read (see ac_parse.c) and compiled once; it can then be
+ * evaluated any number of times against different evidence without
+ * touching the file again.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+
+#include "ac.h"
+
+/*
+ * Allocate an empty circuit with room for 'size' nodes
+ */
+struct circuit* ac_allocate(int size) {
+  struct circuit *ac = (struct circuit*)calloc(1, sizeof(struct circuit));
+  ac->nodeType = (char*)malloc(sizeof(char) * size);
+  ac->varIndex = (int*)malloc(sizeof(int) * size);
+  ac->varValue = (int*)malloc(sizeof(int) * size);
+  ac->vr = (double*)malloc(sizeof(double) * size);
+  ac->dr = (double*)calloc(size, sizeof(double));
+  ac->flag = (bool*)calloc(size, sizeof(bool));
+  ac->childStart = (int*)malloc(sizeof(int) * (size + 1));
+  ac->childStart[0] = 0;
+  ac->childIndex = (int*)malloc(sizeof(int) * INITIAL_EDGE_NUMBER);
+  return ac;
+}
+
+/*
+ * Change the room of an uncompiled circuit to 'size' nodes.
+ * Grows the node store while reading and trims it afterwards.
+ */
+void ac_resize(struct circuit *ac, int size) {
+  ac->nodeType = (char*)realloc(ac->nodeType, sizeof(char) * size);
+  ac->varIndex = (int*)realloc(ac->varIndex, sizeof(int) * size);
+  ac->varValue = (int*)realloc(ac->varValue, sizeof(int) * size);
+  ac->vr = (double*)realloc(ac->vr, sizeof(double) * size);
+  ac->dr = (double*)realloc(ac->dr, sizeof(double) * size);
+  ac->flag = (bool*)realloc(ac->flag, sizeof(bool) * size);
+  ac->childStart = (int*)realloc(ac->childStart, sizeof(int) * (size + 1));
+}
+
+/*
+ * Copy the nodes order[0] .. order[numNodes-1] of a circuit into a new,
+ * uncompiled circuit, node order[n] becoming node n. The children of
+ * every copied node must be copied before it. position[i] is set to the
+ * new index of node i, or -1 if it is not copied.
+ */
+struct circuit* ac_renumber(const struct circuit *ac, const int *order, int numNodes, int *position) {
+  struct circuit *copy = ac_allocate(numNodes);
+  int numEdges = 0;
+
+  for (int i = 0; i < ac->numNodes; i++) {
+    position[i] = -1;
+  }
+  for (int n = 0; n < numNodes; n++) {
+    position[order[n]] = n;
+    numEdges += ac->childStart[order[n]+1] - ac->childStart[order[n]];
+  }
+
+  copy->childIndex = (int*)realloc(copy->childIndex, sizeof(int) * (numEdges + 1));
+  for (int n = 0; n < numNodes; n++) {
+    int i = order[n];
+    copy->nodeType[n] = ac->nodeType[i];
+    copy->varIndex[n] = ac->varIndex[i];
+    copy->varValue[n] = ac->varValue[i];
+    copy->vr[n] = ac->vr[i];
+    for (int e = ac->childStart[i]; e < ac->childStart[i+1]; e++) {
+      copy->childIndex[copy->numEdges++] = position[ac->childIndex[e]];
+    }
+    copy->childStart[n+1] = copy->numEdges;
+  }
+  copy->numNodes = numNodes;
+  copy->numVars = ac->numVars;
+  copy->varCard = (int*)malloc(sizeof(int) * (ac->numVars + 1));
+  if (ac->numVars > 0) {
+    memcpy(copy->varCard, ac->varCard, sizeof(int) * ac->numVars);
+  }
+  return copy;
+}
+
+/*
+ * Number of product register slots of a compiled circuit
+ */
+int ac_register_count(const struct circuit *ac) {
+  int total = 0;
+  for (int i = 0; i < ac->numNodes; i++) {
+    if (ac->nodeType[i] == '*') {
+      total += 2 * (ac->childStart[i+1] - ac->childStart[i] + 1);
+    }
+  }
+  return total;
+}
+
+/*
+ * Select the derivative engine (AC_ENGINE_*) of a compiled circuit.
+ * The product register arena is only kept for the engines that use it.
+ */
+void ac_set_engine(struct circuit *ac, int engine) {
+  if (engine == AC_ENGINE_BIT) {
+    free(ac->pr);
+    ac->pr = NULL;
+  }
+  else if (ac->pr == NULL) {
+    ac->pr = (double*)calloc(ac_register_count(ac) + 1, sizeof(double));
+  }
+  ac->engine = engine;
+}
+
+/*
+ * Group the indicator leaves by variable so evidence can be set per variable
+ */
+static void index_variables(struct circuit *ac) {
+  /*Tolerate indicators of variables missing from the header*/
+  int numVars = ac->numVars;
+  for (int i = 0; i < ac->numNodes; i++) {
+    if (ac->varIndex[i] >= numVars) {
+      numVars = ac->varIndex[i] + 1;
+    }
+  }
+  if (numVars > ac->numVars) {
+    ac->varCard = (int*)realloc(ac->varCard, sizeof(int) * numVars);
+    for (int x = ac->numVars; x < numVars; x++) {
+      ac->varCard[x] = 0;
+    }
+    ac->numVars = numVars;
+  }
+
+  ac->varLeafStart = (int*)calloc(numVars + 1, sizeof(int));
+  for (int i = 0; i < ac->numNodes; i++) {
+    if (ac->varIndex[i] >= 0) {
+      ac->varLeafStart[ac->varIndex[i] + 1]++;
+    }
+  }
+  for (int x = 0; x < numVars; x++) {
+    ac->varLeafStart[x + 1] += ac->varLeafStart[x];
+  }
+
+  int *fill = (int*)malloc(sizeof(int) * (numVars + 1));
+  memcpy(fill, ac->varLeafStart, sizeof(int) * (numVars + 1));
+  ac->varLeaf = (int*)malloc(sizeof(int) * (ac->varLeafStart[numVars] + 1));
+  for (int i = 0; i < ac->numNodes; i++) {
+    if (ac->varIndex[i] >= 0) {
+      ac->varLeaf[fill[ac->varIndex[i]]++] = i;
+      if (ac->varCard[ac->varIndex[i]] <= ac->varValue[i]) {
+	ac->varCard[ac->varIndex[i]] = ac->varValue[i] + 1;
+      }
+    }
+  }
+  free(fill);
+}
+
+/*
+ * Lay out the product registers of every '*' node in a single arena,
+ * so evaluation never allocates
+ */
+static void allocate_registers(struct circuit *ac) {
+  int total = 0;
+
+  ac->prStart = (int*)malloc(sizeof(int) * ac->numNodes);
+  for (int i = 0; i < ac->numNodes; i++) {
+    if (ac->nodeType[i] == '*') {
+      ac->prStart[i] = total;
+      total += 2 * (ac->childStart[i+1] - ac->childStart[i] + 1);
+    }
+    else {
+      ac->prStart[i] = -1;
+    }
+  }
+  ac->pr = (double*)calloc(total + 1, sizeof(double));
+}
+
+/*
+ * Build the parent adjacency (transpose of the child CSR arrays)
+ */
+static void compute_parents(struct circuit *ac) {
+  ac->parentStart = (int*)calloc(ac->numNodes + 1, sizeof(int));
+  ac->parentIndex = (int*)malloc(sizeof(int) * (ac->numEdges + 1));
+  ac->parentPos = (int*)malloc(sizeof(int) * (ac->numEdges + 1));
+
+  for (int e = 0; e < ac->numEdges; e++) {
+    ac->parentStart[ac->childIndex[e] + 1]++;
+  }
+  for (int i = 0; i < ac->numNodes; i++) {
+    ac->parentStart[i + 1] += ac->parentStart[i];
+  }
+  int *fill = (int*)malloc(sizeof(int) * (ac->numNodes + 1));
+  memcpy(fill, ac->parentStart, sizeof(int) * (ac->numNodes + 1));
+  for (int i = 0; i < ac->numNodes; i++) {
+    for (int e = ac->childStart[i]; e < ac->childStart[i+1]; e++) {
+      int slot = fill[ac->childIndex[e]]++;
+      ac->parentIndex[slot] = i;
+      ac->parentPos[slot] = e - ac->childStart[i];
+    }
+  }
+  free(fill);
+}
+
+/*
+ * Partition the nodes into topological levels (depth above the leaves)
+ */
+static void compute_levels(struct circuit *ac) {
+  int *level = (int*)malloc(sizeof(int) * ac->numNodes);
+  int numLevels = 1;
+
+  for (int i = 0; i < ac->numNodes; i++) {
+    level[i] = 0;
+    for (int e = ac->childStart[i]; e < ac->childStart[i+1]; e++) {
+      if (level[ac->childIndex[e]] + 1 > level[i]) {
+	level[i] = level[ac->childIndex[e]] + 1;
+      }
+    }
+    if (level[i] + 1 > numLevels) {
+      numLevels = level[i] + 1;
+    }
+  }
+
+  /*Counting sort by level keeps file order within a level*/
+  ac->numLevels = numLevels;
+  ac->levelStart = (int*)calloc(numLevels + 1, sizeof(int));
+  ac->levelNode = (int*)malloc(sizeof(int) * ac->numNodes);
+  for (int i = 0; i < ac->numNodes; i++) {
+    ac->levelStart[level[i] + 1]++;
+  }
+  for (int l = 0; l < numLevels; l++) {
+    ac->levelStart[l + 1] += ac->levelStart[l];
+  }
+  int *fill = (int*)malloc(sizeof(int) * numLevels);
+  memcpy(fill, ac->levelStart, sizeof(int) * numLevels);
+  for (int i = 0; i < ac->numNodes; i++) {
+    ac->levelNode[fill[level[i]]++] = i;
+  }
+  free(fill);
+  free(level);
+}
+
+/*
+ * Compile a parsed circuit: index the variables and build the product
+ * register arena, the parent adjacency and the topological levels
+ */
+void ac_compile(struct circuit *ac) {
+  index_variables(ac);
+  allocate_registers(ac);
+  compute_parents(ac);
+  compute_levels(ac);
+}
+
+/*
+ * Set the indicator leaves from an evidence assignment.
+ * evidence[x] is the observed value of variable x, or -1 if x is unobserved.
+ * A NULL assignment restores the indicator values written in the file.
+ */
+void ac_set_evidence(struct circuit *ac, const int *evidence) {
+  for (int x = 0; x < ac->numVars; x++) {
+    for (int l = ac->varLeafStart[x]; l < ac->varLeafStart[x+1]; l++) {
+      int leaf = ac->varLeaf[l];
+      if (evidence == NULL) {
+	ac->vr[leaf] = ac->varValue[leaf];
+      }
+      else {
+	ac->vr[leaf] = (evidence[x] < 0 || evidence[x] == ac->varValue[leaf]);
+      }
+    }
+  }
+}
+
+/*
+ * Parse one evidence assignment from a line of text.
+ * The line holds exactly one comma separated value per variable, either
+ * a value below the variable's cardinality or '*' for an unobserved
+ * variable. Returns 1 if an assignment was read, 0 for a blank line and
+ * -1 if the line is not a valid assignment.
+ */
+int ac_parse_evidence(const char *line, const struct circuit *ac, int *evidence) {
+  const char *valueList = line;
+  int x = 0;
+
+  while (isspace((unsigned char)*valueList)) {
+    valueList++;
+  }
+  if (*valueList == '\0') {
+    return 0;
+  }
+
+  while (true) {
+    while (*valueList == ' ' || *valueList == '\t') {
+      valueList++;
+    }
+    if (x == ac->numVars) {
+      return -1;
+    }
+    if (*valueList == '*') {
+      evidence[x++] = -1;
+      valueList++;
+    }
+    else {
+      char *end;
+      long value = strtol(valueList, &end, 10);
+      if (end == valueList || value < 0 || value >= ac->varCard[x]) {
+	return -1;
+      }
+      evidence[x++] = (int)value;
+      valueList = end;
+    }
+    while (*valueList == ' ' || *valueList == '\t') {
+      valueList++;
+    }
+    if (*valueList != ',') {
+      break;
+    }
+    valueList++;
+  }
+
+  while (isspace((unsigned char)*valueList)) {
+    valueList++;
+  }
+  return (*valueList == '\0' && x == ac->numVars) ? 1 : -1;
+}
+
+/*
+ * Read one evidence assignment from an evidence file, one line per
+ * assignment as for ac_parse_evidence; blank lines are skipped.
+ * Returns 1 if an assignment was read, 0 at end of file and -1 after
+ * reporting a line that is not a valid assignment.
+ */
+int ac_read_evidence(FILE *ev_file, const struct circuit *ac, int *evidence) {
+  char *line = NULL;
+  size_t capacity = 0;
+
+  while (getline(&line, &capacity, ev_file) != -1) {
+    int status = ac_parse_evidence(line, ac, evidence);
+    if (status < 0) {
+      fprintf(stderr, "Invalid evidence, need %d values each below its cardinality or '*': %s",
+	      ac->numVars, line);
+    }
+    if (status != 0) {
+      free(line);
+      return status;
+    }
+  }
+  free(line);
+  return 0;
+}
+
+/*
+ * Function to free the compiled circuit
+ */
+int ac_free(struct circuit *ac) {
+  if (ac == NULL) {
+    printf("Circuit is empty!\n");
+    return (EXIT_FAILURE);
+  }
+  if (ac->mapping != NULL) {
+    ac_unmap_binary(ac);
+    return (EXIT_SUCCESS);
+  }
+  free(ac->pr);
+  free(ac->prStart);
+  free(ac->levelNode);
+  free(ac->levelStart);
+  free(ac->varLeaf);
+  free(ac->varLeafStart);
+  free(ac->parentPos);
+  free(ac->parentIndex);
+  free(ac->parentStart);
+  free(ac->childIndex);
+  free(ac->childStart);
+  free(ac->flag);
+  free(ac->dr);
+  free(ac->vr);
+  free(ac->varValue);
+  free(ac->varIndex);
+  free(ac->nodeType);
+  free(ac->varCard);
+  free(ac);
+  return (EXIT_SUCCESS);
+}
@@ -0,0 +1,374 @@
+/*
+ * File:   ac_codegen.c
+ * Author: andrewchoi
+ *
+ * Code generation for a single circuit. ac_codegen writes a C file with
+ * the upward and downward pass of one compiled circuit as straight-line
+ * code: every node is one statement with its child indices fixed and the
+ * constants written in as literals, so the passes need no child lists,
+ * no type dispatch and no product registers. The file defines
+ *   void <prefix>_forward(double *vr)
+ *   void <prefix>_backward(const double *vr, double *dr)
+ *   const int <prefix>_num_nodes, <prefix>_num_edges
+ * vr and dr are indexed like the circuit's; the indicator values must be
+ * in vr (ac_set_evidence) before the upward pass, which writes every '+'
+ * and '*' node. The downward pass writes every derivative except those
+ * of the constants. The products are taken in the order of the cache
+ * engine, so without -ffast-math the results are exactly its results.
+ * A '*' node with a zero constant child is 0 and passes no derivatives.
+ *
+ * The statements are split into functions of about CHUNK_EDGES child
+ * references, which keeps the compiler's time and memory in check on
+ * large circuits. Compiled as a shared object, the code is loaded with
+ * ac_code_load.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <math.h>
+#include <dlfcn.h>
+
+#include "ac.h"
+
+#define CHUNK_EDGES 512 //Child references per generated function
+#define MAX_SYMBOL_LENGTH 256
+
+/*
+ * A prefix must make valid C identifiers
+ */
+static bool valid_prefix(const char *prefix) {
+  if (prefix[0] == '\0' || isdigit((unsigned char)prefix[0])
+      || strlen(prefix) > MAX_SYMBOL_LENGTH - 16) {
+    return false;
+  }
+  for (const char *p = prefix; *p != '\0'; p++) {
+    if (!isalnum((unsigned char)*p) && *p != '_') {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * Write the value of node c: vr[c], or the literal of a constant
+ */
+static void write_value(FILE *out, const struct circuit *ac, int c) {
+  double x = ac->vr[c];
+
+  if (ac->nodeType[c] != 'n') {
+    fprintf(out, "vr[%d]", c);
+  }
+  else if (isnan(x)) {
+    fprintf(out, "NAN");
+  }
+  else if (isinf(x)) {
+    fprintf(out, (x > 0) ? "INFINITY" : "-INFINITY");
+  }
+  else {
+    /*17 significant digits read back as the same double*/
+    fprintf(out, (x < 0) ? "(%.17g)" : "%.17g", x);
+  }
+}
+
+static bool has_zero_constant(const struct circuit *ac, int i) {
+  for (int e = ac->childStart[i]; e < ac->childStart[i+1]; e++) {
+    int c = ac->childIndex[e];
+    if (ac->nodeType[c] == 'n' && ac->vr[c] == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * Upward statement of operation node i
+ */
+static void write_forward_node(FILE *out, const struct circuit *ac, int i) {
+  int start = ac->childStart[i];
+  int end = ac->childStart[i+1];
+  bool product = (ac->nodeType[i] == '*');
+
+  fprintf(out, "  vr[%d] = ", i);
+  if (start == end || (product && has_zero_constant(ac, i))) {
+    fprintf(out, (product && start == end) ? "1;\n" : "0;\n");
+    return;
+  }
+  for (int e = start; e < end; e++) {
+    if (e > start) {
+      fprintf(out, product ? " * " : " + ");
+    }
+    write_value(out, ac, ac->childIndex[e]);
+  }
+  fprintf(out, ";\n");
+}
+
+/*
+ * Add 'd' times the rest of a derivative expression to dr[c]; the first
+ * contribution to a node assigns instead of adding
+ */
+static void begin_contribution(FILE *out, int c, bool *assigned, const char *indent) {
+  fprintf(out, "%sdr[%d] %s d", indent, c, assigned[c] ? "+=" : "=");
+  assigned[c] = true;
+}
+
+/*
+ * Downward statements of operation node i. A '*' node with w children
+ * gives child pos (from 1) d * prR[w-pos] * prL[pos-1], with the left
+ * products l1 .. l(w-1) and the right products r1 .. r(w-1) kept in
+ * locals as far as a non-constant child reads them; l1 and r1 are the
+ * first and the last child.
+ */
+static void write_backward_node(FILE *out, const struct circuit *ac, int i, bool *assigned) {
+  int start = ac->childStart[i];
+  int end = ac->childStart[i+1];
+  int w = end - start;
+  int maxLeft = 0;
+  int maxRight = -1;
+
+  fprintf(out, "  d = dr[%d];\n", i);
+  if (ac->nodeType[i] == '+') {
+    for (int e = start; e < end; e++) {
+      int c = ac->childIndex[e];
+      if (ac->nodeType[c] != 'n') {
+	begin_contribution(out, c, assigned, "  ");
+	fprintf(out, ";\n");
+      }
+    }
+    return;
+  }
+
+  /*Constant children get no derivative, so the products only they
+    would read are left out*/
+  for (int pos = 1; pos <= w; pos++) {
+    if (ac->nodeType[ac->childIndex[start + pos - 1]] != 'n') {
+      maxLeft = pos - 1;
+      maxRight = (maxRight < 0) ? w - pos : maxRight;
+    }
+  }
+  if (w > 2) {
+    fprintf(out, "  {\n");
+    for (int k = 2; k <= maxLeft; k++) {
+      fprintf(out, "    double l%d = ", k);
+      if (k == 2) {
+	write_value(out, ac, ac->childIndex[start]);
+      }
+      else {
+	fprintf(out, "l%d", k - 1);
+      }
+      fprintf(out, " * ");
+      write_value(out, ac, ac->childIndex[start + k - 1]);
+      fprintf(out, ";\n");
+    }
+  }
+  for (int pos = w; pos >= 1; pos--) {
+    int c = ac->childIndex[start + pos - 1];
+    int right = w - pos;
+    int left = pos - 1;
+    const char *indent = (w > 2) ? "    " : "  ";
+    /*prR[k] = child w-k times prR[k-1], needed from k = 2 on*/
+    if (right >= 2 && right <= maxRight && w > 2) {
+      fprintf(out, "%sdouble r%d = ", indent, right);
+      write_value(out, ac, ac->childIndex[start + w - right]);
+      if (right == 2) {
+	fprintf(out, " * ");
+	write_value(out, ac, ac->childIndex[end - 1]);
+      }
+      else {
+	fprintf(out, " * r%d", right - 1);
+      }
+      fprintf(out, ";\n");
+    }
+    if (ac->nodeType[c] == 'n') {
+      continue;
+    }
+    begin_contribution(out, c, assigned, indent);
+    if (right == 1) {
+      fprintf(out, " * ");
+      write_value(out, ac, ac->childIndex[end - 1]);
+    }
+    else if (right > 1) {
+      fprintf(out, " * r%d", right);
+    }
+    if (left == 1) {
+      fprintf(out, " * ");
+      write_value(out, ac, ac->childIndex[start]);
+    }
+    else if (left > 1) {
+      fprintf(out, " * l%d", left);
+    }
+    fprintf(out, ";\n");
+  }
+  if (w > 2) {
+    fprintf(out, "  }\n");
+  }
+}
+
+/*
+ * Write the generated passes of a compiled circuit to 'filename', with
+ * function names starting with 'prefix'
+ */
+int ac_codegen(const struct circuit *ac, const char *prefix, const char *filename) {
+  FILE *out;
+  bool *assigned;
+  int root = ac->numNodes - 1;
+  int numChunks = 0;
+  int chunkEdges = 0;
+
+  if (!valid_prefix(prefix)) {
+    fprintf(stderr, "Invalid function prefix %s\n", prefix);
+    return (EXIT_FAILURE);
+  }
+  out = fopen(filename, "w");
+  if (!out) {
+    fprintf(stderr, "Unable to write file %s\n", filename);
+    return (EXIT_FAILURE);
+  }
+
+  fprintf(out, "/* Generated by ac: %d nodes, %d edges, %d variables.\n"
+	  "   Compile without -ffast-math to keep the order of the products. */\n\n"
+	  "#include <math.h>\n\n"
+	  "const int %s_num_nodes = %d;\n"
+	  "const int %s_num_edges = %d;\n\n",
+	  ac->numNodes, ac->numEdges, ac->numVars, prefix, ac->numNodes, prefix, ac->numEdges);
+
+  /*Upward pass, in index order*/
+  for (int i = 0; i < ac->numNodes; i++) {
+    if (ac->nodeType[i] != '+' && ac->nodeType[i] != '*') {
+      continue;
+    }
+    if (chunkEdges == 0) {
+      fprintf(out, "static void forward_%d(double *vr) {\n", numChunks);
+    }
+    write_forward_node(out, ac, i);
+    chunkEdges += ac->childStart[i+1] - ac->childStart[i] + 1;
+    if (chunkEdges >= CHUNK_EDGES) {
+      fprintf(out, "}\n\n");
+      numChunks++;
+      chunkEdges = 0;
+    }
+  }
+  if (chunkEdges > 0) {
+    fprintf(out, "}\n\n");
+    numChunks++;
+  }
+  fprintf(out, "void %s_forward(double *vr) {\n", prefix);
+  for (int k = 0; k < numChunks; k++) {
+    fprintf(out, "  forward_%d(vr);\n", k);
+  }
+  fprintf(out, "}\n\n");
+
+  /*Downward pass, in reverse index order. A node nothing was assigned to
+    by the time it is reached has no parents on a path from the root.*/
+  assigned = (bool*)calloc(ac->numNodes, sizeof(bool));
+  assigned[root] = true;
+  numChunks = 0;
+  chunkEdges = 0;
+  for (int i = root; i >= 0; i--) {
+    if (ac->nodeType[i] == 'n') {
+      continue;
+    }
+    if (chunkEdges == 0) {
+      fprintf(out, "static void backward_%d(const double *vr, double *dr) {\n"
+	      "  double d;\n", numChunks);
+      if (i == root) {
+	fprintf(out, "  dr[%d] = 1;\n", root);
+      }
+    }
+    chunkEdges++;
+    if (!assigned[i]) {
+      fprintf(out, "  dr[%d] = 0;\n", i);
+      assigned[i] = true;
+    }
+    else if ((ac->nodeType[i] == '+' || ac->nodeType[i] == '*')
+	     && !(ac->nodeType[i] == '*' && has_zero_constant(ac, i))) {
+      write_backward_node(out, ac, i, assigned);
+      chunkEdges += ac->childStart[i+1] - ac->childStart[i];
+    }
+    if (chunkEdges >= CHUNK_EDGES) {
+      fprintf(out, "  (void)vr;\n  (void)d;\n}\n\n");
+      numChunks++;
+      chunkEdges = 0;
+    }
+  }
+  if (chunkEdges > 0) {
+    fprintf(out, "  (void)vr;\n  (void)d;\n}\n\n");
+    numChunks++;
+  }
+  fprintf(out, "void %s_backward(const double *vr, double *dr) {\n", prefix);
+  for (int k = 0; k < numChunks; k++) {
+    fprintf(out, "  backward_%d(vr, dr);\n", k);
+  }
+  fprintf(out, "}\n");
+  free(assigned);
+
+  if (fclose(out) != 0) {
+    fprintf(stderr, "Unable to write file %s\n", filename);
+    return (EXIT_FAILURE);
+  }
+  return (EXIT_SUCCESS);
+}
+
+/*
+ * Load the passes generated for 'ac' with 'prefix' from the shared
+ * object 'library'. Returns NULL if the library can not be loaded or was
+ * generated for a circuit of another size.
+ */
+struct circuit_code* ac_code_load(const char *library, const char *prefix, const struct circuit *ac) {
+  struct circuit_code *code;
+  char symbol[MAX_SYMBOL_LENGTH];
+  const int *numNodes, *numEdges;
+  void *handle;
+
+  if (!valid_prefix(prefix)) {
+    fprintf(stderr, "Invalid function prefix %s\n", prefix);
+    return (NULL);
+  }
+  handle = dlopen(library, RTLD_NOW | RTLD_LOCAL);
+  if (handle == NULL) {
+    fprintf(stderr, "Unable to load %s: %s\n", library, dlerror());
+    return (NULL);
+  }
+
+  code = (struct circuit_code*)malloc(sizeof(struct circuit_code));
+  code->library = handle;
+  snprintf(symbol, sizeof(symbol), "%s_num_nodes", prefix);
+  numNodes = (const int*)dlsym(handle, symbol);
+  snprintf(symbol, sizeof(symbol), "%s_num_edges", prefix);
+  numEdges = (const int*)dlsym(handle, symbol);
+  snprintf(symbol, sizeof(symbol), "%s_forward", prefix);
+  *(void**)&code->forward = dlsym(handle, symbol);
+  snprintf(symbol, sizeof(symbol), "%s_backward", prefix);
+  *(void**)&code->backward = dlsym(handle, symbol);
+
+  if (numNodes == NULL || numEdges == NULL || code->forward == NULL || code->backward == NULL) {
+    fprintf(stderr, "%s has no passes named %s_*\n", library, prefix);
+    ac_code_free(code);
+    return (NULL);
+  }
+  if (*numNodes != ac->numNodes || *numEdges != ac->numEdges) {
+    fprintf(stderr, "%s was generated for %d nodes and %d edges, the circuit has %d and %d\n",
+	    library, *numNodes, *numEdges, ac->numNodes, ac->numEdges);
+    ac_code_free(code);
+    return (NULL);
+  }
+  return code;
+}
+
+/*
+ * Upward and downward pass of a circuit with its generated code
+ */
+void ac_code_forward(const struct circuit_code *code, struct circuit *ac) {
+  code->forward(ac->vr);
+}
+
+void ac_code_backward(const struct circuit_code *code, struct circuit *ac) {
+  code->backward(ac->vr, ac->dr);
+}
+
+void ac_code_free(struct circuit_code *code) {
+  dlclose(code->library);
+  free(code);
+}
@@ -0,0 +1,426 @@
+/*
+ * File:   ac_dataflow.c
+ * Author: andrewchoi
+ *
+ * Dataflow schedule for the thread pool (AC_SCHEDULE_DATAFLOW). Instead
+ * of a barrier after every level, the nodes are grouped into tasks and a
+ * task runs as soon as the tasks it reads from are done, so a long thin
+ * chain does not hold up the workers busy with a wide part of the
+ * circuit, and the reverse. Tasks are built at pool creation:
+ *   - every level is cut into up to TASKS_PER_THREAD slices per worker of
+ *     at least GRAIN_NODES nodes
+ *   - a task whose only input is a task that feeds nothing else is merged
+ *     into it, which turns a chain of one-node levels into one task
+ * Every task has an atomic counter of the tasks it still waits for; the
+ * task that brings it to 0 pushes it onto its worker's deque. A worker
+ * takes its own newest task, or steals the oldest one of another worker
+ * (Chase-Lev deques), and yields when there is nothing to steal.
+ * The downward pass runs over the reversed task graph, pulling or
+ * scattering into per-worker rows like the level schedule. The rows a
+ * contribution lands in depend on which worker ran the task, so scattered
+ * derivatives can differ between runs in the last bits; pulled ones do
+ * not.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <sched.h>
+
+#include "ac.h"
+
+#define GRAIN_NODES 64 //Smallest slice of a level that gets its own task
+#define TASKS_PER_THREAD 4 //Slices per worker of a wide level
+
+/* Work-stealing deque of one worker. Every task is pushed at most once
+   per pass and top and bottom start at 0, so a buffer of numTasks slots
+   never wraps onto a live task. */
+struct task_deque {
+  atomic_long top;
+  atomic_long bottom;
+  atomic_int *buffer;
+  long mask;
+  /*Keep the deques of different workers on different cache lines*/
+  char padding[64];
+};
+
+struct dataflow {
+  int numTasks;
+  int numWorkers;
+  /*Nodes of task t, children before parents: taskNode[taskStart[t]] up
+    to taskNode[taskStart[t+1] - 1]*/
+  int *taskStart;
+  int *taskNode;
+  /*Tasks reading from task t (succ) and tasks task t reads from (pred)*/
+  int *succStart;
+  int *succ;
+  int *predStart;
+  int *pred;
+  /*Tasks each task still waits for in the current pass*/
+  atomic_int *pending;
+  atomic_int done;
+  struct task_deque *deques;
+};
+
+/*
+ * Deque operations (Le, Pop, Cohen and Zappa Nardelli 2013)
+ */
+static void deque_push(struct task_deque *q, int task) {
+  long b = atomic_load_explicit(&q->bottom, memory_order_relaxed);
+  atomic_store_explicit(&q->buffer[b & q->mask], task, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+}
+
+static int deque_take(struct task_deque *q) {
+  long b = atomic_load_explicit(&q->bottom, memory_order_relaxed) - 1;
+  long t;
+  int task = -1;
+
+  atomic_store_explicit(&q->bottom, b, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  t = atomic_load_explicit(&q->top, memory_order_relaxed);
+  if (t <= b) {
+    task = atomic_load_explicit(&q->buffer[b & q->mask], memory_order_relaxed);
+    if (t == b) {
+      /*Last task, race the thieves for it*/
+      if (!atomic_compare_exchange_strong_explicit(&q->top, &t, t + 1, memory_order_seq_cst,
+						   memory_order_relaxed)) {
+	task = -1;
+      }
+      atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+    }
+  }
+  else {
+    atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+  }
+  return task;
+}
+
+static int deque_steal(struct task_deque *q) {
+  long t = atomic_load_explicit(&q->top, memory_order_acquire);
+  long b;
+  int task;
+
+  atomic_thread_fence(memory_order_seq_cst);
+  b = atomic_load_explicit(&q->bottom, memory_order_acquire);
+  if (t >= b) {
+    return -1;
+  }
+  task = atomic_load_explicit(&q->buffer[t & q->mask], memory_order_relaxed);
+  if (!atomic_compare_exchange_strong_explicit(&q->top, &t, t + 1, memory_order_seq_cst,
+					       memory_order_relaxed)) {
+    return -1;
+  }
+  return task;
+}
+
+/*
+ * Inputs of every task of 'nodeTask' as CSR: the distinct tasks holding a
+ * child of one of its nodes. The nodes of task t are listed by
+ * taskNode/taskStart.
+ */
+static void task_inputs(const struct circuit *ac, const int *nodeTask, int numTasks,
+			const int *taskStart, const int *taskNode, int **predStart, int **pred) {
+  int *mark = (int*)malloc(sizeof(int) * numTasks);
+  int capacity = numTasks + 16;
+  int count = 0;
+
+  *predStart = (int*)malloc(sizeof(int) * (numTasks + 1));
+  *pred = (int*)malloc(sizeof(int) * capacity);
+  for (int t = 0; t < numTasks; t++) {
+    mark[t] = -1;
+  }
+  for (int t = 0; t < numTasks; t++) {
+    (*predStart)[t] = count;
+    mark[t] = t;
+    for (int n = taskStart[t]; n < taskStart[t+1]; n++) {
+      int i = taskNode[n];
+      for (int e = ac->childStart[i]; e < ac->childStart[i+1]; e++) {
+	int p = nodeTask[ac->childIndex[e]];
+	if (mark[p] != t) {
+	  mark[p] = t;
+	  if (count == capacity) {
+	    capacity *= 2;
+	    *pred = (int*)realloc(*pred, sizeof(int) * capacity);
+	  }
+	  (*pred)[count++] = p;
+	}
+      }
+    }
+  }
+  (*predStart)[numTasks] = count;
+  free(mark);
+}
+
+/*
+ * Reverse a task graph given as inputs into the outputs of every task
+ */
+static void task_outputs(int numTasks, const int *predStart, const int *pred,
+			 int **succStart, int **succ) {
+  int *fill = (int*)calloc(numTasks + 1, sizeof(int));
+
+  *succStart = (int*)calloc(numTasks + 1, sizeof(int));
+  *succ = (int*)malloc(sizeof(int) * (predStart[numTasks] + 1));
+  for (int k = 0; k < predStart[numTasks]; k++) {
+    (*succStart)[pred[k] + 1]++;
+  }
+  for (int t = 0; t < numTasks; t++) {
+    (*succStart)[t+1] += (*succStart)[t];
+  }
+  for (int t = 0; t < numTasks; t++) {
+    for (int k = predStart[t]; k < predStart[t+1]; k++) {
+      int p = pred[k];
+      (*succ)[(*succStart)[p] + fill[p]++] = t;
+    }
+  }
+  free(fill);
+}
+
+/*
+ * Group the nodes of a compiled circuit into tasks for 'numThreads'
+ * workers
+ */
+struct dataflow* dataflow_create(const struct circuit *ac, int numThreads) {
+  struct dataflow *flow = (struct dataflow*)malloc(sizeof(struct dataflow));
+  int maxSlices = TASKS_PER_THREAD * numThreads;
+  int *nodeTask = (int*)calloc(ac->numNodes, sizeof(int));
+  int *sliceStart = (int*)malloc(sizeof(int) * (ac->numNodes + 1));
+  int *slicePred, *slicePredStart, *sliceSucc, *sliceSuccStart;
+  int *group, *groupSize;
+  int numSlices = 0;
+  long capacity;
+
+  /*Slices of the levels, in level order*/
+  for (int l = 0; l < ac->numLevels; l++) {
+    int levelSize = ac->levelStart[l+1] - ac->levelStart[l];
+    int parts = levelSize / GRAIN_NODES;
+    if (parts > maxSlices) {
+      parts = maxSlices;
+    }
+    if (parts < 1) {
+      parts = 1;
+    }
+    for (int s = 0; s < parts; s++) {
+      int end = ac->levelStart[l] + (int)((long)(s + 1) * levelSize / parts);
+      sliceStart[numSlices] = ac->levelStart[l] + (int)((long)s * levelSize / parts);
+      for (int n = sliceStart[numSlices]; n < end; n++) {
+	nodeTask[ac->levelNode[n]] = numSlices;
+      }
+      numSlices++;
+    }
+  }
+  sliceStart[numSlices] = ac->numNodes;
+  task_inputs(ac, nodeTask, numSlices, sliceStart, ac->levelNode, &slicePredStart, &slicePred);
+  task_outputs(numSlices, slicePredStart, slicePred, &sliceSuccStart, &sliceSucc);
+
+  /*Merge a slice into its only input if that input feeds nothing else*/
+  group = (int*)malloc(sizeof(int) * numSlices);
+  groupSize = (int*)calloc(numSlices + 1, sizeof(int));
+  flow->numTasks = 0;
+  for (int s = 0; s < numSlices; s++) {
+    int p = (slicePredStart[s+1] - slicePredStart[s] == 1) ? slicePred[slicePredStart[s]] : -1;
+    if (p >= 0 && sliceSuccStart[p+1] - sliceSuccStart[p] == 1) {
+      group[s] = group[p];
+    }
+    else {
+      group[s] = flow->numTasks++;
+    }
+    groupSize[group[s] + 1] += sliceStart[s+1] - sliceStart[s];
+  }
+
+  /*Nodes of every task, its slices in level order*/
+  flow->taskStart = (int*)malloc(sizeof(int) * (flow->numTasks + 1));
+  flow->taskNode = (int*)malloc(sizeof(int) * ac->numNodes);
+  flow->taskStart[0] = 0;
+  for (int t = 0; t < flow->numTasks; t++) {
+    flow->taskStart[t+1] = flow->taskStart[t] + groupSize[t+1];
+    groupSize[t+1] = flow->taskStart[t];
+  }
+  for (int s = 0; s < numSlices; s++) {
+    for (int n = sliceStart[s]; n < sliceStart[s+1]; n++) {
+      int i = ac->levelNode[n];
+      nodeTask[i] = group[s];
+      flow->taskNode[groupSize[group[s] + 1]++] = i;
+    }
+  }
+  task_inputs(ac, nodeTask, flow->numTasks, flow->taskStart, flow->taskNode,
+	      &flow->predStart, &flow->pred);
+  task_outputs(flow->numTasks, flow->predStart, flow->pred, &flow->succStart, &flow->succ);
+
+  flow->numWorkers = numThreads;
+  flow->pending = (atomic_int*)malloc(sizeof(atomic_int) * flow->numTasks);
+  flow->deques = (struct task_deque*)malloc(sizeof(struct task_deque) * numThreads);
+  capacity = 1;
+  while (capacity < flow->numTasks) {
+    capacity *= 2;
+  }
+  for (int w = 0; w < numThreads; w++) {
+    atomic_init(&flow->deques[w].top, 0);
+    atomic_init(&flow->deques[w].bottom, 0);
+    flow->deques[w].buffer = (atomic_int*)malloc(sizeof(atomic_int) * capacity);
+    flow->deques[w].mask = capacity - 1;
+  }
+  atomic_init(&flow->done, 0);
+
+  free(groupSize);
+  free(group);
+  free(sliceSucc);
+  free(sliceSuccStart);
+  free(slicePred);
+  free(slicePredStart);
+  free(sliceStart);
+  free(nodeTask);
+  return flow;
+}
+
+int dataflow_task_count(const struct dataflow *flow) {
+  return flow->numTasks;
+}
+
+/*
+ * Reset the counters of worker 'id''s share of the tasks and queue those
+ * that wait for nothing. The caller must synchronize the workers before
+ * the tasks run.
+ */
+static void prepare_pass(struct dataflow *flow, int id, bool backward) {
+  struct task_deque *own = &flow->deques[id];
+  const int *waitStart = backward ? flow->succStart : flow->predStart;
+
+  atomic_store_explicit(&own->top, 0, memory_order_relaxed);
+  atomic_store_explicit(&own->bottom, 0, memory_order_relaxed);
+  if (id == 0) {
+    atomic_store_explicit(&flow->done, 0, memory_order_relaxed);
+  }
+  for (int t = id; t < flow->numTasks; t += flow->numWorkers) {
+    int waits = waitStart[t+1] - waitStart[t];
+    atomic_store_explicit(&flow->pending[t], waits, memory_order_relaxed);
+    if (waits == 0) {
+      deque_push(own, t);
+    }
+  }
+}
+
+/*
+ * Run the nodes of task t for one pass
+ */
+static void run_nodes(struct thread_pool *pool, int id, int t, bool backward) {
+  const struct dataflow *flow = pool->dataflow;
+  struct circuit *ac = pool->ac;
+  int first = flow->taskStart[t];
+  int last = flow->taskStart[t+1];
+
+  if (!backward) {
+    for (int n = first; n < last; n++) {
+      if (ac->engine == AC_ENGINE_BIT) {
+	bit_forward_node(ac, flow->taskNode[n]);
+      }
+      else {
+	cache_forward_node(ac, flow->taskNode[n]);
+      }
+    }
+  }
+  else if (ac->engine == AC_ENGINE_PULL) {
+    int root = ac->numNodes - 1;
+    for (int n = last - 1; n >= first; n--) {
+      int i = flow->taskNode[n];
+      ac->dr[i] = (i == root) ? 1 : pull_backward_node(ac, i);
+    }
+  }
+  else {
+    size_t numNodes = ac->numNodes;
+    double *myDr = pool->threadDr + id * numNodes;
+    for (int n = last - 1; n >= first; n--) {
+      /*Every parent's task is done, so the node's rows are final*/
+      int i = flow->taskNode[n];
+      double parentdr = 0;
+      for (int w = 0; w < pool->numThreads; w++) {
+	parentdr += pool->threadDr[w * numNodes + i];
+      }
+      ac->dr[i] = parentdr;
+      if (ac->engine == AC_ENGINE_BIT) {
+	bit_backward_node(ac, i, parentdr, myDr);
+      }
+      else {
+	cache_backward_node(ac, i, parentdr, myDr);
+      }
+    }
+  }
+}
+
+/*
+ * Run tasks until every task of the pass is done
+ */
+static void run_pass(struct thread_pool *pool, int id, bool backward) {
+  struct dataflow *flow = pool->dataflow;
+  struct task_deque *own = &flow->deques[id];
+  const int *nextStart = backward ? flow->predStart : flow->succStart;
+  const int *next = backward ? flow->pred : flow->succ;
+  int victim = id;
+
+  while (atomic_load_explicit(&flow->done, memory_order_acquire) < flow->numTasks) {
+    int t = deque_take(own);
+    for (int tries = 1; t < 0 && tries < flow->numWorkers; tries++) {
+      victim = (victim + 1 == flow->numWorkers) ? 0 : victim + 1;
+      if (victim != id) {
+	t = deque_steal(&flow->deques[victim]);
+      }
+    }
+    if (t < 0) {
+      sched_yield();
+      continue;
+    }
+
+    run_nodes(pool, id, t, backward);
+    for (int k = nextStart[t]; k < nextStart[t+1]; k++) {
+      if (atomic_fetch_sub_explicit(&flow->pending[next[k]], 1, memory_order_acq_rel) == 1) {
+	deque_push(own, next[k]);
+      }
+    }
+    atomic_fetch_add_explicit(&flow->done, 1, memory_order_release);
+  }
+}
+
+/*
+ * Upward pass of worker 'id'
+ */
+void dataflow_forward(struct thread_pool *pool, int id) {
+  prepare_pass(pool->dataflow, id, false);
+  pthread_barrier_wait(&pool->barrier);
+  run_pass(pool, id, false);
+}
+
+/*
+ * Downward pass of worker 'id'
+ */
+void dataflow_backward(struct thread_pool *pool, int id) {
+  struct circuit *ac = pool->ac;
+
+  if (ac->engine != AC_ENGINE_PULL) {
+    size_t numNodes = ac->numNodes;
+    memset(pool->threadDr + id * numNodes, 0, sizeof(double) * numNodes);
+    if (id == 0) {
+      pool->threadDr[numNodes - 1] = 1;
+    }
+  }
+  prepare_pass(pool->dataflow, id, true);
+  pthread_barrier_wait(&pool->barrier);
+  run_pass(pool, id, true);
+}
+
+void dataflow_free(struct dataflow *flow) {
+  for (int w = 0; w < flow->numWorkers; w++) {
+    free(flow->deques[w].buffer);
+  }
+  free(flow->deques);
+  free(flow->pending);
+  free(flow->succ);
+  free(flow->succStart);
+  free(flow->pred);
+  free(flow->predStart);
+  free(flow->taskNode);
+  free(flow->taskStart);
+  free(flow);
+}
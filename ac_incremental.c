@@ -0,0 +1,201 @@
+/*
+ * File:   ac_incremental.c
+ * Author: andrewchoi
+ *
+ * Incremental re-evaluation for queries that differ from the previous one
+ * in a few indicators. The values, derivatives and product registers of
+ * the last query are kept. The upward step recomputes only the ancestors
+ * of changed leaves, in topological (index) order, and stops at nodes whose
+ * value did not change. The downward step then re-pulls the derivative of
+ * every node that has a recomputed '*' parent or a parent whose
+ * derivative changed, in reverse topological order, and again stops where
+ * nothing changed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "ac.h"
+
+/*
+ * Priority queue of node indices. Pops the smallest index in the upward
+ * step and the largest in the downward step.
+ */
+static void heap_push(struct incremental *inc, int node, bool maxFirst) {
+  int pos = inc->heapSize++;
+  int *heap = inc->heap;
+
+  inc->queued[node] = true;
+  while (pos > 0) {
+    int parent = (pos - 1) / 2;
+    if (maxFirst ? heap[parent] >= node : heap[parent] <= node) {
+      break;
+    }
+    heap[pos] = heap[parent];
+    pos = parent;
+  }
+  heap[pos] = node;
+}
+
+static int heap_pop(struct incremental *inc, bool maxFirst) {
+  int *heap = inc->heap;
+  int top = heap[0];
+  int last = heap[--inc->heapSize];
+  int pos = 0;
+
+  while (2 * pos + 1 < inc->heapSize) {
+    int child = 2 * pos + 1;
+    if (child + 1 < inc->heapSize
+	&& (maxFirst ? heap[child + 1] > heap[child] : heap[child + 1] < heap[child])) {
+      child++;
+    }
+    if (maxFirst ? last >= heap[child] : last <= heap[child]) {
+      break;
+    }
+    heap[pos] = heap[child];
+    pos = child;
+  }
+  heap[pos] = last;
+  inc->queued[top] = false;
+  return top;
+}
+
+/*
+ * Queue the parents of a node for the upward step
+ */
+static void queue_parents(struct incremental *inc, int node) {
+  const struct circuit *ac = inc->ac;
+  for (int k = ac->parentStart[node]; k < ac->parentStart[node+1]; k++) {
+    if (!inc->queued[ac->parentIndex[k]]) {
+      heap_push(inc, ac->parentIndex[k], false);
+    }
+  }
+}
+
+/*
+ * Queue the children of a node for the downward step
+ */
+static void queue_children(struct incremental *inc, int node) {
+  const struct circuit *ac = inc->ac;
+  for (int e = ac->childStart[node]; e < ac->childStart[node+1]; e++) {
+    if (!inc->queued[ac->childIndex[e]]) {
+      heap_push(inc, ac->childIndex[e], true);
+    }
+  }
+}
+
+/*
+ * Set up incremental evaluation of a circuit: apply the evidence and run
+ * both full passes once to fill the kept state. A circuit on the
+ * bit-encoded engine is switched to the pull engine.
+ */
+struct incremental* ac_incremental_create(struct circuit *ac, const int *evidence) {
+  struct incremental *inc = (struct incremental*)malloc(sizeof(struct incremental));
+
+  /*Recomputing single nodes needs the product registers*/
+  if (ac->engine == AC_ENGINE_BIT) {
+    ac_set_engine(ac, AC_ENGINE_PULL);
+  }
+  inc->ac = ac;
+  inc->heap = (int*)malloc(sizeof(int) * ac->numNodes);
+  inc->heapSize = 0;
+  inc->queued = (bool*)calloc(ac->numNodes, sizeof(bool));
+  inc->recomputed = (int*)malloc(sizeof(int) * ac->numNodes);
+  inc->numRecomputed = 0;
+  inc->evidence = (int*)malloc(sizeof(int) * (ac->numVars + 1));
+  for (int x = 0; x < ac->numVars; x++) {
+    inc->evidence[x] = (evidence != NULL) ? evidence[x] : -1;
+  }
+
+  ac_set_evidence(ac, inc->evidence);
+  ac_forward(ac);
+  ac_backward(ac);
+  return inc;
+}
+
+/*
+ * Change the observed value of one variable (-1 for unobserved).
+ * The change takes effect with the next ac_incremental_forward.
+ */
+void ac_incremental_set_variable(struct incremental *inc, int var, int value) {
+  struct circuit *ac = inc->ac;
+
+  if (inc->evidence[var] == value) {
+    return;
+  }
+  inc->evidence[var] = value;
+  for (int l = ac->varLeafStart[var]; l < ac->varLeafStart[var+1]; l++) {
+    int leaf = ac->varLeaf[l];
+    double indicator = (value < 0 || value == ac->varValue[leaf]);
+    if (ac->vr[leaf] != indicator) {
+      ac->vr[leaf] = indicator;
+      queue_parents(inc, leaf);
+    }
+  }
+}
+
+/*
+ * Change the whole evidence assignment, touching only the variables
+ * whose value differs from the current assignment
+ */
+void ac_incremental_set_evidence(struct incremental *inc, const int *evidence) {
+  for (int x = 0; x < inc->ac->numVars; x++) {
+    ac_incremental_set_variable(inc, x, evidence[x]);
+  }
+}
+
+/*
+ * Upward step over the ancestors of the changed leaves
+ */
+void ac_incremental_forward(struct incremental *inc) {
+  struct circuit *ac = inc->ac;
+
+  inc->numRecomputed = 0;
+  while (inc->heapSize > 0) {
+    int i = heap_pop(inc, false);
+    double old = ac->vr[i];
+
+    cache_forward_node(ac, i);
+    inc->recomputed[inc->numRecomputed++] = i;
+    if (ac->vr[i] != old) {
+      queue_parents(inc, i);
+    }
+  }
+}
+
+/*
+ * Downward step after ac_incremental_forward. A '*' node that was
+ * recomputed changes the sibling products of all its children; a node
+ * whose derivative changes passes the change on to its children.
+ */
+void ac_incremental_backward(struct incremental *inc) {
+  struct circuit *ac = inc->ac;
+  int root = ac->numNodes - 1;
+
+  for (int r = 0; r < inc->numRecomputed; r++) {
+    if (ac->nodeType[inc->recomputed[r]] == '*') {
+      queue_children(inc, inc->recomputed[r]);
+    }
+  }
+  inc->numRecomputed = 0;
+
+  while (inc->heapSize > 0) {
+    int i = heap_pop(inc, true);
+    double derivative = (i == root) ? 1 : pull_backward_node(ac, i);
+
+    if (derivative != ac->dr[i]) {
+      ac->dr[i] = derivative;
+      queue_children(inc, i);
+    }
+  }
+}
+
+void ac_incremental_free(struct incremental *inc) {
+  free(inc->evidence);
+  free(inc->recomputed);
+  free(inc->queued);
+  free(inc->heap);
+  free(inc);
+}
@@ -0,0 +1,355 @@
+/*
+ * File:   ac_output.c
+ * Author: andrewchoi
+ *
+ * Output sinks for query results. Every query hands its output, values,
+ * derivatives and (if the sink wants them) marginals to the sink, which
+ * writes one of:
+ *   text       the human readable lines of the original program
+ *   none       nothing
+ *   root       CSV "query,output,log10"
+ *   marginals  CSV "query,variable,p(value 0),p(value 1),..."
+ *   csv        CSV "query,node,type,vr,dr" for every node
+ *   binary     the header "ACV\0", int32 numNodes, then per query
+ *              numNodes values followed by numNodes derivatives, as
+ *              native doubles
+ * The CSV sinks format into their own buffer with ac_format_double instead
+ * of going through printf. With sink->variables set, only the marginals of
+ * those variables are written.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "ac.h"
+
+#define OUTPUT_BUFFER_SIZE (1 << 16)
+#define MAX_FIELD_LENGTH AC_MAX_NUMBER_LENGTH //Longest number or name written in one go
+#define SIGNIFICANT_DIGITS 15
+#define TIE_MARGIN 1e-3L //Distance from halfway below which the rounding is left to snprintf (the product errs by under 3e-4)
+#define MAX_DECIMAL_EXPONENT 360 //Covers 10^14 / smallest subnormal
+
+static const char *formatName[AC_NUM_OUTPUTS] = { "text", "none", "root", "marginals", "csv", "binary" };
+
+/*
+ * Output formats as accepted on the command line
+ */
+int ac_output_by_name(const char *name) {
+  for (int f = 0; f < AC_NUM_OUTPUTS; f++) {
+    if (strcmp(name, formatName[f]) == 0) {
+      return f;
+    }
+  }
+  return -1;
+}
+
+static long double powersOfTen[2 * MAX_DECIMAL_EXPONENT + 1];
+static pthread_once_t powersOfTenOnce = PTHREAD_ONCE_INIT;
+
+static void fill_powers_of_ten(void) {
+  for (int e = -MAX_DECIMAL_EXPONENT; e <= MAX_DECIMAL_EXPONENT; e++) {
+    powersOfTen[e + MAX_DECIMAL_EXPONENT] = powl(10, e);
+  }
+}
+
+/*
+ * 10^k in extended precision for any k a double can scale by. The table
+ * is filled once, by whichever thread formats a number first.
+ */
+static long double power_of_ten(int k) {
+  pthread_once(&powersOfTenOnce, fill_powers_of_ten);
+  return powersOfTen[k + MAX_DECIMAL_EXPONENT];
+}
+
+/*
+ * Write a double like printf("%.15g") into 'out' (room for
+ * AC_MAX_NUMBER_LENGTH characters) and return the length.
+ * The 15 significant digits come from one extended precision product;
+ * the rare products too close to halfway between two last digits for
+ * its precision are left to snprintf.
+ */
+int ac_format_double(char *out, double x) {
+  char digits[SIGNIFICANT_DIGITS];
+  unsigned long long mantissa;
+  long double scaled;
+  int exponent;
+  int numDigits = SIGNIFICANT_DIGITS;
+  int length = 0;
+
+  if (x == 0) {
+    out[0] = '0';
+    return 1;
+  }
+  if (!isfinite(x)) {
+    return snprintf(out, MAX_FIELD_LENGTH, "%g", x);
+  }
+  if (x < 0) {
+    out[length++] = '-';
+    x = -x;
+  }
+
+  /*Decimal exponent from the binary one, corrected by at most one*/
+  exponent = (int)floor(ilogb(x) * 0.30102999566398119521);
+  scaled = (long double)x * power_of_ten(SIGNIFICANT_DIGITS - 1 - exponent);
+  if (scaled >= 999999999999999.5L) {
+    exponent++;
+    scaled = (long double)x * power_of_ten(SIGNIFICANT_DIGITS - 1 - exponent);
+  }
+  else if (scaled < 99999999999999.5L) {
+    exponent--;
+    scaled = (long double)x * power_of_ten(SIGNIFICANT_DIGITS - 1 - exponent);
+  }
+  if (fabsl(scaled - floorl(scaled) - 0.5L) < TIE_MARGIN) {
+    /*Too close to halfway for the product to tell which way to round*/
+    return length + snprintf(out + length, MAX_FIELD_LENGTH - length, "%.15g", x);
+  }
+  mantissa = llroundl(scaled);
+  if (mantissa >= 1000000000000000ULL) {
+    /*Rounded up to the next power of ten*/
+    mantissa /= 10;
+    exponent++;
+  }
+
+  for (int d = SIGNIFICANT_DIGITS - 1; d >= 0; d--) {
+    digits[d] = '0' + mantissa % 10;
+    mantissa /= 10;
+  }
+  while (numDigits > 1 && digits[numDigits - 1] == '0') {
+    numDigits--;
+  }
+
+  if (exponent >= -4 && exponent < SIGNIFICANT_DIGITS) {
+    /*Fixed notation*/
+    if (exponent < 0) {
+      out[length++] = '0';
+      out[length++] = '.';
+      for (int z = -1; z > exponent; z--) {
+	out[length++] = '0';
+      }
+      memcpy(out + length, digits, numDigits);
+      length += numDigits;
+    }
+    else {
+      for (int d = 0; d <= exponent; d++) {
+	out[length++] = (d < numDigits) ? digits[d] : '0';
+      }
+      if (numDigits > exponent + 1) {
+	out[length++] = '.';
+	memcpy(out + length, digits + exponent + 1, numDigits - exponent - 1);
+	length += numDigits - exponent - 1;
+      }
+    }
+    return length;
+  }
+
+  /*Scientific notation*/
+  out[length++] = digits[0];
+  if (numDigits > 1) {
+    out[length++] = '.';
+    memcpy(out + length, digits + 1, numDigits - 1);
+    length += numDigits - 1;
+  }
+  return length + snprintf(out + length, MAX_FIELD_LENGTH - length, "e%+03d", exponent);
+}
+
+static void flush_buffer(struct output_sink *sink) {
+  fwrite(sink->buffer, 1, sink->length, sink->file);
+  sink->length = 0;
+}
+
+/*
+ * Make room for one more field
+ */
+static inline void reserve(struct output_sink *sink) {
+  if (sink->length + MAX_FIELD_LENGTH > OUTPUT_BUFFER_SIZE) {
+    flush_buffer(sink);
+  }
+}
+
+static inline void put_char(struct output_sink *sink, char c) {
+  reserve(sink);
+  sink->buffer[sink->length++] = c;
+}
+
+static void put_int(struct output_sink *sink, long value) {
+  char digits[24];
+  int count = 0;
+
+  reserve(sink);
+  if (value < 0) {
+    sink->buffer[sink->length++] = '-';
+    value = -value;
+  }
+  do {
+    digits[count++] = '0' + value % 10;
+    value /= 10;
+  } while (value > 0);
+  while (count > 0) {
+    sink->buffer[sink->length++] = digits[--count];
+  }
+}
+
+static inline void put_double(struct output_sink *sink, double value) {
+  reserve(sink);
+  sink->length += ac_format_double(sink->buffer + sink->length, value);
+}
+
+/*
+ * Open a sink writing 'format' to a file (stdout if NULL). 'withMarginals'
+ * asks for marginals in the text format; the marginals format always has
+ * them. Returns NULL if the file can not be written.
+ */
+struct output_sink* ac_output_open(const struct circuit *ac, int format, const char *filename,
+				   bool withMarginals) {
+  struct output_sink *sink;
+  FILE *file = stdout;
+
+  if (filename != NULL) {
+    file = fopen(filename, (format == AC_OUTPUT_BINARY) ? "wb" : "w");
+    if (!file) {
+      fprintf(stderr, "Unable to write file %s\n", filename);
+      return NULL;
+    }
+  }
+
+  sink = (struct output_sink*)calloc(1, sizeof(struct output_sink));
+  sink->ac = ac;
+  sink->format = format;
+  sink->file = file;
+  sink->buffer = (char*)malloc(OUTPUT_BUFFER_SIZE);
+  if (format == AC_OUTPUT_MARGINALS || (format == AC_OUTPUT_TEXT && withMarginals)) {
+    sink->marginals = (double*)malloc(sizeof(double) * (ac_marginal_count(ac) + 1));
+  }
+
+  if (format == AC_OUTPUT_BINARY) {
+    int32_t numNodes = ac->numNodes;
+    fwrite("ACV\0", 1, 4, file);
+    fwrite(&numNodes, sizeof(numNodes), 1, file);
+  }
+  else if (format == AC_OUTPUT_ROOT) {
+    fputs("query,output,log10\n", file);
+  }
+  else if (format == AC_OUTPUT_MARGINALS) {
+    fputs("query,variable,marginals\n", file);
+  }
+  else if (format == AC_OUTPUT_CSV) {
+    fputs("query,node,type,vr,dr\n", file);
+  }
+  return sink;
+}
+
+/*
+ * True if the sink writes the value and derivative of every node
+ */
+bool ac_output_needs_nodes(const struct output_sink *sink) {
+  return sink->format == AC_OUTPUT_CSV || sink->format == AC_OUTPUT_BINARY;
+}
+
+/*
+ * Write the result of one query. 'log10Output' is the log of the output
+ * (exact even if the output underflowed), 'vr' and 'dr' hold every node
+ * and are only read by the sinks that write nodes, the marginals are
+ * read from sink->marginals if the sink has a table.
+ */
+void ac_output_query(struct output_sink *sink, int query, double log10Output,
+		     const double *vr, const double *dr) {
+  const struct circuit *ac = sink->ac;
+  int root = ac->numNodes - 1;
+  int offset = 0;
+
+  switch (sink->format) {
+  case AC_OUTPUT_TEXT:
+    fprintf(sink->file, "query %d output %le log: %lf\n", query, vr[root], log10Output);
+    if (sink->marginals != NULL) {
+      for (int x = 0; x < ac->numVars; x++) {
+	if (sink->variables != NULL && !sink->variables[x]) {
+	  offset += ac->varCard[x];
+	  continue;
+	}
+	fprintf(sink->file, "x%d", x);
+	for (int v = 0; v < ac->varCard[x]; v++) {
+	  fprintf(sink->file, " %lf", sink->marginals[offset + v]);
+	}
+	fprintf(sink->file, "\n");
+	offset += ac->varCard[x];
+      }
+    }
+    break;
+  case AC_OUTPUT_ROOT:
+    put_int(sink, query);
+    put_char(sink, ',');
+    put_double(sink, vr[root]);
+    put_char(sink, ',');
+    put_double(sink, log10Output);
+    put_char(sink, '\n');
+    break;
+  case AC_OUTPUT_MARGINALS:
+    for (int x = 0; x < ac->numVars; x++) {
+      if (sink->variables != NULL && !sink->variables[x]) {
+	offset += ac->varCard[x];
+	continue;
+      }
+      put_int(sink, query);
+      put_char(sink, ',');
+      put_int(sink, x);
+      for (int v = 0; v < ac->varCard[x]; v++) {
+	put_char(sink, ',');
+	put_double(sink, sink->marginals[offset + v]);
+      }
+      put_char(sink, '\n');
+      offset += ac->varCard[x];
+    }
+    break;
+  case AC_OUTPUT_CSV:
+    for (int i = 0; i < ac->numNodes; i++) {
+      put_int(sink, query);
+      put_char(sink, ',');
+      put_int(sink, i);
+      put_char(sink, ',');
+      put_char(sink, ac->nodeType[i]);
+      put_char(sink, ',');
+      put_double(sink, vr[i]);
+      put_char(sink, ',');
+      put_double(sink, dr[i]);
+      put_char(sink, '\n');
+    }
+    break;
+  case AC_OUTPUT_BINARY:
+    fwrite(vr, sizeof(double), ac->numNodes, sink->file);
+    fwrite(dr, sizeof(double), ac->numNodes, sink->file);
+    break;
+  default:
+    break;
+  }
+}
+
+/*
+ * Flush and close a sink. Returns EXIT_FAILURE if writing failed.
+ */
+int ac_output_close(struct output_sink *sink) {
+  int status = EXIT_SUCCESS;
+
+  flush_buffer(sink);
+  if (ferror(sink->file)) {
+    status = EXIT_FAILURE;
+  }
+  if (sink->file != stdout) {
+    if (fclose(sink->file) != 0) {
+      status = EXIT_FAILURE;
+    }
+  }
+  else {
+    fflush(stdout);
+  }
+  if (status != EXIT_SUCCESS) {
+    fprintf(stderr, "Unable to write the results\n");
+  }
+  free(sink->marginals);
+  free(sink->buffer);
+  free(sink);
+  return status;
+}
@@ -0,0 +1,250 @@
+/*
+ * File:   ac_parallel.c
+ * Author: andrewchoi
+ *
+ * Level-synchronous multithreaded cache-propagation.
+ * The nodes of one topological level only depend on lower levels, so a
+ * level can be split across workers; a barrier separates the levels.
+ * The upward pass runs the levels bottom up, the downward pass top down,
+ * either scattering into per-worker rows or pulling from the parents
+ * depending on the circuit's engine. With the dataflow schedule the
+ * workers run the same node steps without level barriers (see
+ * ac_dataflow.c).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "ac.h"
+
+#define TASK_FORWARD 0
+#define TASK_BACKWARD 1
+#define TASK_EXIT 2
+
+struct pool_worker {
+  struct thread_pool *pool;
+  int id;
+  pthread_t thread;
+};
+
+/*
+ * Range of the nodes of level 'l' handled by worker 'id'
+ */
+static void level_chunk(const struct thread_pool *pool, int l, int id, int *first, int *last) {
+  const struct circuit *ac = pool->ac;
+  int levelSize = ac->levelStart[l+1] - ac->levelStart[l];
+  int chunk = (levelSize + pool->numThreads - 1) / pool->numThreads;
+
+  *first = ac->levelStart[l] + id * chunk;
+  *last = *first + chunk;
+  if (*last > ac->levelStart[l+1]) {
+    *last = ac->levelStart[l+1];
+  }
+}
+
+static void forward_levels(struct thread_pool *pool, int id) {
+  struct circuit *ac = pool->ac;
+  int first, last;
+
+  /*Level 0 only holds leaves*/
+  for (int l = 1; l < ac->numLevels; l++) {
+    level_chunk(pool, l, id, &first, &last);
+    for (int n = first; n < last; n++) {
+      if (ac->engine == AC_ENGINE_BIT) {
+	bit_forward_node(ac, ac->levelNode[n]);
+      }
+      else {
+	cache_forward_node(ac, ac->levelNode[n]);
+      }
+    }
+    pthread_barrier_wait(&pool->barrier);
+  }
+}
+
+/*
+ * Pull-based downward pass: every node gathers from its parents on higher
+ * levels, so the workers write disjoint slots and need no private rows
+ */
+static void pull_levels(struct thread_pool *pool, int id) {
+  struct circuit *ac = pool->ac;
+  int root = ac->numNodes - 1;
+  int first, last;
+
+  for (int l = ac->numLevels - 1; l >= 0; l--) {
+    level_chunk(pool, l, id, &first, &last);
+    for (int n = first; n < last; n++) {
+      int i = ac->levelNode[n];
+      ac->dr[i] = (i == root) ? 1 : pull_backward_node(ac, i);
+    }
+    pthread_barrier_wait(&pool->barrier);
+  }
+}
+
+static void backward_levels(struct thread_pool *pool, int id) {
+  struct circuit *ac = pool->ac;
+  size_t numNodes = ac->numNodes;
+  double *myDr = pool->threadDr + id * numNodes;
+  int first, last;
+
+  if (ac->engine == AC_ENGINE_PULL) {
+    pull_levels(pool, id);
+    return;
+  }
+
+  memset(myDr, 0, sizeof(double) * numNodes);
+  if (id == 0) {
+    myDr[numNodes - 1] = 1;
+  }
+  pthread_barrier_wait(&pool->barrier);
+
+  for (int l = ac->numLevels - 1; l >= 0; l--) {
+    level_chunk(pool, l, id, &first, &last);
+    for (int n = first; n < last; n++) {
+      int i = ac->levelNode[n];
+      /*All parents are on higher levels, so the node's rows are final*/
+      double parentdr = 0;
+      for (int t = 0; t < pool->numThreads; t++) {
+	parentdr += pool->threadDr[t * numNodes + i];
+      }
+      ac->dr[i] = parentdr;
+      if (ac->engine == AC_ENGINE_BIT) {
+	bit_backward_node(ac, i, parentdr, myDr);
+      }
+      else {
+	cache_backward_node(ac, i, parentdr, myDr);
+      }
+    }
+    pthread_barrier_wait(&pool->barrier);
+  }
+}
+
+static void run_task(struct thread_pool *pool, int id) {
+  if (pool->task == TASK_FORWARD) {
+    if (pool->schedule == AC_SCHEDULE_DATAFLOW) {
+      dataflow_forward(pool, id);
+    }
+    else {
+      forward_levels(pool, id);
+    }
+  }
+  else if (pool->task == TASK_BACKWARD) {
+    if (pool->schedule == AC_SCHEDULE_DATAFLOW) {
+      dataflow_backward(pool, id);
+    }
+    else {
+      backward_levels(pool, id);
+    }
+  }
+}
+
+static void* worker_loop(void *arg) {
+  struct pool_worker *worker = (struct pool_worker*)arg;
+  struct thread_pool *pool = worker->pool;
+
+  while (1) {
+    /*Wait for the next pass*/
+    pthread_barrier_wait(&pool->barrier);
+    if (pool->task == TASK_EXIT) {
+      break;
+    }
+    run_task(pool, worker->id);
+    pthread_barrier_wait(&pool->barrier);
+  }
+  return NULL;
+}
+
+/*
+ * Run one pass on every worker, the caller acting as worker 0
+ */
+static void dispatch(struct thread_pool *pool, int task) {
+  pool->task = task;
+  pthread_barrier_wait(&pool->barrier);
+  run_task(pool, 0);
+  pthread_barrier_wait(&pool->barrier);
+}
+
+/*
+ * Schedules as accepted on the command line
+ */
+int ac_schedule_by_name(const char *name) {
+  if (strcmp(name, "level") == 0) {
+    return AC_SCHEDULE_LEVEL;
+  }
+  if (strcmp(name, "dataflow") == 0) {
+    return AC_SCHEDULE_DATAFLOW;
+  }
+  return -1;
+}
+
+const char* ac_schedule_name(int schedule) {
+  return (schedule == AC_SCHEDULE_DATAFLOW) ? "dataflow" : "level";
+}
+
+/*
+ * Start 'numThreads' - 1 worker threads for a compiled circuit
+ */
+struct thread_pool* ac_pool_create(struct circuit *ac, int numThreads) {
+  struct thread_pool *pool = (struct thread_pool*)malloc(sizeof(struct thread_pool));
+
+  if (numThreads < 1) {
+    numThreads = 1;
+  }
+  pool->ac = ac;
+  pool->numThreads = numThreads;
+  pool->task = TASK_FORWARD;
+  pool->schedule = AC_SCHEDULE_LEVEL;
+  pool->dataflow = NULL;
+  pool->threadDr = (double*)malloc(sizeof(double) * numThreads * (size_t)ac->numNodes);
+  pool->workers = (struct pool_worker*)malloc(sizeof(struct pool_worker) * numThreads);
+  pthread_barrier_init(&pool->barrier, NULL, numThreads);
+
+  for (int t = 1; t < numThreads; t++) {
+    pool->workers[t].pool = pool;
+    pool->workers[t].id = t;
+    pthread_create(&pool->workers[t].thread, NULL, worker_loop, &pool->workers[t]);
+  }
+  return pool;
+}
+
+/*
+ * Switch between level by level and dataflow scheduling; the tasks of the
+ * dataflow schedule are built on first use
+ */
+void ac_pool_set_schedule(struct thread_pool *pool, int schedule) {
+  if (schedule == AC_SCHEDULE_DATAFLOW && pool->dataflow == NULL) {
+    pool->dataflow = dataflow_create(pool->ac, pool->numThreads);
+  }
+  pool->schedule = schedule;
+}
+
+/*
+ * Upward pass, parallel within each level
+ */
+void ac_parallel_forward(struct thread_pool *pool) {
+  dispatch(pool, TASK_FORWARD);
+}
+
+/*
+ * Downward pass, parallel within each level.
+ * Needs the values of the last upward pass.
+ */
+void ac_parallel_backward(struct thread_pool *pool) {
+  dispatch(pool, TASK_BACKWARD);
+}
+
+void ac_pool_free(struct thread_pool *pool) {
+  pool->task = TASK_EXIT;
+  pthread_barrier_wait(&pool->barrier);
+  for (int t = 1; t < pool->numThreads; t++) {
+    pthread_join(pool->workers[t].thread, NULL);
+  }
+  pthread_barrier_destroy(&pool->barrier);
+  if (pool->dataflow != NULL) {
+    dataflow_free(pool->dataflow);
+  }
+  free(pool->workers);
+  free(pool->threadDr);
+  free(pool);
+}
@@ -0,0 +1,439 @@
+/*
+ * File:   ac_parse.c
+ * Author: andrewchoi
+ *
+ * Reads .ac files. The file is memory-mapped and scanned once with
+ * hand-rolled integer and number scanners that write straight into the
+ * compiled arrays, so there is no line buffer and no limit on the length
+ * of a child list. A line that starts with a digit continues the child
+ * list of the operation node above it. A line with a missing, malformed
+ * or out of range field is an error that names the line.
+ * Circuits are written back in the same format, with constants printed
+ * to 17 significant digits so they read back exactly.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ac.h"
+
+#define MAX_FAST_DIGITS 15 //Decimal digits that always fit a double exactly
+#define MAX_FAST_EXPONENT 22 //Largest exactly representable power of ten
+
+/* Read position in the mapped file, and its line number from 1 */
+struct scanner {
+  const char *pos;
+  const char *end;
+  int line;
+};
+
+static const double powersOfTen[MAX_FAST_EXPONENT + 1] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/*
+ * Skip blanks within the current line
+ */
+static void skip_blanks(struct scanner *s) {
+  while (s->pos < s->end && (*s->pos == ' ' || *s->pos == '\t' || *s->pos == '\r')) {
+    s->pos++;
+  }
+}
+
+/*
+ * Move to the first character of the next line
+ */
+static void next_line(struct scanner *s) {
+  const char *newline = memchr(s->pos, '\n', s->end - s->pos);
+  s->pos = (newline != NULL) ? newline + 1 : s->end;
+  s->line++;
+}
+
+/*
+ * True if only blanks are left on the current line
+ */
+static bool at_line_end(struct scanner *s) {
+  skip_blanks(s);
+  return s->pos == s->end || *s->pos == '\n';
+}
+
+static bool is_digit(char c) {
+  return c >= '0' && c <= '9';
+}
+
+/*
+ * Scan a non-negative integer on the current line.
+ * Returns false (without moving) if there is none or it does not fit an
+ * int.
+ */
+static bool scan_int(struct scanner *s, int *value) {
+  const char *start;
+  int result = 0;
+
+  skip_blanks(s);
+  if (s->pos == s->end || !is_digit(*s->pos)) {
+    return false;
+  }
+  start = s->pos;
+  while (s->pos < s->end && is_digit(*s->pos)) {
+    int digit = *s->pos - '0';
+    if (result > (INT_MAX - digit) / 10) {
+      s->pos = start;
+      return false;
+    }
+    result = result * 10 + digit;
+    s->pos++;
+  }
+  *value = result;
+  return true;
+}
+
+/*
+ * Scan a decimal number on the current line. Numbers with at most
+ * MAX_FAST_DIGITS significant digits and a small exponent are converted
+ * exactly with a single division by an exact power of ten;
+ * anything else falls back to strtod.
+ */
+static bool scan_double(struct scanner *s, double *value) {
+  const char *start;
+  unsigned long long mantissa = 0;
+  int digits = 0;
+  int exponent = 0;
+  bool negative = false;
+
+  skip_blanks(s);
+  start = s->pos;
+  if (s->pos < s->end && (*s->pos == '-' || *s->pos == '+')) {
+    negative = (*s->pos == '-');
+    s->pos++;
+  }
+  while (s->pos < s->end && is_digit(*s->pos)) {
+    if (mantissa != 0 || *s->pos != '0') {
+      digits++;
+    }
+    mantissa = mantissa * 10 + (*s->pos - '0');
+    s->pos++;
+  }
+  if (s->pos < s->end && *s->pos == '.') {
+    s->pos++;
+    while (s->pos < s->end && is_digit(*s->pos)) {
+      if (mantissa != 0 || *s->pos != '0') {
+	digits++;
+      }
+      mantissa = mantissa * 10 + (*s->pos - '0');
+      exponent--;
+      s->pos++;
+    }
+  }
+  if (s->pos == start || (s->pos == start + 1 && !is_digit(*start))) {
+    s->pos = start;
+    return false;
+  }
+  if (s->pos < s->end && (*s->pos == 'e' || *s->pos == 'E')) {
+    digits = MAX_FAST_DIGITS + 1; /*Leave exponents to strtod*/
+  }
+
+  if (digits <= MAX_FAST_DIGITS && -exponent <= MAX_FAST_EXPONENT) {
+    *value = (double)mantissa / powersOfTen[-exponent];
+    if (negative) {
+      *value = -*value;
+    }
+    return true;
+  }
+
+  /*Slow path: copy the token so strtod never runs past the mapping*/
+  char token[64];
+  const char *tokenEnd = start;
+  while (tokenEnd < s->end && tokenEnd - start < (long)sizeof(token) - 1
+	 && (is_digit(*tokenEnd) || *tokenEnd == '.' || *tokenEnd == 'e' || *tokenEnd == 'E'
+	     || *tokenEnd == '-' || *tokenEnd == '+')) {
+    tokenEnd++;
+  }
+  memcpy(token, start, tokenEnd - start);
+  token[tokenEnd - start] = '\0';
+  *value = strtod(token, NULL);
+  s->pos = tokenEnd;
+  return true;
+}
+
+/*
+ * Read the variable cardinalities from the "(2 2 2)" header line.
+ * Returns false if it does not end in ')' after them.
+ */
+static bool scan_header(struct scanner *s, struct circuit *ac) {
+  int card;
+  int capacity = 16;
+
+  s->pos++; /*Ignore the opening bracket*/
+  ac->varCard = (int*)malloc(sizeof(int) * capacity);
+  while (scan_int(s, &card)) {
+    if (ac->numVars == capacity) {
+      capacity *= 2;
+      ac->varCard = (int*)realloc(ac->varCard, sizeof(int) * capacity);
+    }
+    ac->varCard[ac->numVars++] = card;
+  }
+  skip_blanks(s);
+  return s->pos < s->end && *s->pos == ')';
+}
+
+/*
+ * Scan the child indices on the rest of the line into the CSR arrays.
+ * Returns false on a reference to a node that is not defined yet, or on
+ * anything else than a child index.
+ */
+static bool scan_children(struct scanner *s, struct circuit *ac, int index, int *capacity) {
+  int childIndex;
+
+  while (scan_int(s, &childIndex)) {
+    if (childIndex >= index) {
+      return false;
+    }
+    if (ac->numEdges == *capacity) {
+      *capacity *= 2;
+      ac->childIndex = (int*)realloc(ac->childIndex, sizeof(int) * (*capacity));
+    }
+    ac->childIndex[ac->numEdges++] = childIndex;
+  }
+  return at_line_end(s);
+}
+
+/*
+ * Count the node lines of a mapped .ac file: one cheap pass over the
+ * line starts, so the node store can be allocated at its final size
+ */
+static int count_nodes(const char *data, size_t length) {
+  struct scanner s = { data, data + length, 1 };
+  bool header = false;
+  int count = 0;
+
+  while (s.pos < s.end) {
+    char type = *s.pos;
+    if (type == '(') {
+      header = true;
+    }
+    else if (header && type == 'E') {
+      break;
+    }
+    else if (header && (type == 'n' || type == 'v' || type == '+' || type == '*')) {
+      count++;
+    }
+    next_line(&s);
+  }
+  return count;
+}
+
+/*
+ * Parse a mapped .ac file into a circuit (not compiled yet)
+ */
+static struct circuit* parse_circuit(const char *data, size_t length, int size, const char *filename) {
+  struct scanner s = { data, data + length, 1 };
+  struct circuit *ac = NULL;
+  int index = 0;
+  int nodeCapacity = 0;
+  int edgeCapacity = INITIAL_EDGE_NUMBER;
+  char lastType = '\0';
+
+  while (s.pos < s.end) {
+    char type = *s.pos;
+
+    if (type == '(') {
+      /*Allocate memory for the circuit*/
+      if (ac == NULL) {
+	nodeCapacity = (size > 0) ? size + NODE_SAFETY_MARGIN : count_nodes(data, length);
+	if (nodeCapacity < 1) {
+	  nodeCapacity = 1;
+	}
+	ac = ac_allocate(nodeCapacity);
+	if (!scan_header(&s, ac)) {
+	  fprintf(stderr, "Line %d of %s: invalid variable cardinalities\n", s.line, filename);
+	  ac_free(ac);
+	  return NULL;
+	}
+      }
+    }
+    else if (ac == NULL) {
+      /*Ignore anything before the header*/
+    }
+    else if (type == 'E') {
+      break;
+    }
+    else if (type == 'n' || type == 'v' || type == '+' || type == '*') {
+      bool valid = true;
+      s.pos++;
+      if (index == nodeCapacity) {
+	/*The size given was too small*/
+	nodeCapacity *= 2;
+	ac_resize(ac, nodeCapacity);
+      }
+      ac->nodeType[index] = type;
+      ac->varIndex[index] = -1;
+      ac->varValue[index] = -1;
+      ac->dr[index] = 0;
+      ac->flag[index] = false;
+
+      if (type == 'n') {
+	/*Leaf node (Constant)*/
+	valid = scan_double(&s, &(ac->vr[index])) && at_line_end(&s);
+      }
+      else if (type == 'v') {
+	/*Leaf node (Variable)*/
+	valid = scan_int(&s, &(ac->varIndex[index])) && scan_int(&s, &(ac->varValue[index]))
+	  && at_line_end(&s);
+	ac->vr[index] = ac->varValue[index];
+      }
+      else if (!scan_children(&s, ac, index, &edgeCapacity)) {
+	fprintf(stderr, "Line %d of %s: node %d has an undefined or invalid child\n", s.line, filename, index);
+	ac_free(ac);
+	return NULL;
+      }
+      if (!valid) {
+	fprintf(stderr, "Line %d of %s: node %d needs %s\n", s.line, filename, index,
+		(type == 'n') ? "one number" : "a variable and a value");
+	ac_free(ac);
+	return NULL;
+      }
+      index++;
+      ac->childStart[index] = ac->numEdges;
+      ac->numNodes = index;
+      lastType = type;
+    }
+    else if (is_digit(type) && (lastType == '+' || lastType == '*')) {
+      /*Continuation line of the previous child list*/
+      if (!scan_children(&s, ac, index - 1, &edgeCapacity)) {
+	fprintf(stderr, "Line %d of %s: node %d has an undefined or invalid child\n", s.line, filename, index - 1);
+	ac_free(ac);
+	return NULL;
+      }
+      ac->childStart[index] = ac->numEdges;
+    }
+    next_line(&s);
+  }
+
+  if (ac == NULL || ac->numNodes == 0) {
+    fprintf(stderr, "No circuit found in file %s\n", filename);
+    if (ac != NULL) {
+      ac_free(ac);
+    }
+    return NULL;
+  }
+
+  /*Keep memory proportional to the circuit*/
+  if (nodeCapacity > ac->numNodes) {
+    ac_resize(ac, ac->numNodes);
+  }
+  if (edgeCapacity > ac->numEdges && ac->numEdges > 0) {
+    ac->childIndex = (int*)realloc(ac->childIndex, sizeof(int) * ac->numEdges);
+  }
+  return ac;
+}
+
+/*
+ * Read an .ac file without compiling it, or map a compiled .acb file
+ * (mapping != NULL). 'size' is the expected number of nodes, 0 counts
+ * them first; the node store grows if the size is too small.
+ * Returns NULL if the file can not be read.
+ */
+struct circuit* ac_parse(const char *filename, int size) {
+  struct circuit *ac;
+  struct stat fileStat;
+  void *data;
+  int fd = open(filename, O_RDONLY);
+
+  if (fd < 0 || fstat(fd, &fileStat) != 0) {
+    /* File does not exist*/
+    fprintf(stderr, "Unable to read file %s\n", filename);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return NULL;
+  }
+
+  if (fileStat.st_size == 0) {
+    fprintf(stderr, "No circuit found in file %s\n", filename);
+    ac = NULL;
+  }
+  else {
+    data = mmap(NULL, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      fprintf(stderr, "Unable to map file %s\n", filename);
+      close(fd);
+      return NULL;
+    }
+    if (ac_is_binary(data, fileStat.st_size)) {
+      /*Compiled circuit, evaluated straight from the mapping*/
+      ac = ac_map_binary(data, fileStat.st_size, filename);
+      if (ac == NULL) {
+	munmap(data, fileStat.st_size);
+      }
+      close(fd);
+      return ac;
+    }
+    madvise(data, fileStat.st_size, MADV_SEQUENTIAL);
+    ac = parse_circuit((const char*)data, fileStat.st_size, size, filename);
+    munmap(data, fileStat.st_size);
+  }
+  close(fd);
+  return ac;
+}
+
+/*
+ * Read and compile an .ac file, or map a compiled .acb file.
+ * Returns NULL if the file can not be read.
+ */
+struct circuit* ac_load(const char *filename, int size) {
+  struct circuit *ac = ac_parse(filename, size);
+
+  if (ac != NULL && ac->mapping == NULL) {
+    ac_compile(ac);
+  }
+  return ac;
+}
+
+/*
+ * Write a circuit to an .ac file
+ */
+int ac_save_text(const struct circuit *ac, const char *filename) {
+  FILE *ac_file = fopen(filename, "w");
+  int status = EXIT_SUCCESS;
+
+  if (!ac_file) {
+    fprintf(stderr, "Unable to write file %s\n", filename);
+    return (EXIT_FAILURE);
+  }
+
+  fputc('(', ac_file);
+  for (int x = 0; x < ac->numVars; x++) {
+    fprintf(ac_file, (x == 0) ? "%d" : " %d", ac->varCard[x]);
+  }
+  fprintf(ac_file, ")\n");
+  for (int i = 0; i < ac->numNodes; i++) {
+    if (ac->nodeType[i] == 'n') {
+      fprintf(ac_file, "n %.17g\n", ac->vr[i]);
+    }
+    else if (ac->nodeType[i] == 'v') {
+      fprintf(ac_file, "v %d %d\n", ac->varIndex[i], ac->varValue[i]);
+    }
+    else {
+      fputc(ac->nodeType[i], ac_file);
+      for (int e = ac->childStart[i]; e < ac->childStart[i+1]; e++) {
+	fprintf(ac_file, " %d", ac->childIndex[e]);
+      }
+      fputc('\n', ac_file);
+    }
+  }
+  fprintf(ac_file, "EOF\n");
+  if (ferror(ac_file) || fclose(ac_file) != 0) {
+    fprintf(stderr, "Unable to write file %s\n", filename);
+    status = EXIT_FAILURE;
+  }
+  return (status);
+}
@@ -0,0 +1,334 @@
+/*
+ * File:   ac_propagate.c
+ * Author: andrewchoi
+ *
+ * Upward (value) and downward (partial derivative) passes over a
+ * compiled circuit. Cache-propagation keeps left and right product
+ * registers for every '*' node, bit-encoded propagation (Darwiche 2003,
+ * AC_ENGINE_BIT) keeps a flag for '*' nodes with exactly one zero child
+ * instead and divides in the downward pass. Neither assumes that '+' and
+ * '*' nodes alternate.
+ * The cache derivatives can be pushed from every node to its children
+ * (AC_ENGINE_CACHE) or pulled by every node from its parents
+ * (AC_ENGINE_PULL); pulling writes every derivative exactly once.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "ac.h"
+
+/*
+ * Bit-encoded upward step for a single node. vr holds the true value of
+ * every node; the flag of a '*' node records that exactly one child is
+ * zero, which is all the downward step needs to know about zeros.
+ */
+void bit_forward_node(struct circuit *ac, int i) {
+  int start = ac->childStart[i];
+  int end = ac->childStart[i+1];
+
+  if (ac->nodeType[i] == '+') {
+    double sum = 0;
+    for (int e = start; e < end; e++) {
+      sum += ac->vr[ac->childIndex[e]];
+    }
+    ac->vr[i] = sum;
+  }
+  else if (ac->nodeType[i] == '*') {
+    /* Multiply the non-zero children, count the zeros */
+    double product = 1;
+    int zeroCount = 0;
+    for (int e = start; e < end; e++) {
+      double childvr = ac->vr[ac->childIndex[e]];
+      if (childvr == 0) {
+	zeroCount++;
+      }
+      else {
+	product *= childvr;
+      }
+    }
+    ac->vr[i] = (zeroCount == 0) ? product : 0;
+    ac->flag[i] = (zeroCount == 1);
+  }
+}
+
+void bit_forwardpropagation(struct circuit *ac) {
+  for (int i = 0; i < ac->numNodes; i++) {
+    bit_forward_node(ac, i);
+  }
+}
+
+/*
+ * Cache-propagation upward step for a single node. Fills the product
+ * registers of '*' nodes for the downward pass.
+ */
+void cache_forward_node(struct circuit *ac, int i) {
+  int start = ac->childStart[i];
+  int end = ac->childStart[i+1];
+
+  if (ac->nodeType[i] == '+') {
+    double sum = 0;
+    for (int e = start; e < end; e++) {
+      sum += ac->vr[ac->childIndex[e]];
+    }
+    ac->vr[i] = sum;
+  }
+  else if (ac->nodeType[i] == '*') {
+    /* Calculate products */
+    int childCount = end - start;
+    int zeroCount = 0;
+    double *prL = ac->pr + ac->prStart[i];
+    double *prR = prL + childCount + 1;
+    prL[0] = 1;
+    prR[0] = 1;
+    for (int k = 1, j = end - 1; k <= childCount; k++, j--) {
+      double childvr = ac->vr[ac->childIndex[start + k - 1]];
+      if (childvr == 0) {
+	zeroCount++;
+      }
+      prL[k] = childvr * prL[(k-1)];
+      prR[k] = ac->vr[ac->childIndex[j]] * prR[(k-1)];
+    }
+    ac->vr[i] = prL[childCount];
+    ac->flag[i] = (zeroCount == 1);
+  }
+}
+
+void cache_forwardpropagation(struct circuit *ac) {
+  for (int i = 0; i < ac->numNodes; i++) {
+    cache_forward_node(ac, i);
+  }
+}
+
+/*
+ * Bit-encoded downward step for a single node. A '*' node without zero
+ * children divides its value by the child's; with exactly one zero child
+ * only that child gets a derivative, the product of the others; with
+ * more zeros every child's derivative is 0.
+ */
+void bit_backward_node(const struct circuit *ac, int i, double parentdr, double *dr) {
+  int start = ac->childStart[i];
+  int end = ac->childStart[i+1];
+
+  if (ac->nodeType[i] == '+') {
+    for (int e = start; e < end; e++) {
+      dr[ac->childIndex[e]] += parentdr;
+    }
+  }
+  else if (ac->nodeType[i] == '*') {
+    if (ac->vr[i] != 0) {
+      double scaled = parentdr * ac->vr[i];
+      for (int e = start; e < end; e++) {
+	int cIndex = ac->childIndex[e];
+	dr[cIndex] += scaled / ac->vr[cIndex];
+      }
+    }
+    else if (ac->flag[i]) {
+      double product = 1;
+      int zeroChild = -1;
+      for (int e = start; e < end; e++) {
+	int cIndex = ac->childIndex[e];
+	if (ac->vr[cIndex] == 0) {
+	  zeroChild = cIndex;
+	}
+	else {
+	  product *= ac->vr[cIndex];
+	}
+      }
+      dr[zeroChild] += parentdr * product;
+    }
+  }
+}
+
+void bit_backpropagation(struct circuit *ac) {
+  for (int i = ac->numNodes - 1; i >= 0; i--) {
+    bit_backward_node(ac, i, ac->dr[i], ac->dr);
+  }
+}
+
+/*
+ * Cache-propagation downward step for a single node: add the node's
+ * contribution 'parentdr' times the product of the siblings to the
+ * derivative of each child in 'dr'
+ */
+void cache_backward_node(const struct circuit *ac, int i, double parentdr, double *dr) {
+  int start = ac->childStart[i];
+  int end = ac->childStart[i+1];
+
+  /*Assign dr values depending on parent node*/
+  if (ac->nodeType[i] == '+') {
+    for (int e = start; e < end; e++) {
+      dr[ac->childIndex[e]] += parentdr;
+    }
+  }
+  /*Assign dr based on child position in cache*/
+  else if (ac->nodeType[i] == '*') {
+    int w = end - start;
+    const double *prL = ac->pr + ac->prStart[i];
+    const double *prR = prL + w + 1;
+    /*Product: pr(pos) = prR(w-pos) * prL(pos-1)*/
+    for (int pos = 1; pos <= w; pos++) {
+      dr[ac->childIndex[start + pos - 1]] += parentdr * prR[(w-pos)] * prL[(pos-1)];
+    }
+  }
+}
+
+void cache_backpropagation(struct circuit *ac) {
+  for (int i = ac->numNodes - 1; i >= 0; i--) {
+    cache_backward_node(ac, i, ac->dr[i], ac->dr);
+  }
+}
+
+/*
+ * Pull-based downward step: the derivative of node i gathered from its
+ * parents, whose derivatives must already be final
+ */
+double pull_backward_node(const struct circuit *ac, int i) {
+  double sum = 0;
+
+  for (int k = ac->parentStart[i]; k < ac->parentStart[i+1]; k++) {
+    int parent = ac->parentIndex[k];
+    if (ac->nodeType[parent] == '+') {
+      sum += ac->dr[parent];
+    }
+    else {
+      /*Product of the siblings: prL(pos) * prR(w-pos-1), pos from 0*/
+      int w = ac->childStart[parent+1] - ac->childStart[parent];
+      int pos = ac->parentPos[k];
+      const double *prL = ac->pr + ac->prStart[parent];
+      const double *prR = prL + w + 1;
+      sum += ac->dr[parent] * prL[pos] * prR[w-pos-1];
+    }
+  }
+  return sum;
+}
+
+void pull_backpropagation(struct circuit *ac) {
+  int root = ac->numNodes - 1;
+  ac->dr[root] = 1;
+  for (int i = root - 1; i >= 0; i--) {
+    ac->dr[i] = pull_backward_node(ac, i);
+  }
+}
+
+/*
+ * Engine names as accepted on the command line
+ */
+int ac_engine_by_name(const char *name) {
+  if (strcmp(name, "cache") == 0) {
+    return AC_ENGINE_CACHE;
+  }
+  if (strcmp(name, "pull") == 0) {
+    return AC_ENGINE_PULL;
+  }
+  if (strcmp(name, "bit") == 0) {
+    return AC_ENGINE_BIT;
+  }
+  if (strcmp(name, "auto") == 0) {
+    return AC_ENGINE_AUTO;
+  }
+  return -1;
+}
+
+const char* ac_engine_name(int engine) {
+  switch (engine) {
+  case AC_ENGINE_CACHE:
+    return "cache";
+  case AC_ENGINE_PULL:
+    return "pull";
+  case AC_ENGINE_BIT:
+    return "bit";
+  case AC_ENGINE_AUTO:
+    return "auto";
+  default:
+    return "unknown";
+  }
+}
+
+/*
+ * Upward pass: compute the value of every node from the current leaves
+ */
+void ac_forward(struct circuit *ac) {
+  if (ac->engine == AC_ENGINE_BIT) {
+    /*Bit-encoded forward propagation*/
+    bit_forwardpropagation(ac);
+    return;
+  }
+
+  /*Product cache forward propagation*/
+  cache_forwardpropagation(ac);
+}
+
+/*
+ * Downward pass: compute the partial derivative of the root with respect
+ * to every node. Needs the values of the last upward pass.
+ */
+void ac_backward(struct circuit *ac) {
+  if (ac->engine == AC_ENGINE_PULL) {
+    /*Every derivative is written once, no reset needed*/
+    pull_backpropagation(ac);
+    return;
+  }
+
+  memset(ac->dr, 0, sizeof(double) * ac->numNodes);
+  ac->dr[ac->numNodes - 1] = 1;
+
+  if (ac->engine == AC_ENGINE_BIT) {
+    /*Bit-encoded backpropagation*/
+    bit_backpropagation(ac);
+    return;
+  }
+
+  /*Product cache backpropagation*/
+  cache_backpropagation(ac);
+}
+
+/*
+ * Number of entries of a marginal table, the sum of the cardinalities.
+ * The values of variable x follow those of variables 0 .. x-1.
+ */
+int ac_marginal_count(const struct circuit *ac) {
+  int count = 0;
+  for (int x = 0; x < ac->numVars; x++) {
+    count += ac->varCard[x];
+  }
+  return count;
+}
+
+/*
+ * Posterior marginals P(x = v | e) = dr * vr / P(e) of every variable
+ * and value, written into 'marginals' (ac_marginal_count entries).
+ * Indicators that appear in several leaves add up. Needs the derivatives
+ * of the last downward pass. Returns P(e), the circuit output; if it is 0
+ * the table holds zeros.
+ */
+double ac_marginals(const struct circuit *ac, double *marginals) {
+  double root = ac->vr[ac->numNodes - 1];
+  int offset = 0;
+
+  for (int x = 0; x < ac->numVars; x++) {
+    for (int v = 0; v < ac->varCard[x]; v++) {
+      marginals[offset + v] = 0;
+    }
+    for (int l = ac->varLeafStart[x]; l < ac->varLeafStart[x+1]; l++) {
+      int leaf = ac->varLeaf[l];
+      if (ac->varValue[leaf] < ac->varCard[x] && root != 0) {
+	marginals[offset + ac->varValue[leaf]] += ac->dr[leaf] * ac->vr[leaf] / root;
+      }
+    }
+    offset += ac->varCard[x];
+  }
+  return root;
+}
+
+/*
+ * Function to print the values and partial derivatives of every node
+ */
+void ac_print_nodes(const struct circuit *ac) {
+  for (int i = 0; i < ac->numNodes; i++) {
+    printf("n%d t: %c, dr: %lf vr: %lf, flag: %d\n",
+	   i, ac->nodeType[i], ac->dr[i], ac->vr[i], ac->flag[i]);
+  }
+}
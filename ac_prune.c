@@ -0,0 +1,154 @@
+/*
+ * File:   ac_prune.c
+ * Author: andrewchoi
+ *
+ * Passes that skip the work the evidence forces to zero. An observed
+ * variable zeroes all but one of its indicators, and the zeros spread up
+ * through every '*' node above them. Like the bit flag, what matters is
+ * how many children of a '*' node are zero:
+ *   none      the node passes a derivative to every child
+ *   one       only the zero child gets one, the product of the others
+ *   more      the node is 0 and passes nothing
+ * The upward pass counts the zero children of every '*' node while it
+ * fills its registers, and stops at the second zero: the node is 0 and
+ * the rest of its registers are never read. The downward pass skips every
+ * node whose derivative is 0, so a subcircuit only reachable through
+ * zeroed '*' nodes costs one test per node, and a '*' node with one zero
+ * child only pushes to that child. Every value and every derivative is
+ * exactly the one of the full passes (the skipped contributions are
+ * products with a zero factor); only the registers of a '*' node with
+ * two zero children are left incomplete, so pruned upward passes must be
+ * followed by pruned downward passes. There is no separate marking pass:
+ * one costs about as much as an upward pass, as much as it would save.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "ac.h"
+
+/*
+ * Cache-propagation upward step that stops at the second zero child
+ */
+static void pruned_cache_forward_node(struct circuit *ac, int i) {
+  int start = ac->childStart[i];
+  int end = ac->childStart[i+1];
+  int childCount = end - start;
+  int zeroCount = 0;
+  double *prL = ac->pr + ac->prStart[i];
+  double *prR = prL + childCount + 1;
+
+  prL[0] = 1;
+  prR[0] = 1;
+  for (int k = 1, j = end - 1; k <= childCount; k++, j--) {
+    double childvr = ac->vr[ac->childIndex[start + k - 1]];
+    if (childvr == 0 && ++zeroCount == 2) {
+      break;
+    }
+    prL[k] = childvr * prL[(k-1)];
+    prR[k] = ac->vr[ac->childIndex[j]] * prR[(k-1)];
+  }
+  ac->vr[i] = (zeroCount < 2) ? prL[childCount] : 0;
+  ac->flag[i] = (zeroCount == 1);
+}
+
+/*
+ * Bit-encoded upward step that stops at the second zero child
+ */
+static void pruned_bit_forward_node(struct circuit *ac, int i) {
+  int start = ac->childStart[i];
+  int end = ac->childStart[i+1];
+  double product = 1;
+  int zeroCount = 0;
+
+  for (int e = start; e < end; e++) {
+    double childvr = ac->vr[ac->childIndex[e]];
+    if (childvr == 0) {
+      if (++zeroCount == 2) {
+	break;
+      }
+    }
+    else {
+      product *= childvr;
+    }
+  }
+  ac->vr[i] = (zeroCount == 0) ? product : 0;
+  ac->flag[i] = (zeroCount == 1);
+}
+
+/*
+ * Upward pass of the circuit's engine, '*' nodes stopping at their
+ * second zero child
+ */
+void ac_pruned_forward(struct circuit *ac) {
+  bool bit = (ac->engine == AC_ENGINE_BIT);
+
+  for (int i = 0; i < ac->numNodes; i++) {
+    if (ac->nodeType[i] != '*') {
+      cache_forward_node(ac, i);
+    }
+    else if (bit) {
+      pruned_bit_forward_node(ac, i);
+    }
+    else {
+      pruned_cache_forward_node(ac, i);
+    }
+  }
+}
+
+/*
+ * Cache-propagation downward step of a '*' node whose value is 0: only a
+ * zero child can get a non-zero derivative
+ */
+static void pruned_cache_backward_zero(const struct circuit *ac, int i, double parentdr, double *dr) {
+  int start = ac->childStart[i];
+  int end = ac->childStart[i+1];
+  int w = end - start;
+  const double *prL = ac->pr + ac->prStart[i];
+  const double *prR = prL + w + 1;
+  int zeroPos = 0;
+
+  if (!ac->flag[i]) {
+    /*Two zero children, or none and the product underflowed*/
+    for (int e = start; e < end; e++) {
+      if (ac->vr[ac->childIndex[e]] == 0) {
+	return;
+      }
+    }
+    cache_backward_node(ac, i, parentdr, dr);
+    return;
+  }
+  while (ac->vr[ac->childIndex[start + zeroPos]] != 0) {
+    zeroPos++;
+  }
+  /*The registers are complete: the node stopped at no second zero*/
+  dr[ac->childIndex[start + zeroPos]] += parentdr * prR[(w-zeroPos-1)] * prL[zeroPos];
+}
+
+/*
+ * Downward pass that skips every node with a zero derivative. The pull
+ * engine pushes here too, as pushing is what allows skipping.
+ */
+void ac_pruned_backward(struct circuit *ac) {
+  bool bit = (ac->engine == AC_ENGINE_BIT);
+
+  memset(ac->dr, 0, sizeof(double) * ac->numNodes);
+  ac->dr[ac->numNodes - 1] = 1;
+  for (int i = ac->numNodes - 1; i >= 0; i--) {
+    double parentdr = ac->dr[i];
+    if (parentdr == 0) {
+      continue;
+    }
+    if (bit) {
+      bit_backward_node(ac, i, parentdr, ac->dr);
+    }
+    else if (ac->nodeType[i] == '*' && ac->vr[i] == 0) {
+      pruned_cache_backward_zero(ac, i, parentdr, ac->dr);
+    }
+    else {
+      cache_backward_node(ac, i, parentdr, ac->dr);
+    }
+  }
+}
@@ -0,0 +1,132 @@
+/*
+ * File:   ac_query.c
+ * Author: andrewchoi
+ *
+ * Downward pass restricted to the marginals of a few query variables. The
+ * derivative of an indicator leaf only depends on the derivatives of its
+ * ancestors, and every parent of an ancestor is an ancestor too. So the
+ * ancestor cone of the query variables' leaves is collected once per
+ * query set, in reverse index order, and the downward pass pulls the
+ * derivative of every cone node from its parents like the pull engine,
+ * touching nothing outside the cone. The cone is kept in the query and
+ * reused by every downward pass; its cost is proportional to the edges
+ * into the cone. Derivatives outside the cone are left as they were.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "ac.h"
+
+/*
+ * Collect the cone of a set of query variables. A circuit on the
+ * bit-encoded engine is switched to the pull engine, as pulling a single
+ * derivative needs the product registers. Returns NULL if a variable is
+ * not one of the circuit's.
+ */
+struct circuit_query* ac_query_create(struct circuit *ac, const int *vars, int numVars) {
+  struct circuit_query *query;
+  bool *inCone;
+
+  for (int k = 0; k < numVars; k++) {
+    if (vars[k] < 0 || vars[k] >= ac->numVars) {
+      fprintf(stderr, "Query variable %d is not one of the %d variables\n", vars[k], ac->numVars);
+      return NULL;
+    }
+  }
+  if (ac->engine == AC_ENGINE_BIT) {
+    ac_set_engine(ac, AC_ENGINE_PULL);
+  }
+
+  query = (struct circuit_query*)malloc(sizeof(struct circuit_query));
+  query->ac = ac;
+  query->isQueryVar = (bool*)calloc(ac->numVars, sizeof(bool));
+  query->numQueryVars = 0;
+  query->queryVar = (int*)malloc(sizeof(int) * (numVars + 1));
+  for (int k = 0; k < numVars; k++) {
+    if (!query->isQueryVar[vars[k]]) {
+      query->isQueryVar[vars[k]] = true;
+      query->queryVar[query->numQueryVars++] = vars[k];
+    }
+  }
+
+  /*A node is in the cone if it is a query leaf or has a child in it*/
+  inCone = (bool*)calloc(ac->numNodes, sizeof(bool));
+  for (int k = 0; k < query->numQueryVars; k++) {
+    int x = query->queryVar[k];
+    for (int l = ac->varLeafStart[x]; l < ac->varLeafStart[x+1]; l++) {
+      inCone[ac->varLeaf[l]] = true;
+    }
+  }
+  query->numCone = 0;
+  for (int i = 0; i < ac->numNodes; i++) {
+    for (int e = ac->childStart[i]; e < ac->childStart[i+1] && !inCone[i]; e++) {
+      inCone[i] = inCone[ac->childIndex[e]];
+    }
+    query->numCone += inCone[i];
+  }
+  query->coneNode = (int*)malloc(sizeof(int) * (query->numCone + 1));
+  for (int i = ac->numNodes - 1, k = 0; i >= 0; i--) {
+    if (inCone[i]) {
+      query->coneNode[k++] = i;
+    }
+  }
+  free(inCone);
+  return query;
+}
+
+/*
+ * Downward pass over the cone: the derivatives of the query leaves and of
+ * their ancestors. Needs the values and product registers of the last
+ * upward pass.
+ */
+void ac_query_backward(struct circuit_query *query) {
+  struct circuit *ac = query->ac;
+  int root = ac->numNodes - 1;
+
+  for (int k = 0; k < query->numCone; k++) {
+    int i = query->coneNode[k];
+    ac->dr[i] = (i == root) ? 1 : pull_backward_node(ac, i);
+  }
+}
+
+/*
+ * Posterior marginals of the query variables, laid out as for
+ * ac_marginals; the entries of the other variables are 0. Needs the
+ * derivatives of the last ac_query_backward. Returns P(e).
+ */
+double ac_query_marginals(const struct circuit_query *query, double *marginals) {
+  const struct circuit *ac = query->ac;
+  double root = ac->vr[ac->numNodes - 1];
+  int offset = 0;
+
+  for (int x = 0; x < ac->numVars; x++) {
+    for (int v = 0; v < ac->varCard[x]; v++) {
+      marginals[offset + v] = 0;
+    }
+    for (int l = ac->varLeafStart[x]; l < ac->varLeafStart[x+1] && query->isQueryVar[x]; l++) {
+      int leaf = ac->varLeaf[l];
+      if (ac->varValue[leaf] < ac->varCard[x] && root != 0) {
+	marginals[offset + ac->varValue[leaf]] += ac->dr[leaf] * ac->vr[leaf] / root;
+      }
+    }
+    offset += ac->varCard[x];
+  }
+  return root;
+}
+
+/*
+ * Share of the circuit's nodes in the cone
+ */
+double ac_query_coverage(const struct circuit_query *query) {
+  return (double)query->numCone / query->ac->numNodes;
+}
+
+void ac_query_free(struct circuit_query *query) {
+  free(query->coneNode);
+  free(query->queryVar);
+  free(query->isQueryVar);
+  free(query);
+}
@@ -0,0 +1,128 @@
+/*
+ * File:   ac_reorder.c
+ * Author: andrewchoi
+ *
+ * Renumbering of a compiled circuit for locality. The passes visit the
+ * nodes in index order, so the order decides how far apart a node's
+ * children and the node itself are in the value, derivative and register
+ * arrays. Every order keeps children before their parents and the root
+ * last:
+ *   file   the order of the .ac file
+ *   dfs    depth-first post-order from the root: a node directly follows
+ *          the subcircuit of its last child, so most children were
+ *          computed just before they are read
+ *   level  level by level from the leaves up (breadth-first)
+ * ac_reuse_distance (see ac_analyze.c) measures the effect.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "ac.h"
+
+static const char *orderName[AC_NUM_ORDERS] = { "file", "dfs", "level" };
+
+/*
+ * Node orders as accepted on the command line
+ */
+int ac_order_by_name(const char *name) {
+  for (int o = 0; o < AC_NUM_ORDERS; o++) {
+    if (strcmp(name, orderName[o]) == 0) {
+      return o;
+    }
+  }
+  return -1;
+}
+
+const char* ac_order_name(int nodeOrder) {
+  return (nodeOrder >= 0 && nodeOrder < AC_NUM_ORDERS) ? orderName[nodeOrder] : "unknown";
+}
+
+/*
+ * Depth-first post-order of the nodes below 'top' not placed yet,
+ * appended to 'order'. Iterative, as circuits can be very deep.
+ */
+static int post_order(const struct circuit *ac, int top, bool *placed, int *stack, int *next,
+		      int *order, int numPlaced) {
+  int depth = 0;
+
+  stack[depth] = top;
+  next[depth] = ac->childStart[top];
+  placed[top] = true;
+  while (depth >= 0) {
+    int i = stack[depth];
+    if (next[depth] < ac->childStart[i+1]) {
+      int c = ac->childIndex[next[depth]++];
+      if (!placed[c]) {
+	placed[c] = true;
+	depth++;
+	stack[depth] = c;
+	next[depth] = ac->childStart[c];
+      }
+    }
+    else {
+      order[numPlaced++] = i;
+      depth--;
+    }
+  }
+  return numPlaced;
+}
+
+/*
+ * Build a renumbered, compiled copy of a compiled circuit with the nodes
+ * in 'nodeOrder' (AC_ORDER_*). If 'remap' is not NULL, remap[i] is set
+ * to the new index of node i.
+ */
+struct circuit* ac_reorder(const struct circuit *ac, int nodeOrder, int *remap) {
+  struct circuit *reordered;
+  int *order = (int*)malloc(sizeof(int) * ac->numNodes);
+  int *position = (int*)malloc(sizeof(int) * ac->numNodes);
+  int root = ac->numNodes - 1;
+  int numPlaced = 0;
+
+  if (nodeOrder == AC_ORDER_DFS) {
+    bool *placed = (bool*)calloc(ac->numNodes, sizeof(bool));
+    int *stack = (int*)malloc(sizeof(int) * ac->numNodes);
+    int *next = (int*)malloc(sizeof(int) * ac->numNodes);
+    /*Subcircuits the root does not need first, each from a node
+      without parents, then the root's*/
+    for (int i = 0; i < root; i++) {
+      if (ac->parentStart[i] == ac->parentStart[i+1] && !placed[i]) {
+	numPlaced = post_order(ac, i, placed, stack, next, order, numPlaced);
+      }
+    }
+    numPlaced = post_order(ac, root, placed, stack, next, order, numPlaced);
+    free(next);
+    free(stack);
+    free(placed);
+  }
+  else if (nodeOrder == AC_ORDER_LEVEL) {
+    int n = 0;
+    memcpy(order, ac->levelNode, sizeof(int) * ac->numNodes);
+    /*Subcircuits the root does not need can reach higher levels than the
+      root: move it to the end, the nodes after it keeping their order*/
+    while (order[n] != root) {
+      n++;
+    }
+    memmove(order + n, order + n + 1, sizeof(int) * (root - n));
+    order[root] = root;
+    numPlaced = ac->numNodes;
+  }
+  else {
+    for (int i = 0; i < ac->numNodes; i++) {
+      order[i] = i;
+    }
+    numPlaced = ac->numNodes;
+  }
+
+  reordered = ac_renumber(ac, order, numPlaced, position);
+  ac_compile(reordered);
+  if (remap != NULL) {
+    memcpy(remap, position, sizeof(int) * ac->numNodes);
+  }
+  free(position);
+  free(order);
+  return reordered;
+}
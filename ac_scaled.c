@@ -0,0 +1,256 @@
+/*
+ * File:   ac_scaled.c
+ * Author: andrewchoi
+ *
+ * Scaled evaluation for circuits whose output or derivatives underflow a
+ * double. Every value, derivative and product register is a mantissa with
+ * a power of two exponent of its own. Node mantissas are normalised to
+ * [0.5, 1) once per node; product registers are only renormalised when
+ * they drop below SCALE_FLOOR, so the inner loops stay multiply-add with
+ * an integer add for the exponent. Sums align their terms to the largest
+ * exponent seen so far. The downward pass pulls from the parents like
+ * AC_ENGINE_PULL.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "ac.h"
+
+#define SCALE_FLOOR 0x1p-300 //Smallest register mantissa before renormalising
+#define LOG10_2 0.30102999566398119521
+
+/*
+ * 2^e for e <= 0, flushing to 0 below the normal range
+ */
+static inline double pow2(int e) {
+  union { uint64_t bits; double value; } p;
+
+  if (e < -1022) {
+    return 0;
+  }
+  p.bits = (uint64_t)(e + 1023) << 52;
+  return p.value;
+}
+
+/*
+ * Move the magnitude of a mantissa into its exponent
+ */
+static inline void normalise(double *m, int *e) {
+  union { uint64_t bits; double value; } p;
+  int biased;
+  int shift;
+
+  p.value = *m;
+  biased = (int)((p.bits >> 52) & 0x7ff);
+  if (biased == 0 || biased == 0x7ff) {
+    /*Zero, subnormal, inf or nan*/
+    *m = frexp(*m, &shift);
+    *e = (*m == 0) ? 0 : *e + shift;
+    return;
+  }
+  p.bits = (p.bits & ~(0x7ffULL << 52)) | (1022ULL << 52);
+  *m = p.value;
+  *e += biased - 1022;
+}
+
+/*
+ * acc * 2^accE += m * 2^e. Terms more than 2^1022 below the sum are
+ * dropped.
+ */
+static inline void scaled_add(double *acc, int *accE, double m, int e) {
+  if (m == 0) {
+    return;
+  }
+  if (*acc == 0) {
+    *acc = m;
+    *accE = e;
+  }
+  else if (e > *accE) {
+    *acc = *acc * pow2(*accE - e) + m;
+    *accE = e;
+  }
+  else {
+    *acc += m * pow2(e - *accE);
+  }
+}
+
+/*
+ * Create the scaled state of a compiled circuit. The leaves are read from
+ * the circuit on every upward pass, so ac_set_evidence applies as usual.
+ */
+struct circuit_scaled* ac_scaled_create(const struct circuit *ac) {
+  struct circuit_scaled *sc = (struct circuit_scaled*)malloc(sizeof(struct circuit_scaled));
+  int numRegisters = ac_register_count(ac);
+
+  sc->ac = ac;
+  sc->vr = (double*)calloc(ac->numNodes, sizeof(double));
+  sc->vrExp = (int*)calloc(ac->numNodes, sizeof(int));
+  sc->dr = (double*)calloc(ac->numNodes, sizeof(double));
+  sc->drExp = (int*)calloc(ac->numNodes, sizeof(int));
+  sc->pr = (double*)calloc(numRegisters + 1, sizeof(double));
+  sc->prExp = (int*)calloc(numRegisters + 1, sizeof(int));
+  return sc;
+}
+
+/*
+ * Scaled upward pass
+ */
+void ac_scaled_forward(struct circuit_scaled *sc) {
+  const struct circuit *ac = sc->ac;
+  double *vr = sc->vr;
+  int *vrExp = sc->vrExp;
+
+  for (int i = 0; i < ac->numNodes; i++) {
+    int start = ac->childStart[i];
+    int end = ac->childStart[i+1];
+
+    if (ac->nodeType[i] == '+') {
+      double sum = 0;
+      int sumExp = 0;
+      for (int e = start; e < end; e++) {
+	int c = ac->childIndex[e];
+	scaled_add(&sum, &sumExp, vr[c], vrExp[c]);
+      }
+      vr[i] = sum;
+      vrExp[i] = sumExp;
+    }
+    else if (ac->nodeType[i] == '*') {
+      int w = end - start;
+      double *prL = sc->pr + ac->prStart[i];
+      double *prR = prL + w + 1;
+      int *prLExp = sc->prExp + ac->prStart[i];
+      int *prRExp = prLExp + w + 1;
+      prL[0] = 1;
+      prR[0] = 1;
+      prLExp[0] = 0;
+      prRExp[0] = 0;
+      for (int k = 1, j = end - 1; k <= w; k++, j--) {
+	int left = ac->childIndex[start + k - 1];
+	int right = ac->childIndex[j];
+	prL[k] = prL[k-1] * vr[left];
+	prLExp[k] = prLExp[k-1] + vrExp[left];
+	prR[k] = prR[k-1] * vr[right];
+	prRExp[k] = prRExp[k-1] + vrExp[right];
+	if (fabs(prL[k]) < SCALE_FLOOR) {
+	  normalise(&prL[k], &prLExp[k]);
+	}
+	if (fabs(prR[k]) < SCALE_FLOOR) {
+	  normalise(&prR[k], &prRExp[k]);
+	}
+      }
+      vr[i] = prL[w];
+      vrExp[i] = prLExp[w];
+    }
+    else {
+      /*Leaf, as set in the circuit*/
+      vr[i] = ac->vr[i];
+      vrExp[i] = 0;
+    }
+    normalise(&vr[i], &vrExp[i]);
+  }
+}
+
+/*
+ * Scaled downward pass, every node pulling its derivative from its
+ * parents. Needs the values of the last scaled upward pass.
+ */
+void ac_scaled_backward(struct circuit_scaled *sc) {
+  const struct circuit *ac = sc->ac;
+  double *dr = sc->dr;
+  int *drExp = sc->drExp;
+  int root = ac->numNodes - 1;
+
+  dr[root] = 1;
+  drExp[root] = 0;
+  normalise(&dr[root], &drExp[root]);
+  for (int i = root - 1; i >= 0; i--) {
+    double sum = 0;
+    int sumExp = 0;
+    for (int k = ac->parentStart[i]; k < ac->parentStart[i+1]; k++) {
+      int parent = ac->parentIndex[k];
+      if (ac->nodeType[parent] == '+') {
+	scaled_add(&sum, &sumExp, dr[parent], drExp[parent]);
+      }
+      else {
+	int w = ac->childStart[parent+1] - ac->childStart[parent];
+	int pos = ac->parentPos[k];
+	int left = ac->prStart[parent] + pos;
+	int right = ac->prStart[parent] + w + 1 + (w - pos - 1);
+	scaled_add(&sum, &sumExp, dr[parent] * sc->pr[left] * sc->pr[right],
+		   drExp[parent] + sc->prExp[left] + sc->prExp[right]);
+      }
+    }
+    dr[i] = sum;
+    drExp[i] = sumExp;
+    normalise(&dr[i], &drExp[i]);
+  }
+}
+
+/*
+ * log10 of the value and of the derivative of a node (-inf for 0)
+ */
+double ac_scaled_log10_value(const struct circuit_scaled *sc, int node) {
+  return log10(sc->vr[node]) + sc->vrExp[node] * LOG10_2;
+}
+
+double ac_scaled_log10_derivative(const struct circuit_scaled *sc, int node) {
+  return log10(sc->dr[node]) + sc->drExp[node] * LOG10_2;
+}
+
+/*
+ * Posterior marginals, laid out as for ac_marginals. The ratios are
+ * formed on the scaled values, so they are exact even when P(e)
+ * underflows. Returns P(e) as a plain double.
+ */
+double ac_scaled_marginals(const struct circuit_scaled *sc, double *marginals) {
+  const struct circuit *ac = sc->ac;
+  int root = ac->numNodes - 1;
+  int offset = 0;
+
+  for (int x = 0; x < ac->numVars; x++) {
+    for (int v = 0; v < ac->varCard[x]; v++) {
+      marginals[offset + v] = 0;
+    }
+    for (int l = ac->varLeafStart[x]; l < ac->varLeafStart[x+1]; l++) {
+      int leaf = ac->varLeaf[l];
+      if (ac->varValue[leaf] < ac->varCard[x] && sc->vr[root] != 0) {
+	marginals[offset + ac->varValue[leaf]] += ldexp(sc->dr[leaf] * sc->vr[leaf] / sc->vr[root],
+							 sc->drExp[leaf] + sc->vrExp[leaf] - sc->vrExp[root]);
+      }
+    }
+    offset += ac->varCard[x];
+  }
+  return ldexp(sc->vr[root], sc->vrExp[root]);
+}
+
+/*
+ * Copy the values, derivatives and zero flags into the circuit as plain
+ * doubles; whatever does not fit a double becomes 0 or inf
+ */
+void ac_scaled_store(const struct circuit_scaled *sc, struct circuit *ac) {
+  for (int i = 0; i < ac->numNodes; i++) {
+    ac->vr[i] = ldexp(sc->vr[i], sc->vrExp[i]);
+    ac->dr[i] = ldexp(sc->dr[i], sc->drExp[i]);
+    if (ac->nodeType[i] == '*') {
+      int zeroCount = 0;
+      for (int e = ac->childStart[i]; e < ac->childStart[i+1]; e++) {
+	zeroCount += (sc->vr[ac->childIndex[e]] == 0);
+      }
+      ac->flag[i] = (zeroCount == 1);
+    }
+  }
+}
+
+void ac_scaled_free(struct circuit_scaled *sc) {
+  free(sc->prExp);
+  free(sc->pr);
+  free(sc->drExp);
+  free(sc->dr);
+  free(sc->vrExp);
+  free(sc->vr);
+  free(sc);
+}
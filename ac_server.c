@@ -0,0 +1,524 @@
+/*
+ * File:   ac_server.c
+ * Author: andrewchoi
+ *
+ * Query server over circuits that stay loaded. Requests are lines on
+ * stdin (answered on stdout) or on the connections of a Unix-domain
+ * socket:
+ *   [circuit] evidence   evidence as in an evidence file, for the named
+ *                        circuit or the first one
+ *   list                 the circuits and the cardinalities of their
+ *                        variables
+ *   quit                 close the connection (stdin: stop the server)
+ * and every request is answered by one line:
+ *   ok P(e) log10(P(e)) marginals...   marginals laid out as for
+ *                                      ac_marginals
+ *   ok name:card,card,... ...          for list
+ *   error message
+ * A request line longer than MAX_LINE_LENGTH is answered by an error and
+ * its connection is closed (stdin: the server stops).
+ * All the lines that are waiting, from every connection, are read before
+ * anything is evaluated. The queries of one circuit are then evaluated
+ * together by the batch evaluator (a lone query by the plain passes), up
+ * to SERVER_BATCH_SIZE per round, and the answers go back in order.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+
+#include "ac.h"
+
+#define SERVER_BATCH_SIZE 256 //Queries evaluated per round
+#define SERVER_READ_SIZE 65536
+#define MAX_CLIENTS 1024
+#define MAX_BACKLOG (1 << 20) //Unsent answer bytes before a client's input is left waiting
+#define MAX_LINE_LENGTH (4 << 20) //Longest request line, a client sending more is dropped
+
+/* One connection (or stdin and stdout) */
+struct client {
+  int in;
+  int out;
+  /*Bytes read but not yet consumed as lines*/
+  char *input;
+  size_t length;
+  size_t capacity;
+  /*Bytes read since the last newline*/
+  size_t lineLength;
+  /*Answers not written yet*/
+  char *output;
+  size_t outputLength;
+  size_t outputCapacity;
+  /*No more input will come*/
+  bool closed;
+  /*Answers can no longer be written*/
+  bool broken;
+};
+
+/* Queries of the current round for one circuit */
+struct server_circuit {
+  struct circuit *ac;
+  const char *name;
+  struct circuit_batch *batch;
+  int numMarginals;
+  int count;
+  int *evidence;
+  double *output;
+  double *marginals;
+};
+
+/* A request of the current round, answered in this order */
+struct request {
+  int client;
+  /*Circuit and instance of a query, circuit -1 if 'text' is the answer*/
+  int circuit;
+  int instance;
+  const char *text;
+};
+
+static volatile sig_atomic_t stopping = 0;
+
+static void stop_server(int signal) {
+  (void)signal;
+  stopping = 1;
+}
+
+static void append(struct client *c, const char *text, size_t length) {
+  if (c->outputLength + length > c->outputCapacity) {
+    while (c->outputLength + length > c->outputCapacity) {
+      c->outputCapacity = (c->outputCapacity > 0) ? 2 * c->outputCapacity : SERVER_READ_SIZE;
+    }
+    c->output = (char*)realloc(c->output, c->outputCapacity);
+  }
+  memcpy(c->output + c->outputLength, text, length);
+  c->outputLength += length;
+}
+
+static void append_double(struct client *c, double value) {
+  char field[AC_MAX_NUMBER_LENGTH + 1];
+  field[0] = ' ';
+  append(c, field, 1 + ac_format_double(field + 1, value));
+}
+
+/*
+ * Write the answers of a client as far as it takes them (all of them on
+ * stdout), marking it broken if writing fails
+ */
+static void flush_client(struct client *c) {
+  size_t written = 0;
+
+  while (written < c->outputLength && !c->broken) {
+    ssize_t n = write(c->out, c->output + written, c->outputLength - written);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    if (n <= 0) {
+      c->broken = true;
+      break;
+    }
+    written += n;
+  }
+  if (c->broken) {
+    c->outputLength = 0;
+  }
+  else if (written > 0) {
+    memmove(c->output, c->output + written, c->outputLength - written);
+    c->outputLength -= written;
+  }
+}
+
+/*
+ * Read what is waiting on a client. At the end of its input the client
+ * is closed and an unterminated last line is terminated. A client whose
+ * line grows past MAX_LINE_LENGTH is answered by an error, its input is
+ * dropped and it is closed.
+ */
+static void read_client(struct client *c) {
+  ssize_t n;
+
+  if (c->capacity - c->length < SERVER_READ_SIZE) {
+    c->capacity = c->length + 2 * SERVER_READ_SIZE;
+    c->input = (char*)realloc(c->input, c->capacity);
+  }
+  do {
+    n = read(c->in, c->input + c->length, c->capacity - c->length - 2);
+  } while (n < 0 && errno == EINTR);
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return;
+  }
+  if (n <= 0) {
+    c->closed = true;
+    if (c->length > 0 && c->input[c->length - 1] != '\n') {
+      c->input[c->length++] = '\n';
+    }
+    return;
+  }
+  /*The line left open after the last newline read*/
+  char *chunk = c->input + c->length;
+  ssize_t end = n;
+  while (end > 0 && chunk[end - 1] != '\n') {
+    end--;
+  }
+  c->lineLength = (end > 0) ? (size_t)(n - end) : c->lineLength + n;
+  c->length += n;
+  if (c->lineLength > MAX_LINE_LENGTH) {
+    const char *error = "error request line too long\n";
+    append(c, error, strlen(error));
+    c->length = 0;
+    c->closed = true;
+  }
+}
+
+/*
+ * Take the next complete line of a client, NULL if there is none. The
+ * line stays valid until the client's input is consumed.
+ */
+static char* next_line(struct client *c, size_t *consumed) {
+  char *start = c->input + *consumed;
+  char *newline = memchr(start, '\n', c->length - *consumed);
+
+  if (newline == NULL) {
+    return NULL;
+  }
+  *newline = '\0';
+  if (newline > start && newline[-1] == '\r') {
+    newline[-1] = '\0';
+  }
+  *consumed = newline + 1 - c->input;
+  return start;
+}
+
+/*
+ * Turn one line into a request. Returns false for a blank line.
+ */
+static bool parse_request(char *line, struct server_circuit *circuits, int numCircuits,
+			  struct request *r, char *listAnswer, bool *quit) {
+  char *rest = line;
+  size_t nameLength;
+  int target = 0;
+
+  while (isspace((unsigned char)*rest)) {
+    rest++;
+  }
+  if (*rest == '\0') {
+    return false;
+  }
+  nameLength = strcspn(rest, " \t");
+
+  r->circuit = -1;
+  if (nameLength == 4 && strncmp(rest, "quit", 4) == 0) {
+    *quit = true;
+    return false;
+  }
+  if (nameLength == 4 && strncmp(rest, "list", 4) == 0) {
+    r->text = listAnswer;
+    return true;
+  }
+  if (isalpha((unsigned char)*rest) || *rest == '_') {
+    target = -1;
+    for (int k = 0; k < numCircuits; k++) {
+      if (strlen(circuits[k].name) == nameLength && strncmp(rest, circuits[k].name, nameLength) == 0) {
+	target = k;
+      }
+    }
+    if (target < 0) {
+      r->text = "error unknown circuit\n";
+      return true;
+    }
+    rest += nameLength;
+  }
+
+  struct server_circuit *sc = &circuits[target];
+  int *evidence = sc->evidence + (size_t)sc->count * (sc->ac->numVars + 1);
+  int status = ac_parse_evidence(rest, sc->ac, evidence);
+  if (status < 0) {
+    r->text = "error invalid evidence, need one value per variable, each below its cardinality or *\n";
+    return true;
+  }
+  if (status == 0) {
+    /*A name without evidence: nothing observed*/
+    for (int x = 0; x < sc->ac->numVars; x++) {
+      evidence[x] = -1;
+    }
+  }
+  r->circuit = target;
+  r->instance = sc->count++;
+  return true;
+}
+
+/*
+ * Evaluate the queries of one circuit gathered this round
+ */
+static void evaluate_round(struct server_circuit *sc) {
+  struct circuit *ac = sc->ac;
+  int stride = ac->numVars + 1;
+
+  if (sc->count == 1) {
+    ac_set_evidence(ac, sc->evidence);
+    ac_forward(ac);
+    ac_backward(ac);
+    sc->output[0] = ac_marginals(ac, sc->marginals);
+    return;
+  }
+  if (sc->batch == NULL) {
+    sc->batch = ac_batch_create(ac, SERVER_BATCH_SIZE);
+  }
+  for (int k = 0; k < sc->count; k++) {
+    ac_batch_set_evidence(sc->batch, k, sc->evidence + (size_t)k * stride);
+  }
+  ac_batch_evaluate_instances(sc->batch, sc->count);
+  for (int k = 0; k < sc->count; k++) {
+    sc->output[k] = ac_batch_marginals(sc->batch, k, sc->marginals + (size_t)k * sc->numMarginals);
+  }
+}
+
+/*
+ * Open a listening Unix-domain socket at 'path', -1 on failure
+ */
+static int open_socket(const char *path) {
+  struct sockaddr_un address;
+  struct stat existing;
+  int fd;
+
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "Socket path %s is too long\n", path);
+    return -1;
+  }
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, path);
+  if (stat(path, &existing) == 0 && S_ISSOCK(existing.st_mode)) {
+    /*Left behind by an earlier server*/
+    unlink(path);
+  }
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(fd, 64) != 0) {
+    fprintf(stderr, "Unable to listen on %s\n", path);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  return fd;
+}
+
+static void free_client(struct client *c) {
+  if (c->in > STDIN_FILENO) {
+    close(c->in);
+  }
+  free(c->input);
+  free(c->output);
+}
+
+/*
+ * Answer queries on the circuits until stdin ends ('socketPath' NULL) or
+ * the server is interrupted. 'names' are the names requests use for the
+ * circuits. Returns EXIT_FAILURE if the socket can not be opened.
+ */
+int ac_serve(struct circuit **acs, const char **names, int numCircuits, const char *socketPath) {
+  struct server_circuit *circuits = (struct server_circuit*)calloc(numCircuits, sizeof(struct server_circuit));
+  struct client *clients = (struct client*)calloc(MAX_CLIENTS, sizeof(struct client));
+  struct pollfd *polls = (struct pollfd*)malloc(sizeof(struct pollfd) * (MAX_CLIENTS + 1));
+  struct request *requests = (struct request*)malloc(sizeof(struct request) * SERVER_BATCH_SIZE);
+  size_t *consumed = (size_t*)calloc(MAX_CLIENTS, sizeof(size_t));
+  char *listAnswer;
+  size_t listLength = 4;
+  int numClients = 0;
+  int listener = -1;
+  bool pending = false;
+
+  if (socketPath != NULL) {
+    listener = open_socket(socketPath);
+    if (listener < 0) {
+      free(consumed);
+      free(requests);
+      free(polls);
+      free(clients);
+      free(circuits);
+      return (EXIT_FAILURE);
+    }
+  }
+  else {
+    clients[0].in = STDIN_FILENO;
+    clients[0].out = STDOUT_FILENO;
+    numClients = 1;
+  }
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGINT, stop_server);
+  signal(SIGTERM, stop_server);
+
+  for (int k = 0; k < numCircuits; k++) {
+    struct server_circuit *sc = &circuits[k];
+    sc->ac = acs[k];
+    sc->name = names[k];
+    sc->numMarginals = ac_marginal_count(acs[k]);
+    sc->evidence = (int*)malloc(sizeof(int) * SERVER_BATCH_SIZE * (acs[k]->numVars + 1));
+    sc->output = (double*)malloc(sizeof(double) * SERVER_BATCH_SIZE);
+    sc->marginals = (double*)malloc(sizeof(double) * SERVER_BATCH_SIZE * (sc->numMarginals + 1));
+    listLength += strlen(names[k]) + 2 + 12 * (acs[k]->numVars + 1);
+  }
+  listAnswer = (char*)malloc(listLength + 2);
+  strcpy(listAnswer, "ok");
+  for (int k = 0; k < numCircuits; k++) {
+    size_t at = strlen(listAnswer);
+    at += sprintf(listAnswer + at, " %s:", names[k]);
+    for (int x = 0; x < acs[k]->numVars; x++) {
+      at += sprintf(listAnswer + at, (x == 0) ? "%d" : ",%d", acs[k]->varCard[x]);
+    }
+  }
+  strcat(listAnswer, "\n");
+
+  while (!stopping && (socketPath != NULL || !clients[0].closed || pending)) {
+    int numPolls = 0;
+    int numRequests = 0;
+
+    /*Wait for input, or only look if lines are left from the last round*/
+    if (listener >= 0) {
+      polls[numPolls].fd = listener;
+      polls[numPolls++].events = POLLIN;
+    }
+    for (int c = 0; c < numClients; c++) {
+      struct client *client = &clients[c];
+      bool reading = !client->closed && client->outputLength < MAX_BACKLOG;
+      polls[numPolls].fd = client->broken ? -1 : client->in;
+      polls[numPolls++].events = (reading ? POLLIN : 0) | (client->outputLength > 0 ? POLLOUT : 0);
+    }
+    if (poll(polls, numPolls, pending ? 0 : -1) < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+      break;
+    }
+    if (listener >= 0 && (polls[0].revents & POLLIN)) {
+      int fd = accept(listener, NULL, NULL);
+      if (fd >= 0 && numClients < MAX_CLIENTS) {
+	memset(&clients[numClients], 0, sizeof(struct client));
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	clients[numClients].in = fd;
+	clients[numClients].out = fd;
+	consumed[numClients] = 0;
+	numClients++;
+      }
+      else if (fd >= 0) {
+	close(fd);
+      }
+    }
+    for (int c = 0, p = (listener >= 0); c < numClients; c++, p++) {
+      if ((polls[p].revents & (POLLIN | POLLHUP | POLLERR)) && !clients[c].closed
+	  && clients[c].outputLength < MAX_BACKLOG) {
+	read_client(&clients[c]);
+      }
+    }
+
+    /*Gather the waiting lines of every client*/
+    for (int c = 0; c < numClients; c++) {
+      struct client *client = &clients[c];
+      char *line;
+      bool quit = false;
+      if (client->input == NULL || client->broken || client->outputLength >= MAX_BACKLOG) {
+	continue;
+      }
+      client->input[client->length] = '\0';
+      while (numRequests < SERVER_BATCH_SIZE && !quit
+	     && (line = next_line(client, &consumed[c])) != NULL) {
+	struct request *r = &requests[numRequests];
+	if (parse_request(line, circuits, numCircuits, r, listAnswer, &quit)) {
+	  r->client = c;
+	  numRequests++;
+	}
+      }
+      if (quit) {
+	client->closed = true;
+	consumed[c] = client->length;
+      }
+    }
+
+    for (int k = 0; k < numCircuits; k++) {
+      if (circuits[k].count > 0) {
+	evaluate_round(&circuits[k]);
+      }
+    }
+    for (int n = 0; n < numRequests; n++) {
+      struct request *r = &requests[n];
+      struct client *client = &clients[r->client];
+      if (r->circuit < 0) {
+	append(client, r->text, strlen(r->text));
+	continue;
+      }
+      struct server_circuit *sc = &circuits[r->circuit];
+      const double *marginals = sc->marginals + (size_t)r->instance * sc->numMarginals;
+      double output = sc->output[r->instance];
+      append(client, "ok", 2);
+      append_double(client, output);
+      append_double(client, log10(output));
+      for (int m = 0; m < sc->numMarginals; m++) {
+	append_double(client, marginals[m]);
+      }
+      append(client, "\n", 1);
+    }
+    for (int k = 0; k < numCircuits; k++) {
+      circuits[k].count = 0;
+    }
+
+    /*Answer, drop consumed input and closed clients, and see whether
+      lines are left for another round*/
+    pending = false;
+    for (int c = 0; c < numClients; c++) {
+      struct client *client = &clients[c];
+      flush_client(client);
+      if (consumed[c] > 0) {
+	memmove(client->input, client->input + consumed[c], client->length - consumed[c]);
+	client->length -= consumed[c];
+	consumed[c] = 0;
+      }
+      bool waiting = client->input != NULL && memchr(client->input, '\n', client->length) != NULL;
+      if (!client->broken && waiting && client->outputLength < MAX_BACKLOG) {
+	pending = true;
+      }
+      if (listener >= 0 && (client->broken || (client->closed && !waiting && client->outputLength == 0))) {
+	free_client(client);
+	clients[c] = clients[--numClients];
+	consumed[c] = consumed[numClients];
+	c--;
+      }
+    }
+  }
+
+  for (int c = 0; c < numClients; c++) {
+    free_client(&clients[c]);
+  }
+  if (listener >= 0) {
+    close(listener);
+    unlink(socketPath);
+  }
+  for (int k = 0; k < numCircuits; k++) {
+    if (circuits[k].batch != NULL) {
+      ac_batch_free(circuits[k].batch);
+    }
+    free(circuits[k].marginals);
+    free(circuits[k].output);
+    free(circuits[k].evidence);
+  }
+  free(listAnswer);
+  free(consumed);
+  free(requests);
+  free(polls);
+  free(clients);
+  free(circuits);
+  return (EXIT_SUCCESS);
+}
@@ -0,0 +1,362 @@
+/*
+ * File:   ac_simplify.c
+ * Author: andrewchoi
+ *
+ * Simplification of a compiled circuit into a smaller equivalent one.
+ * The nodes are rebuilt in file order, each from the rebuilt children:
+ *   - constant children are folded into one constant, a '*' node with a
+ *     zero constant child becomes the constant 0, and a node whose
+ *     children are all constants becomes a constant
+ *   - a node left with a single child is replaced by that child
+ *   - the children of '+' and '*' nodes are sorted, and a node equal to
+ *     one built before it (same type, same children, or the same constant
+ *     or indicator) is replaced by that node
+ *   - optionally, '*' nodes wider than a given fan-in become balanced
+ *     trees of '*' nodes of at most that fan-in
+ * Nodes the root no longer depends on are dropped, except the indicator
+ * leaves, so evidence and marginals cover the same variables as before.
+ * Specializing on partial evidence runs the same rebuild with the
+ * observed indicators turned into constants first.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "ac.h"
+
+/* Circuit under construction, with its table of distinct nodes */
+struct builder {
+  struct circuit *ac;
+  int nodeCapacity;
+  int edgeCapacity;
+  /*Open addressing table of node indices, -1 for an empty slot*/
+  int *table;
+  int tableSize;
+};
+
+static int compare_ints(const void *a, const void *b) {
+  int x = *(const int*)a;
+  int y = *(const int*)b;
+  return (x > y) - (x < y);
+}
+
+/*
+ * Hash of a node: its type, indicator, constant bits and children
+ */
+static uint64_t node_hash(char type, int var, int value, double constant,
+			  const int *children, int numChildren) {
+  uint64_t h = 1469598103934665603ULL ^ (unsigned char)type;
+  uint64_t bits = 0;
+
+  if (type == 'n') {
+    memcpy(&bits, &constant, sizeof(bits));
+  }
+  else if (type == 'v') {
+    bits = ((uint64_t)(uint32_t)var << 32) | (uint32_t)value;
+  }
+  h = (h ^ bits) * 1099511628211ULL;
+  for (int k = 0; k < numChildren; k++) {
+    h = (h ^ (uint32_t)children[k]) * 1099511628211ULL;
+  }
+  return h ^ (h >> 29);
+}
+
+static bool node_equals(const struct circuit *ac, int i, char type, int var, int value,
+			double constant, const int *children, int numChildren) {
+  if (ac->nodeType[i] != type) {
+    return false;
+  }
+  if (type == 'n') {
+    return memcmp(&ac->vr[i], &constant, sizeof(double)) == 0;
+  }
+  if (type == 'v') {
+    return ac->varIndex[i] == var && ac->varValue[i] == value;
+  }
+  return ac->childStart[i+1] - ac->childStart[i] == numChildren
+    && memcmp(ac->childIndex + ac->childStart[i], children, sizeof(int) * numChildren) == 0;
+}
+
+static void grow_table(struct builder *b) {
+  int *old = b->table;
+  int oldSize = b->tableSize;
+  const struct circuit *ac = b->ac;
+
+  b->tableSize = 2 * oldSize;
+  b->table = (int*)malloc(sizeof(int) * b->tableSize);
+  memset(b->table, -1, sizeof(int) * b->tableSize);
+  for (int s = 0; s < oldSize; s++) {
+    int i = old[s];
+    if (i >= 0) {
+      const int *children = ac->childIndex + ac->childStart[i];
+      uint64_t h = node_hash(ac->nodeType[i], ac->varIndex[i], ac->varValue[i], ac->vr[i],
+			     children, ac->childStart[i+1] - ac->childStart[i]);
+      int slot = (int)(h & (b->tableSize - 1));
+      while (b->table[slot] >= 0) {
+	slot = (slot + 1) & (b->tableSize - 1);
+      }
+      b->table[slot] = i;
+    }
+  }
+  free(old);
+}
+
+/*
+ * Index of the node with the given contents, added if there is none yet.
+ * The children must already be sorted for '+' and '*' nodes.
+ */
+static int add_node(struct builder *b, char type, int var, int value, double constant,
+		    const int *children, int numChildren) {
+  struct circuit *ac = b->ac;
+  uint64_t h = node_hash(type, var, value, constant, children, numChildren);
+  int slot = (int)(h & (b->tableSize - 1));
+  int i;
+
+  while (b->table[slot] >= 0) {
+    if (node_equals(ac, b->table[slot], type, var, value, constant, children, numChildren)) {
+      return b->table[slot];
+    }
+    slot = (slot + 1) & (b->tableSize - 1);
+  }
+
+  i = ac->numNodes;
+  if (i == b->nodeCapacity) {
+    b->nodeCapacity *= 2;
+    ac_resize(ac, b->nodeCapacity);
+  }
+  if (ac->numEdges + numChildren > b->edgeCapacity) {
+    while (ac->numEdges + numChildren > b->edgeCapacity) {
+      b->edgeCapacity *= 2;
+    }
+    ac->childIndex = (int*)realloc(ac->childIndex, sizeof(int) * b->edgeCapacity);
+  }
+  ac->nodeType[i] = type;
+  ac->varIndex[i] = (type == 'v') ? var : -1;
+  ac->varValue[i] = (type == 'v') ? value : -1;
+  ac->vr[i] = (type == 'n') ? constant : (type == 'v') ? value : 0;
+  ac->dr[i] = 0;
+  ac->flag[i] = false;
+  if (numChildren > 0) {
+    memcpy(ac->childIndex + ac->numEdges, children, sizeof(int) * numChildren);
+  }
+  ac->numEdges += numChildren;
+  ac->childStart[i+1] = ac->numEdges;
+  ac->numNodes++;
+
+  b->table[slot] = i;
+  if (2 * ac->numNodes > b->tableSize) {
+    grow_table(b);
+  }
+  return i;
+}
+
+static int add_constant(struct builder *b, double constant) {
+  return add_node(b, 'n', -1, -1, constant, NULL, 0);
+}
+
+/*
+ * Add a '*' node over 'children' (sorted, in place), as a balanced tree
+ * of nodes with at most 'maxFanIn' children if 'maxFanIn' > 1
+ */
+static int add_product(struct builder *b, int *children, int numChildren, int maxFanIn) {
+  while (maxFanIn > 1 && numChildren > maxFanIn) {
+    int numGroups = (numChildren + maxFanIn - 1) / maxFanIn;
+    for (int g = 0; g < numGroups; g++) {
+      /*Spread the children evenly over the groups*/
+      int start = (int)((long)g * numChildren / numGroups);
+      int end = (int)((long)(g + 1) * numChildren / numGroups);
+      children[g] = (end - start == 1) ? children[start]
+	: add_node(b, '*', -1, -1, 0, children + start, end - start);
+    }
+    numChildren = numGroups;
+    qsort(children, numChildren, sizeof(int), compare_ints);
+  }
+  return add_node(b, '*', -1, -1, 0, children, numChildren);
+}
+
+/*
+ * Rebuild operation node i of 'ac' from the rebuilt children 'map'
+ */
+static int simplify_operation(struct builder *b, const struct circuit *ac, int i, const int *map,
+			      int *children, int maxFanIn) {
+  const struct circuit *out = b->ac;
+  bool product = (ac->nodeType[i] == '*');
+  double constant = product ? 1 : 0;
+  int numConstants = 0;
+  int numChildren = 0;
+
+  for (int e = ac->childStart[i]; e < ac->childStart[i+1]; e++) {
+    int c = map[ac->childIndex[e]];
+    if (out->nodeType[c] == 'n') {
+      if (product) {
+	constant *= out->vr[c];
+      }
+      else {
+	constant += out->vr[c];
+      }
+      numConstants++;
+    }
+    else {
+      children[numChildren++] = c;
+    }
+  }
+
+  if (numChildren == 0 || (product && constant == 0)) {
+    return add_constant(b, constant);
+  }
+  if (numConstants > 0 && constant != (product ? 1 : 0)) {
+    children[numChildren++] = add_constant(b, constant);
+  }
+  if (numChildren == 1) {
+    return children[0];
+  }
+  qsort(children, numChildren, sizeof(int), compare_ints);
+  if (product) {
+    return add_product(b, children, numChildren, maxFanIn);
+  }
+  return add_node(b, '+', -1, -1, 0, children, numChildren);
+}
+
+/*
+ * Copy the nodes of 'work' that are kept into a new circuit, in order
+ * but with the root last. Returns the new index of every node of 'work'
+ * in 'position' (-1 if dropped).
+ */
+static struct circuit* compact(const struct circuit *work, int root, int *position) {
+  struct circuit *ac;
+  bool *kept = (bool*)calloc(work->numNodes, sizeof(bool));
+  int *order = (int*)malloc(sizeof(int) * work->numNodes);
+  int numKept = 0;
+
+  kept[root] = true;
+  for (int i = root; i >= 0; i--) {
+    if (kept[i]) {
+      for (int e = work->childStart[i]; e < work->childStart[i+1]; e++) {
+	kept[work->childIndex[e]] = true;
+      }
+    }
+  }
+  for (int i = 0; i < work->numNodes; i++) {
+    if (work->nodeType[i] == 'v') {
+      kept[i] = true;
+    }
+  }
+
+  /*The root goes last; only leaves can follow it in 'work'*/
+  for (int i = 0; i < work->numNodes; i++) {
+    if (kept[i] && i != root) {
+      order[numKept++] = i;
+    }
+  }
+  order[numKept++] = root;
+  ac = ac_renumber(work, order, numKept, position);
+  free(order);
+  free(kept);
+  return ac;
+}
+
+/*
+ * Rebuild a compiled circuit as described above, the indicator leaves of
+ * the variables 'evidence' observes (if not NULL) becoming constants
+ */
+static struct circuit* rebuild(const struct circuit *ac, const int *evidence, int maxFanIn, int *remap) {
+  struct builder b;
+  struct circuit *simplified;
+  int *map = (int*)malloc(sizeof(int) * ac->numNodes);
+  int *children = (int*)malloc(sizeof(int) * (ac->numEdges + 2));
+  int *position;
+
+  b.nodeCapacity = ac->numNodes + 1;
+  b.edgeCapacity = ac->numEdges + 1;
+  b.ac = ac_allocate(b.nodeCapacity);
+  b.ac->childIndex = (int*)realloc(b.ac->childIndex, sizeof(int) * b.edgeCapacity);
+  b.tableSize = 1024;
+  while (b.tableSize < 2 * b.nodeCapacity) {
+    b.tableSize *= 2;
+  }
+  b.table = (int*)malloc(sizeof(int) * b.tableSize);
+  memset(b.table, -1, sizeof(int) * b.tableSize);
+
+  for (int i = 0; i < ac->numNodes; i++) {
+    if (ac->nodeType[i] == 'n') {
+      map[i] = add_constant(&b, ac->vr[i]);
+    }
+    else if (ac->nodeType[i] == 'v' && evidence != NULL && evidence[ac->varIndex[i]] >= 0) {
+      map[i] = add_constant(&b, evidence[ac->varIndex[i]] == ac->varValue[i]);
+    }
+    else if (ac->nodeType[i] == 'v') {
+      map[i] = add_node(&b, 'v', ac->varIndex[i], ac->varValue[i], 0, NULL, 0);
+    }
+    else {
+      map[i] = simplify_operation(&b, ac, i, map, children, maxFanIn);
+    }
+  }
+
+  position = (int*)malloc(sizeof(int) * (b.ac->numNodes + 1));
+  b.ac->numVars = ac->numVars;
+  b.ac->varCard = ac->varCard;
+  simplified = compact(b.ac, map[ac->numNodes - 1], position);
+  b.ac->varCard = NULL;
+  ac_compile(simplified);
+
+  if (remap != NULL) {
+    for (int i = 0; i < ac->numNodes; i++) {
+      remap[i] = position[map[i]];
+    }
+  }
+  free(position);
+  free(b.table);
+  ac_free(b.ac);
+  free(children);
+  free(map);
+  return simplified;
+}
+
+/*
+ * Build a simplified, compiled copy of a compiled circuit. '*' nodes
+ * wider than 'maxFanIn' are split into balanced trees unless 'maxFanIn'
+ * is 0. If 'remap' is not NULL, remap[i] is set to the node of the copy
+ * with the value of node i of 'ac', or -1 if the root does not depend on
+ * it. The indicator leaves keep their variable and value, so marginals
+ * are the same. Derivatives only carry over for the indicators: a node
+ * shared by several old nodes gets the sum of their derivatives.
+ */
+struct circuit* ac_simplify(const struct circuit *ac, int maxFanIn, int *remap) {
+  return rebuild(ac, NULL, maxFanIn, remap);
+}
+
+/*
+ * Build a simplified copy of a compiled circuit specialized on a partial
+ * evidence assignment (-1 for the free variables): the indicator leaves
+ * of the observed variables become the constants 1 and 0 and are folded
+ * away with everything that only depended on them. The copy keeps the
+ * variables and cardinalities, so evidence files and marginal tables
+ * stay laid out as before; its output for evidence on the free variables
+ * is that of the original circuit for the combined evidence, whatever the
+ * evidence says about the fixed variables. The fixed variables have no
+ * leaves left, see ac_fixed_marginals. 'maxFanIn' and 'remap' are as for
+ * ac_simplify.
+ */
+struct circuit* ac_specialize(const struct circuit *ac, const int *evidence, int maxFanIn, int *remap) {
+  return rebuild(ac, evidence, maxFanIn, remap);
+}
+
+/*
+ * Fill the entries of the variables a circuit was specialized on into a
+ * marginal table (laid out as for ac_marginals): the observed value has
+ * probability 1
+ */
+void ac_fixed_marginals(const struct circuit *ac, const int *evidence, double *marginals) {
+  int offset = 0;
+
+  for (int x = 0; x < ac->numVars; x++) {
+    if (evidence[x] >= 0) {
+      for (int v = 0; v < ac->varCard[x]; v++) {
+	marginals[offset + v] = (v == evidence[x]);
+      }
+    }
+    offset += ac->varCard[x];
+  }
+}
@@ -1,4 +1,4 @@
-/* 
+/*
  * File:   main.c
  * Author: andrewchoi
  *
@@ -7,487 +7,828 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
-#include <assert.h>
 #include <math.h>
+#include <unistd.h>
+
+#include "ac.h"
 
-/* 
- * Reads an .ac file by argument and calculates the circuit output and 
+/*
+ * Reads an .ac file by argument and calculates the circuit output and
  * partial derivatives for every node.
- * The circuit is stored in an adjacency list.
- * Each non-leaf node storess its children in a linked list.
+ * The circuit is compiled once at load time (see ac_circuit.c) and can then
+ * be evaluated against any number of evidence assignments.
+ *
+ * Usage: ac [-O [-k fan_in] | -x fixed_evidence] [-r order] [-w out.acb|out.ac | -g out.c] [-m engine] [-t threads [-D schedule] | -s | -l code.so | -P] [-p | -q vars] [-f format] [-o out_file] [-e evidence_file [-b batch_size | -i]] file.ac [size]
+ *        ac [-O [-k fan_in]] [-r order] [-m engine] -S socket|- file.ac ...
+ * Without evidence the indicator values written in the file are used and
+ * every node is printed. With an evidence file every line is one query and
+ * the circuit output is printed per query. With a batch size the queries
+ * are read and evaluated batch_size at a time by the SIMD batch evaluator.
+ * With -i every query only recomputes what changed since the previous one.
+ * With -P the passes skip the '*' nodes the evidence forces to zero and,
+ * downward, every node whose derivative is zero (see ac_prune.c).
+ * With -p the posterior marginals of every variable are printed, one line
+ * per variable, instead of the node list. With -q and comma separated
+ * variable numbers only their marginals are printed, and the downward
+ * pass only visits their leaves and the ancestors (see ac_query.c).
+ * -f selects how results are written (see ac_output.c): "text" (default),
+ * "none", "root", "marginals", "csv" or "binary", to stdout or to the
+ * file given by -o. Progress messages are only printed with "text".
+ * With -s every value and derivative carries its own exponent, so circuits
+ * whose output underflows a double still evaluate (see ac_scaled.c).
+ * Without -s an output that is 0, or an output or indicator derivative
+ * that does not fit a double, is checked with the scaled passes, and the
+ * run switches to them if a value underflowed or overflowed; with an
+ * evidence file every such query is evaluated again scaled.
+ * With more than one thread both passes run on a thread pool, by default
+ * level by level; with -D dataflow every group of nodes runs as soon as
+ * its inputs are done, without level barriers (see ac_dataflow.c).
+ * The engine selects how derivatives are computed: "cache" pushes them from
+ * every node to its children, "pull" gathers them from the parents, "bit"
+ * is bit-encoded propagation without product registers. By default
+ * ("auto") the engine is chosen from the circuit's statistics and the
+ * reasons are logged to stderr.
+ * With -O the circuit is simplified after loading (see ac_simplify.c):
+ * constants are folded, trivial and duplicate nodes removed, and with -k
+ * '*' nodes wider than fan_in are split into balanced trees. Marginals
+ * and the output are those of the original circuit; the node list and the
+ * per-node formats show the nodes of the simplified one.
+ * -r renumbers the nodes for locality (see ac_reorder.c): "file"
+ * (default), "dfs" or "level"; with text output the reuse distances
+ * before and after are logged to stderr. Like -O it changes the node
+ * list, not the results.
+ * With -S every circuit on the command line is loaded once and evidence
+ * queries are answered, with their output and marginals, until the
+ * server is stopped (see ac_server.c): on a Unix-domain socket at the
+ * given path, or with "-" line by line on stdin and stdout.
+ * With -x the circuit is specialized on the first assignment of an
+ * evidence file (see ac_simplify.c): the observed indicators become
+ * constants and are folded away, so the smaller circuit answers queries
+ * on the other variables; the marginals of the fixed variables are their
+ * observed values.
+ * With -w the compiled circuit is written to a binary .acb file, which can
+ * be passed instead of the .ac file to skip parsing and compiling, or to
+ * an .ac file if the name ends in ".ac".
+ * With -g the passes of the circuit are written as straight-line C code
+ * (see ac_codegen.c); built as a shared object, it is passed with -l to
+ * run the passes of the same circuit (with the same -O and -r) instead of
+ * the engine. The generated passes leave the derivatives of the constants
+ * at 0.
  */
 
-/* 
- * GLOBAL VARIABLES 
+/*
+ * GLOBAL VARIABLES
  */
-struct node **circuit; //Arithmetic Circuit Structure
+struct thread_pool *pool = NULL; //Level-synchronous workers (if -t > 1)
+struct circuit_scaled *scaled = NULL; //Scaled values and derivatives (if -s)
+struct circuit_code *code = NULL; //Generated passes (if -l)
+struct output_sink *sink = NULL; //Where query results go
+bool verbose = true; //Progress messages (text output only)
+bool prune = false; //Pruned passes on one thread (if -P)
+struct circuit_query *cone = NULL; //Cone of the query variables (if -q)
+int *fixed = NULL; //Partial evidence the circuit is specialized on (if -x)
 
-/* 
- * CONSTANTS
+/*
+ * Upward and downward pass, on the thread pool if there is one
  */
-#define MAX_NODE_NUMBER 50000 //Program assumes max AC size of 50000 (if not specified)
-#define MAX_LINE_NUMBER 20000
-#define NODE_SAFETY_MARGIN 20 //Adds 20 to the AC size that user specified
+static void forward(struct circuit *ac) {
+  if (scaled != NULL) {
+    ac_scaled_forward(scaled);
+    ac_scaled_store(scaled, ac);
+  }
+  else if (code != NULL) {
+    ac_code_forward(code, ac);
+  }
+  else if (pool != NULL) {
+    ac_parallel_forward(pool);
+  }
+  else if (prune) {
+    ac_pruned_forward(ac);
+  }
+  else {
+    ac_forward(ac);
+  }
+}
+
+static void backward(struct circuit *ac) {
+  if (scaled != NULL) {
+    ac_scaled_backward(scaled);
+    ac_scaled_store(scaled, ac);
+  }
+  else if (code != NULL) {
+    ac_code_backward(code, ac);
+  }
+  else if (pool != NULL) {
+    ac_parallel_backward(pool);
+  }
+  else if (cone != NULL) {
+    ac_query_backward(cone);
+  }
+  else if (prune) {
+    ac_pruned_backward(ac);
+  }
+  else {
+    ac_backward(ac);
+  }
+}
 
 /*
- * STRUCTURES
+ * log10 of the circuit output, exact in scaled mode even if the output
+ * underflowed
  */
+static double output_log10(const struct circuit *ac) {
+  if (scaled != NULL) {
+    return ac_scaled_log10_value(scaled, ac->numNodes - 1);
+  }
+  return log10(ac->vr[ac->numNodes - 1]);
+}
 
-/* Node Structure
-   Children and flag only apply to non-leaf nodes */
-struct node {
-  /*Node type can be 'n' or 'v' for leaf nodes
-    Node type can be '+' or '-' for non-leaf nodes */
-  char nodeType; 
-  /*Node index, e.g. "Third variable: n=2*/
-  int index;
-  /*Value of the node*/
-  double vr; 
-  /*Derivative of the node*/
-  double dr;
-  /*Bit flag, true means there is exactly one child that is zero*/
-  bool flag;
-  /*Linked list of child nodes*/
-  struct childList *childHead;
-  //int numChildren; 
-  /*Product registers*/
-  double *prL;
-  double *prR;
-};
-
-/* List of child nodes of a non-leaf node */
-struct childList {
-  int numChildren; //number of children nodes of the parent node
-  //int position; //Child node position, relative to other children. Left-most is position 1. 
-  int childIndex; //circuit index of child node
-  struct childList *next; 
-};
-
-
-/* 
- * FUNCTIONS
+/*
+ * Hand the result of the last downward pass to the sink
  */
-
-struct node* allocate_constant_node(char* line, struct node* n) {
-  n = (struct node*)malloc(sizeof(struct node));
-  sscanf(line, "%s %lf", &(n->nodeType), &(n->vr));
-  n->dr = 0;
-  n->flag = false;
-  n->childHead = NULL;
-  n->prL = NULL;
-  n->prR = NULL;
-  return n;
+static void report_query(const struct circuit *ac, int query) {
+  if (sink->marginals != NULL) {
+    if (scaled != NULL) {
+      ac_scaled_marginals(scaled, sink->marginals);
+    }
+    else if (cone != NULL) {
+      ac_query_marginals(cone, sink->marginals);
+    }
+    else {
+      ac_marginals(ac, sink->marginals);
+    }
+    if (fixed != NULL) {
+      ac_fixed_marginals(ac, fixed, sink->marginals);
+    }
+  }
+  ac_output_query(sink, query, output_log10(ac), ac->vr, ac->dr);
 }
 
-struct node* allocate_variable_node(char* line, struct node* n) {
-  n = (struct node*)malloc(sizeof(struct node));
-  sscanf(line, "%s %d %lf", &(n->nodeType), &(n->index), &(n->vr));
-  n->dr = 0;
-  n->flag = false;
-  n->childHead = NULL;
-  n->prL = NULL;
-  n->prR = NULL;
-  return n;
+/*
+ * Whether the circuit output fits a double. A 0 may have underflowed and
+ * inf or nan overflowed; only the scaled passes tell.
+ */
+static bool output_in_range(const struct circuit *ac) {
+  double output = ac->vr[ac->numNodes - 1];
+  return output != 0 && isfinite(output);
 }
 
-void bit_forwardpropagation(struct node* n) {
-  if (n->flag) {
-    /* Multiply child if flag is down and is not zero */
-    struct childList *tempPtr = n->childHead;
-    n->childHead->numChildren = -1; //trivial, set it to -1 for convenience
-
-    while (tempPtr != NULL) {
-      int cIndex = tempPtr->childIndex;
-      if (circuit[cIndex]->flag) {
-	n->vr = 0;
-	break;
-      }
-      else if (!circuit[cIndex]->flag && circuit[cIndex]->vr != 0) {
-	n->vr *= circuit[cIndex]->vr;
+/*
+ * Whether the derivatives 'dr' of the indicators the marginals are taken
+ * from are finite; with a finite output they can still overflow
+ */
+static bool derivatives_in_range(const struct circuit *ac, const double *dr) {
+  for (int x = 0; x < ac->numVars; x++) {
+    for (int l = ac->varLeafStart[x]; l < ac->varLeafStart[x+1] && (cone == NULL || cone->isQueryVar[x]); l++) {
+      if (!isfinite(dr[ac->varLeaf[l]])) {
+	return false;
       }
-      tempPtr = tempPtr->next;
     }
   }
-  else {
-    struct childList *tempPtr = n->childHead;
+  return true;
+}
 
-    while (tempPtr != NULL) {
-      int cIndex = tempPtr->childIndex;
-      if (circuit[cIndex]->flag) {
-	n->vr = 0;
-	break;
-      }
-      else {
-	n->vr *= circuit[cIndex]->vr;
-      }
-      tempPtr = tempPtr->next;
-    }
+/*
+ * Evaluate and report the query set in the circuit with the scaled
+ * passes, created in 'rescue' on first use, for a query whose output does
+ * not fit a double
+ */
+static void evaluate_scaled(struct circuit *ac, struct circuit_scaled **rescue, int query) {
+  if (*rescue == NULL) {
+    *rescue = ac_scaled_create(ac);
   }
+  scaled = *rescue;
+  forward(ac);
+  backward(ac);
+  report_query(ac, query);
+  scaled = NULL;
 }
 
-void cache_forwardpropagation(struct node* n) {
-  //Initialize Product registers
-  int childCount = n->childHead->numChildren;  
-  double childvr[(childCount + 1)]; //start index from 1
-  int j = 0;
-  n->prL = (double*)calloc((childCount + 1), sizeof(double));
-  n->prR = (double*)calloc((childCount + 1), sizeof(double));
-  if (n->flag) {
-    /* Multiply child if flag is down and is not zero */
-    struct childList *tempPtr = n->childHead;
-    while (tempPtr != NULL) {
-      j++;
-      int cIndex = tempPtr->childIndex;
-      if (circuit[cIndex]->flag) {
-	n->vr = 0;
-	childvr[j] = 0;
-	//break;
-      }
-      else if (!circuit[cIndex]->flag && circuit[cIndex]->vr != 0) {
-	childvr[j] = circuit[cIndex]->vr;
-      }
-      tempPtr = tempPtr->next;
-    }
+/*
+ * Evaluate the circuit once for every assignment in the evidence file
+ */
+static int evaluate_evidence(struct circuit *ac, const char *filename) {
+  FILE *ev_file = fopen(filename, "r");
+  struct circuit_scaled *rescue = NULL;
+  int *evidence;
+  int query = 0;
+  int status;
+
+  if (!ev_file) {
+    fprintf(stderr, "Unable to read evidence file %s\n", filename);
+    return (EXIT_FAILURE);
   }
-  else {
-    struct childList *tempPtr = n->childHead;
-    while (tempPtr != NULL) {
-      int cIndex = tempPtr->childIndex;
-      j++;
-      if (circuit[cIndex]->flag) {
-	n->vr = 0;
-	childvr[j] = 0;
-	//break;
-      }
-      else {
-	childvr[j] = circuit[cIndex]->vr;
-      }
-      tempPtr = tempPtr->next;
+
+  evidence = (int*)malloc(sizeof(int) * (ac->numVars + 1));
+  while ((status = ac_read_evidence(ev_file, ac, evidence)) > 0) {
+    ac_set_evidence(ac, evidence);
+    forward(ac);
+    if (scaled != NULL || output_in_range(ac)) {
+      backward(ac);
+    }
+    if (scaled == NULL && !(output_in_range(ac) && derivatives_in_range(ac, ac->dr))) {
+      evaluate_scaled(ac, &rescue, query);
+    }
+    else {
+      report_query(ac, query);
     }
+    query++;
   }
-  /* Calculate products */
-  //j = childCount;
-  n->prL[0] = 1;
-  n->prR[0] = 1;
-  for (int k = 1, j = childCount; k <= childCount; k++, j--) {
-    n->prL[k] = childvr[k] * n->prL[(k-1)];
-    n->prR[k] = childvr[(j)] * n->prR[(k-1)];
-    //printf("index %d, l %d, r %d, prL: %lf prR: %lf\n", index, k, j, n->prL[k], n->prR[k]);
+  if (rescue != NULL) {
+    ac_scaled_free(rescue);
   }
-  n->vr = n->prL[childCount];
+  free(evidence);
+  fclose(ev_file);
+  return (status < 0) ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
-/*Function to perform bit-encoded backpropagation*/
-void bit_backpropagation(int index){
-  struct node *parent;
-  struct childList *tempPtr;
-  for (int i = index; i >= 0; i--) {
-    parent = circuit[i];
-
-    /*Assign dr values depending on parent node*/
-    if (parent->nodeType == '+') {
-      tempPtr = parent->childHead;
-      while (tempPtr != NULL) {
-	int cIndex = tempPtr->childIndex;
-	circuit[cIndex]->dr += parent->dr;
-	tempPtr = tempPtr->next;
-      }
+/*
+ * Evaluate the evidence file in batches of 'batchSize' queries. A query
+ * whose output does not fit a double is evaluated again scaled.
+ */
+static int evaluate_evidence_batch(struct circuit *ac, const char *filename, int batchSize) {
+  FILE *ev_file = fopen(filename, "r");
+  struct circuit_batch *batch;
+  struct circuit_scaled *rescue = NULL;
+  int *evidence;
+  double *nodeVr, *nodeDr;
+  int root = ac->numNodes - 1;
+  int query = 0;
+  int count;
+  int status = 0;
+
+  if (!ev_file) {
+    fprintf(stderr, "Unable to read evidence file %s\n", filename);
+    return (EXIT_FAILURE);
+  }
+
+  batch = ac_batch_create(ac, batchSize);
+  evidence = (int*)malloc(sizeof(int) * (ac->numVars + 1) * batchSize);
+  nodeVr = (double*)calloc(ac->numNodes, sizeof(double));
+  nodeDr = (double*)calloc(ac->numNodes, sizeof(double));
+  do {
+    for (count = 0; count < batchSize
+	   && (status = ac_read_evidence(ev_file, ac, evidence + count * (ac->numVars + 1))) > 0; count++) {
+      ac_batch_set_evidence(batch, count, evidence + count * (ac->numVars + 1));
     }
-    else if (parent->nodeType == '*') {
-      if (parent->vr != 0) {
-	if (!parent->flag) {
-	  tempPtr = parent->childHead;
-	  while (tempPtr != NULL) {
-	    int cIndex = tempPtr->childIndex;
-	    circuit[cIndex]->dr += (parent->dr)*(parent->vr)/(circuit[cIndex]->vr);
-	    tempPtr = tempPtr->next;
-	  }
-	}
-	else {
-	  //printf("parent %d flag 1\n", i);
-	  tempPtr = parent->childHead;
-	  while (tempPtr != NULL) {
-	    int cIndex = tempPtr->childIndex;
-	    //printf("child %d \n", cIndex);
-	    if (circuit[cIndex]->vr == 0) {
-	      circuit[cIndex]->dr += (parent->dr) * (parent->vr);
-	    }
-	    tempPtr = tempPtr->next;
-	  }
+    if (count == 0) {
+      break;
+    }
+    ac_batch_evaluate(batch);
+    for (int k = 0; k < count; k++, query++) {
+      /*Gather the instance's nodes only if the sink writes them*/
+      int first = ac_output_needs_nodes(sink) ? 0 : root;
+      double output = ac_batch_value(batch, root, k);
+      for (int l = 0; l < ac->varLeafStart[ac->numVars]; l++) {
+	nodeDr[ac->varLeaf[l]] = ac_batch_derivative(batch, ac->varLeaf[l], k);
+      }
+      if (output == 0 || !isfinite(output) || !derivatives_in_range(ac, nodeDr)) {
+	ac_set_evidence(ac, evidence + k * (ac->numVars + 1));
+	evaluate_scaled(ac, &rescue, query);
+	continue;
+      }
+      for (int i = first; i <= root; i++) {
+	nodeVr[i] = ac_batch_value(batch, i, k);
+	nodeDr[i] = ac_batch_derivative(batch, i, k);
+      }
+      if (sink->marginals != NULL) {
+	ac_batch_marginals(batch, k, sink->marginals);
+	if (fixed != NULL) {
+	  ac_fixed_marginals(ac, fixed, sink->marginals);
 	}
       }
+      ac_output_query(sink, query, log10(nodeVr[root]), nodeVr, nodeDr);
     }
+  } while (count == batchSize);
+  if (rescue != NULL) {
+    ac_scaled_free(rescue);
   }
+  free(nodeDr);
+  free(nodeVr);
+  free(evidence);
+  ac_batch_free(batch);
+  fclose(ev_file);
+  return (status < 0) ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
-void cache_backpropagation(int index) {
-  struct node *parent;
-  struct childList *tempPtr;
-  for (int i = index; i >= 0; i--) {
-    parent = circuit[i];
-
-    /*Assign dr values depending on parent node*/
-    if (parent->nodeType == '+') {
-      tempPtr = parent->childHead;
-      while (tempPtr != NULL) {
-	int cIndex = tempPtr->childIndex;
-	circuit[cIndex]->dr += parent->dr;
-	tempPtr = tempPtr->next;
-      }
+/*
+ * Evaluate the evidence file incrementally, each query starting from the
+ * state of the previous one. A query whose output does not fit a double
+ * is evaluated scaled, and the kept state is then rebuilt by full passes.
+ */
+static int evaluate_evidence_incremental(struct circuit *ac, const char *filename) {
+  FILE *ev_file = fopen(filename, "r");
+  struct incremental *inc;
+  struct circuit_scaled *rescue = NULL;
+  int *evidence;
+  int query = 0;
+  int status;
+
+  if (!ev_file) {
+    fprintf(stderr, "Unable to read evidence file %s\n", filename);
+    return (EXIT_FAILURE);
+  }
+
+  inc = ac_incremental_create(ac, NULL);
+  evidence = (int*)malloc(sizeof(int) * (ac->numVars + 1));
+  while ((status = ac_read_evidence(ev_file, ac, evidence)) > 0) {
+    ac_incremental_set_evidence(inc, evidence);
+    ac_incremental_forward(inc);
+    ac_incremental_backward(inc);
+    if (!(output_in_range(ac) && derivatives_in_range(ac, ac->dr))) {
+      evaluate_scaled(ac, &rescue, query);
+      /*The scaled passes overwrote the kept values and derivatives*/
+      ac_incremental_free(inc);
+      inc = ac_incremental_create(ac, evidence);
     }
-    /*Assign dr based on child position in cache*/
-    else if (parent->nodeType == '*') {
-      tempPtr = parent->childHead;
-      int pos = 1; //position of child
-      int w = tempPtr->numChildren;
-      /*Product: pr(pos) = prR(w-pos) * prL(pos-1)*/
-      while (tempPtr != NULL) {
-	int cIndex = tempPtr->childIndex;
-	circuit[cIndex]->dr += parent->dr * parent->prR[(w-pos)] * parent->prL[(pos-1)];
-	//printf("index %d r %d l %d\n", cIndex, (n-pos), pos-1);
-	tempPtr = tempPtr->next;
-	pos++;
-      }
+    else {
+      report_query(ac, query);
     }
+    query++;
   }
+  if (rescue != NULL) {
+    ac_scaled_free(rescue);
+  }
+  free(evidence);
+  ac_incremental_free(inc);
+  fclose(ev_file);
+  return (status < 0) ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
 /*
- * Function to free all nodes and print the backpropagated values in AC
+ * Query of the comma separated variables in 'list', NULL if one is not a
+ * number or not a variable of the circuit
  */
-int free_nodes(int index) {
+static struct circuit_query* create_query(struct circuit *ac, const char *list) {
+  int *vars = (int*)malloc(sizeof(int) * (strlen(list) / 2 + 1));
+  int numVars = 0;
+  struct circuit_query *q = NULL;
+  const char *p = list;
+  char *end;
+
+  while (*p != '\0') {
+    vars[numVars++] = (int)strtol(p, &end, 10);
+    if (end == p || (*end != ',' && *end != '\0')) {
+      fprintf(stderr, "Query variables must be comma separated numbers: %s\n", list);
+      free(vars);
+      return NULL;
+    }
+    p = (*end == ',') ? end + 1 : end;
+  }
+  q = ac_query_create(ac, vars, numVars);
+  free(vars);
+  return q;
+}
+
+/*
+ * Load a circuit, specialize it on the first assignment of 'fixedFile'
+ * (kept in 'fixed') or simplify it, and renumber it if asked to, and set
+ * its engine ("auto" picks one from its statistics)
+ */
+static struct circuit* load_circuit(const char *filename, int size, const char *fixedFile, bool simplify,
+				    int maxFanIn, int nodeOrder, int engine, int numThreads) {
+  struct circuit *circuit;
+
+  if (verbose) {
+    printf("\t... reading file ...\n");
+  }
+  circuit = ac_load(filename, size);
   if (circuit == NULL) {
-    printf("Circuit is empty!\n");
-    return (EXIT_FAILURE);
+    return (NULL);
   }
-  for (int i = 0; i <= index; i++) {
-    if (circuit[i] != NULL) {
-      /* Print out the values and partial derivatives for each node*/
-      printf("n%d t: %c, dr: %lf vr: %lf, flag: %d\n",
-      	     i, circuit[i]->nodeType, (circuit[i]->dr), circuit[i]->vr, circuit[i]->flag);
-
-      /* Deallocate the list of child nodes (if it's a non-leaf node) */
-      if (circuit[i]->childHead != NULL) {
-	struct childList *childPtr = circuit[i]->childHead;
-	struct childList *next = childPtr; 
-	while (childPtr != NULL) {
-	  next = childPtr->next;
-	  free(childPtr);
-	  childPtr = next;
-	}
-	circuit[i]->childHead = NULL;
-      }
-      if (circuit[i]->prL != NULL && circuit[i]->prR != NULL) {
-      	free(circuit[i]->prL);
-      	circuit[i]->prL = NULL;
-      	free(circuit[i]->prR);
-      	circuit[i]->prR = NULL;
+  if (verbose) {
+    printf("\t... done reading file ... \n");
+  }
+  if (fixedFile != NULL) {
+    FILE *ev_file = fopen(fixedFile, "r");
+    struct circuit *specialized;
+    fixed = (int*)malloc(sizeof(int) * (circuit->numVars + 1));
+    if (!ev_file || ac_read_evidence(ev_file, circuit, fixed) <= 0) {
+      fprintf(stderr, "Unable to read partial evidence from %s\n", fixedFile);
+      if (ev_file) {
+	fclose(ev_file);
       }
-      /* Deallocate the node */
-      free(circuit[i]);
+      ac_free(circuit);
+      return (NULL);
+    }
+    fclose(ev_file);
+    specialized = ac_specialize(circuit, fixed, maxFanIn, NULL);
+    if (verbose) {
+      printf("\t... specialized %d nodes, %d edges to %d nodes, %d edges ...\n",
+	     circuit->numNodes, circuit->numEdges, specialized->numNodes, specialized->numEdges);
+    }
+    ac_free(circuit);
+    circuit = specialized;
+  }
+  else if (simplify) {
+    struct circuit *simplified = ac_simplify(circuit, maxFanIn, NULL);
+    if (verbose) {
+      printf("\t... simplified %d nodes, %d edges to %d nodes, %d edges ...\n",
+	     circuit->numNodes, circuit->numEdges, simplified->numNodes, simplified->numEdges);
+    }
+    ac_free(circuit);
+    circuit = simplified;
+  }
+  if (nodeOrder != AC_ORDER_FILE) {
+    struct circuit *reordered = ac_reorder(circuit, nodeOrder, NULL);
+    if (verbose) {
+      struct reuse_stats reuse;
+      ac_reuse_distance(circuit, &reuse);
+      ac_print_reuse(&reuse, "file", stderr);
+      ac_reuse_distance(reordered, &reuse);
+      ac_print_reuse(&reuse, ac_order_name(nodeOrder), stderr);
+    }
+    ac_free(circuit);
+    circuit = reordered;
+  }
+  if (engine == AC_ENGINE_AUTO) {
+    struct circuit_stats stats;
+    ac_analyze(circuit, &stats);
+    engine = ac_choose_engine(&stats, numThreads, verbose ? stderr : NULL);
+  }
+  ac_set_engine(circuit, engine);
+  return (circuit);
+}
+
+/*
+ * Load every circuit and answer queries on them (see ac_server.c). A
+ * circuit is named after its file, without directory and extension.
+ */
+static int serve(int numFiles, char **files, const char *socketPath, bool simplify, int maxFanIn,
+		 int nodeOrder, int engine) {
+  struct circuit **circuits = (struct circuit**)calloc(numFiles, sizeof(struct circuit*));
+  char **names = (char**)calloc(numFiles, sizeof(char*));
+  int status = EXIT_SUCCESS;
+
+  for (int k = 0; k < numFiles && status == EXIT_SUCCESS; k++) {
+    const char *base = strrchr(files[k], '/');
+    char *dot;
+    names[k] = strdup((base != NULL) ? base + 1 : files[k]);
+    dot = strrchr(names[k], '.');
+    if (dot != NULL && dot != names[k]) {
+      *dot = '\0';
+    }
+    circuits[k] = load_circuit(files[k], 0, NULL, simplify, maxFanIn, nodeOrder, engine, 1);
+    if (circuits[k] == NULL) {
+      status = EXIT_FAILURE;
+    }
+  }
+  if (status == EXIT_SUCCESS) {
+    if (strcmp(socketPath, "-") != 0) {
+      fprintf(stderr, "serving %d circuits on %s\n", numFiles, socketPath);
     }
+    status = ac_serve(circuits, (const char**)names, numFiles,
+		      (strcmp(socketPath, "-") == 0) ? NULL : socketPath);
   }
-  return (EXIT_SUCCESS);
+  for (int k = 0; k < numFiles; k++) {
+    if (circuits[k] != NULL) {
+      ac_free(circuits[k]);
+    }
+    free(names[k]);
+  }
+  free(names);
+  free(circuits);
+  return (status);
 }
 
 int main(int argc, char** argv) {
-  FILE *ac_file;
-  char lineToRead[MAX_LINE_NUMBER]; 
-  //struct node **circuit;
-  struct node *n; //temporary storage for nodes
-  int index = 0;
+  struct circuit *circuit; //Arithmetic Circuit Structure
+  char *evidenceFile = NULL;
+  char *binaryFile = NULL;
+  char *fixedFile = NULL;
+  char *codeFile = NULL;
+  char *codeLibrary = NULL;
+  char *outputFile = NULL;
+  char *queryVars = NULL;
+  int format = AC_OUTPUT_TEXT;
+  int batchSize = 0;
+  bool incremental = false;
+  bool scaledMode = false;
+  bool marginalMode = false;
+  bool simplify = false;
+  int maxFanIn = 0;
+  int nodeOrder = AC_ORDER_FILE;
+  char *serverSocket = NULL;
+  int numThreads = 1;
+  int schedule = AC_SCHEDULE_LEVEL;
+  int engine = AC_ENGINE_AUTO;
   int size = 0;
-  
+  int opt;
+
+  while ((opt = getopt(argc, argv, "e:b:iPq:x:t:D:m:spf:o:w:g:l:Ok:r:S:")) != -1) {
+    if (opt == 'e') {
+      evidenceFile = optarg;
+    }
+    else if (opt == 'b') {
+      batchSize = atoi(optarg);
+    }
+    else if (opt == 't') {
+      numThreads = atoi(optarg);
+    }
+    else if (opt == 'D') {
+      schedule = ac_schedule_by_name(optarg);
+      if (schedule < 0) {
+	fprintf(stderr, "Unknown schedule %s\n", optarg);
+	return(EXIT_FAILURE);
+      }
+    }
+    else if (opt == 'i') {
+      incremental = true;
+    }
+    else if (opt == 'P') {
+      prune = true;
+    }
+    else if (opt == 'q') {
+      queryVars = optarg;
+    }
+    else if (opt == 'x') {
+      fixedFile = optarg;
+    }
+    else if (opt == 's') {
+      scaledMode = true;
+    }
+    else if (opt == 'p') {
+      marginalMode = true;
+    }
+    else if (opt == 'f') {
+      format = ac_output_by_name(optarg);
+      if (format < 0) {
+	fprintf(stderr, "Unknown output format %s\n", optarg);
+	return(EXIT_FAILURE);
+      }
+    }
+    else if (opt == 'o') {
+      outputFile = optarg;
+    }
+    else if (opt == 'w') {
+      binaryFile = optarg;
+    }
+    else if (opt == 'g') {
+      codeFile = optarg;
+    }
+    else if (opt == 'l') {
+      codeLibrary = optarg;
+    }
+    else if (opt == 'S') {
+      serverSocket = optarg;
+    }
+    else if (opt == 'O') {
+      simplify = true;
+    }
+    else if (opt == 'r') {
+      nodeOrder = ac_order_by_name(optarg);
+      if (nodeOrder < 0) {
+	fprintf(stderr, "Unknown node order %s\n", optarg);
+	return(EXIT_FAILURE);
+      }
+    }
+    else if (opt == 'k') {
+      maxFanIn = atoi(optarg);
+      if (maxFanIn < 2) {
+	fprintf(stderr, "The fan-in must be at least 2\n");
+	return(EXIT_FAILURE);
+      }
+    }
+    else if (opt == 'm') {
+      engine = ac_engine_by_name(optarg);
+      if (engine < 0) {
+	fprintf(stderr, "Unknown engine %s\n", optarg);
+	return(EXIT_FAILURE);
+      }
+    }
+    else {
+      fprintf(stderr, "Usage: %s [-O [-k fan_in] | -x fixed_evidence] [-r order] [-w out.acb|out.ac | -g out.c] [-m engine] [-t threads [-D schedule] | -s | -l code.so | -P] [-p | -q vars] [-f format] [-o out_file] [-e evidence_file [-b batch_size | -i]] file.ac [size]\n"
+	      "       %s [-O [-k fan_in]] [-r order] [-m engine] -S socket|- file.ac ...\n", argv[0], argv[0]);
+      return(EXIT_FAILURE);
+    }
+  }
+
   /*Try to open the AC file*/
-  if (argc < 2) {
+  if (optind >= argc) {
     /*No file has been passed - error*/
     fprintf(stderr, "Must pass AC file\n");
     return(EXIT_FAILURE);
   }
 
-  /*If the size of AC is specified, allocate fixed amount of memory*/
-  if (argc > 2) {
-    size = atoi(argv[2]);
+  /*If the size of AC is specified, the node store starts at that size*/
+  if (argc > optind + 1 && serverSocket == NULL) {
+    size = atoi(argv[optind + 1]);
   }
-    
-  ac_file = fopen(argv[1], "r");
-    
-  if (!ac_file) {
-    /* File does not exist*/
-    fprintf(stderr, "Unable to read file %s\n", argv[1]);
+
+  verbose = (format == AC_OUTPUT_TEXT) && serverSocket == NULL;
+  if (serverSocket != NULL) {
+    if (fixedFile != NULL) {
+      fprintf(stderr, "The server does not specialize circuits, write them with -x and -w first\n");
+      return(EXIT_FAILURE);
+    }
+    return serve(argc - optind, argv + optind, serverSocket, simplify, maxFanIn, nodeOrder, engine);
+  }
+  circuit = load_circuit(argv[optind], size, fixedFile, simplify, maxFanIn, nodeOrder, engine, numThreads);
+  if (circuit == NULL) {
     return(EXIT_FAILURE);
   }
-    
-  /*File was successfully read*/
-  while (fgets(lineToRead, MAX_LINE_NUMBER, ac_file) != NULL) {
-    //printf("index: %d, %s", index, lineToRead);
-        
-    if (*lineToRead == '(') {
-      printf("\t... reading file ...\n");
-
-      /*Allocate memory for the circuit*/
-      if (size > 0) {
-	size += NODE_SAFETY_MARGIN;
-	circuit = (struct node**)malloc(sizeof(struct node*) * size);
-      }
-      else {
-	circuit = (struct node**)malloc(sizeof(struct node*) * MAX_NODE_NUMBER);
-      }
+
+  if (binaryFile != NULL) {
+    size_t length = strlen(binaryFile);
+    bool text = (length > 3 && strcmp(binaryFile + length - 3, ".ac") == 0);
+    int status = text ? ac_save_text(circuit, binaryFile) : ac_save_binary(circuit, binaryFile);
+    if (status == EXIT_SUCCESS && verbose) {
+      printf("\t... wrote %s ...\n", binaryFile);
     }
-    else if (*lineToRead == 'E'){
-      printf("\t... done reading file ... \n");
-      index--;
-      n->dr = 1;
-      break;
+    ac_free(circuit);
+    free(fixed);
+    return (status);
+  }
+
+  if (codeFile != NULL) {
+    int status = ac_codegen(circuit, AC_CODE_PREFIX, codeFile);
+    if (status == EXIT_SUCCESS && verbose) {
+      printf("\t... wrote %s ...\n", codeFile);
     }
-    else{
-      if (*lineToRead == 'n') {
-	/*Leaf node (Constant)*/
-	/*Insert node into circuit*/
-	n = allocate_constant_node(lineToRead, n);
-      }
-      
-      else if (*lineToRead == 'v') {
-	/*Leaf node (Variable)*/
-	n = allocate_variable_node(lineToRead, n);
-      }
-      
-      else if (*lineToRead == '+') {
-	/*Non-leaf (Operation)*/
-	n = (struct node*)malloc(sizeof(struct node));
-	/*"n->child" stores the index of the children nodes in the circuit*/
-	sscanf(lineToRead, "%s", &(n->nodeType));
-	n->flag = false;
-	n->vr = 0;
-	n->dr = 0;
-	n->childHead = NULL;
-	n->prL = NULL;
-	n->prR = NULL;
-
-	/*Read the sequence of child nodes*/
-	char *nodeList = lineToRead;
-	int childIndex;
-	int offset;
-	struct childList *children;
-	struct childList *linking;
-	nodeList += 2; /*Ignore the operator (first two characters) */
-	
-	while (sscanf(nodeList, " %d%n", &childIndex, &offset) == 1) {
-	  children = (struct childList*)malloc(sizeof(struct childList));
-	  children->childIndex = childIndex;
-
-	  if (n->childHead == NULL) {
-	    n->childHead = children;
-	    linking = n->childHead;
-	  }
-	  else {
-	    linking->next = children;
-	    linking = linking->next;
-	  }
-	  nodeList += offset;
-	}
-	linking->next = NULL;
-
-	/* Add the child node value only if the flag is down */
-	struct childList *tempPtr = n->childHead;
-	
-	while (tempPtr != NULL) {
-	  int cIndex = tempPtr->childIndex;
-	  if (!circuit[cIndex]->flag) {
-	    n->vr += circuit[cIndex]->vr;
-	  }
-	  tempPtr = tempPtr->next;
-	}
-      }
-      
-      else if (*lineToRead == '*') {
-	/*Non-leaf (Operation)*/
-	n = (struct node*)malloc(sizeof(struct node));
-	n->nodeType = '*';
-	n->vr = 1;
-	n->dr = 0;
-	n->flag = false;
-	n->childHead = NULL;
-	n->prL = NULL;
-	n->prR = NULL;
-	
-	/*Read the sequence of child nodes*/
-	char *nodeList = lineToRead;
-	int childIndex = 0;
-	int offset;
-	int zeroCount = 0;
-	int childCount = 0;
-	struct childList *children;
-	struct childList *linking;
-	nodeList += 2; /*Ignore the operator (first two characters) */
-	
-	while (sscanf(nodeList, " %d%n", &childIndex, &offset) == 1) {
-	  children = (struct childList*)malloc(sizeof(struct childList));
-	  children->childIndex = childIndex;
-
-	  /*Insert child node*/
-	  if (n->childHead == NULL) {
-	    n->childHead = children;
-	    linking = n->childHead;
-	  }
-	  else {
-	    linking->next = children;
-	    linking = linking->next;
-	  }
-	  nodeList += offset;
-	  /*Check if child node is zero*/
-	  if (circuit[childIndex]->vr == 0) {
-	    zeroCount++;
-	  }
-	  childCount++;
-	  //children->position = childCount;
-	}
-	linking->next = NULL;
+    ac_free(circuit);
+    free(fixed);
+    return (status);
+  }
 
-	if (zeroCount == 1) {
-	  n->flag = true;
-	}
-	
-	//bit_forwardpropagation(n);
+  if (prune && (scaledMode || numThreads > 1 || batchSize > 0 || incremental || codeLibrary != NULL)) {
+    fprintf(stderr, "Pruned passes run on one thread, without -s, -b, -i or -l\n");
+    ac_free(circuit);
+    free(fixed);
+    return (EXIT_FAILURE);
+  }
 
-	/*Cache back-prop*/
-	n->childHead->numChildren = childCount;
-	cache_forwardpropagation(n);
-      }
-      circuit[index] = n;
-      index++;   
+  if (queryVars != NULL) {
+    if (scaledMode || numThreads > 1 || batchSize > 0 || incremental || codeLibrary != NULL || prune
+	|| format == AC_OUTPUT_CSV || format == AC_OUTPUT_BINARY) {
+      fprintf(stderr, "Query variables need the plain passes on one thread, without -s, -b, -i, -l or -P, and no node output\n");
+      ac_free(circuit);
+      free(fixed);
+      return (EXIT_FAILURE);
+    }
+    cone = create_query(circuit, queryVars);
+    if (cone == NULL) {
+      ac_free(circuit);
+      free(fixed);
+      return (EXIT_FAILURE);
+    }
+    marginalMode = true;
+    if (verbose) {
+      printf("\t... query cone of %d variables holds %d of %d nodes (%.1lf%%) ...\n", cone->numQueryVars,
+	     cone->numCone, circuit->numNodes, 100 * ac_query_coverage(cone));
+    }
+  }
+
+  if (codeLibrary != NULL) {
+    if (scaledMode || numThreads > 1 || batchSize > 0 || incremental) {
+      fprintf(stderr, "Generated code runs on one thread, without -s, -b or -i\n");
+      ac_free(circuit);
+      free(fixed);
+      return (EXIT_FAILURE);
+    }
+    code = ac_code_load(codeLibrary, AC_CODE_PREFIX, circuit);
+    if (code == NULL) {
+      ac_free(circuit);
+      free(fixed);
+      return (EXIT_FAILURE);
+    }
+  }
+  else if (scaledMode) {
+    if (numThreads > 1 || batchSize > 0 || incremental) {
+      fprintf(stderr, "Scaled evaluation runs on one thread, without -b or -i\n");
+      ac_free(circuit);
+      free(fixed);
+      return (EXIT_FAILURE);
+    }
+    scaled = ac_scaled_create(circuit);
+  }
+  else if (numThreads > 1) {
+    pool = ac_pool_create(circuit, numThreads);
+    ac_pool_set_schedule(pool, schedule);
+    if (schedule == AC_SCHEDULE_DATAFLOW && verbose) {
+      printf("\t... %d dataflow tasks over %d levels ...\n", dataflow_task_count(pool->dataflow),
+	     circuit->numLevels);
+    }
+  }
+
+  sink = ac_output_open(circuit, format, outputFile, marginalMode);
+  if (sink != NULL && cone != NULL) {
+    sink->variables = cone->isQueryVar;
+  }
+  if (sink == NULL) {
+    if (pool != NULL) {
+      ac_pool_free(pool);
+    }
+    if (scaled != NULL) {
+      ac_scaled_free(scaled);
+    }
+    if (code != NULL) {
+      ac_code_free(code);
     }
+    if (cone != NULL) {
+      ac_query_free(cone);
+    }
+    ac_free(circuit);
+    free(fixed);
+    return (EXIT_FAILURE);
   }
 
+  if (evidenceFile != NULL) {
+    int status;
+    if (batchSize > 0) {
+      status = evaluate_evidence_batch(circuit, evidenceFile, batchSize);
+    }
+    else if (incremental) {
+      status = evaluate_evidence_incremental(circuit, evidenceFile);
+    }
+    else {
+      status = evaluate_evidence(circuit, evidenceFile);
+    }
+    if (pool != NULL) {
+      ac_pool_free(pool);
+    }
+    if (scaled != NULL) {
+      ac_scaled_free(scaled);
+    }
+    if (code != NULL) {
+      ac_code_free(code);
+    }
+    if (cone != NULL) {
+      ac_query_free(cone);
+    }
+    if (ac_output_close(sink) != EXIT_SUCCESS) {
+      status = EXIT_FAILURE;
+    }
+    ac_free(circuit);
+    free(fixed);
+    return (status);
+  }
+
+  int index = circuit->numNodes - 1;
+  forward(circuit);
+
   /*Print out circuit output*/
-  printf("output %lf for %d nodes\n", circuit[index]->vr, index);
-  
-  printf("log: %lf\n", log10(circuit[index]->vr));
-  
-  if (circuit[index]->vr == 0) {
-    assert(0);
-  }
-
-  printf("\t... starting backpropagation ...\n");
-
-  /*Bit-encoded backpropagation*/
-  //bit_backpropagation(index);
-  
-  /*Product cache backpropagation*/
-  cache_backpropagation(index);
-  
-  /*Free all nodes and circuit*/
-  free_nodes(index);
-  free(circuit);
-  
-  /*Close file*/
-  if (ac_file != NULL) {
-    fclose(ac_file);
-  }
-
-  printf("\t... done ... \n");
-  
-  return (EXIT_SUCCESS);
+  if (verbose) {
+    printf("output %lf for %d nodes\n", circuit->vr[index], index);
+  }
+
+  if (scaled != NULL || output_in_range(circuit)) {
+    if (verbose) {
+      printf("log: %lf\n", output_log10(circuit));
+      printf("\t... starting backpropagation ...\n");
+    }
+    backward(circuit);
+  }
+
+  if (scaled == NULL && !(output_in_range(circuit) && derivatives_in_range(circuit, circuit->dr))) {
+    /*Either the output is 0 or a value or derivative underflowed or
+      overflowed, the scaled passes tell which*/
+    scaled = ac_scaled_create(circuit);
+    forward(circuit);
+    if (scaled->vr[index] != 0) {
+      if (verbose) {
+	printf("\t... values out of range, switching to scaled evaluation ...\n");
+      }
+    }
+    else {
+      fprintf(stderr, "Circuit output is 0\n");
+      ac_scaled_free(scaled);
+      scaled = NULL;
+    }
+    if (verbose) {
+      printf("log: %lf\n", output_log10(circuit));
+      printf("\t... starting backpropagation ...\n");
+    }
+    backward(circuit);
+  }
+
+  /*Print all nodes (or the results in the chosen format) and free circuit*/
+  if (format == AC_OUTPUT_TEXT && sink->marginals == NULL) {
+    ac_print_nodes(circuit);
+  }
+  else {
+    report_query(circuit, 0);
+  }
+  int status = ac_output_close(sink);
+  if (pool != NULL) {
+    ac_pool_free(pool);
+  }
+  if (scaled != NULL) {
+    ac_scaled_free(scaled);
+  }
+  if (code != NULL) {
+    ac_code_free(code);
+  }
+  if (cone != NULL) {
+    ac_query_free(cone);
+  }
+  ac_free(circuit);
+  free(fixed);
+
+  if (verbose) {
+    printf("\t... done ... \n");
+  }
+
+  return (status);
 }
-  
@@ -0,0 +1,255 @@
+/*
+ * File:   bench_codegen.c
+ * Author: andrewchoi
+ *
+ * Benchmark of generated code against the interpreted engines. For every
+ * circuit the passes are generated as C (see ac_codegen.c), compiled into
+ * a shared object with the given compiler command and loaded. Then the
+ * upward and downward pass of the cache and bit engines and of the
+ * generated code are timed on the indicator values of the file, 'warmup'
+ * times untimed and 'repetitions' times timed, and the medians reported.
+ * The generated results are checked against the cache engine's, which
+ * they should match exactly. Without circuits movie.ac and voting.ac are
+ * used.
+ *
+ * Usage: bench_codegen [-w warmup] [-r repetitions] [-c "compiler command"] [-k]
+ *                      [file.ac ...]
+ * -c is run as "<command> -shared -fPIC -o <lib.so> <file.c>", by default
+ *    with DEFAULT_COMPILER.
+ * -k keeps the generated files and prints where they are.
+ *
+ * gcc -O2 -I. -o test_bench/bench_codegen test_bench/bench_codegen.c ac_*.c -lm -lpthread -ldl
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ac.h"
+
+#define DEFAULT_WARMUP 3
+#define DEFAULT_REPETITIONS 50
+#define DEFAULT_COMPILER "cc -O2"
+#define PREFIX "bench"
+#define NUM_ENGINES 3 //cache, bit, generated
+#define MAX_COMMAND_LENGTH 4096
+
+static const char *sampleCircuits[] = { "movie.ac", "voting.ac" };
+
+static double now_ns(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+static double median(double *ns, int count) {
+  qsort(ns, count, sizeof(double), compare_doubles);
+  return ns[count / 2];
+}
+
+/*
+ * Time the passes of one engine (generated code if 'code' is not NULL),
+ * storing the medians in nanoseconds
+ */
+static void time_engine(struct circuit *ac, const struct circuit_code *code, int engine, int warmup,
+			int repetitions, double *forwardNs, double *backwardNs) {
+  double *up = (double*)malloc(sizeof(double) * repetitions);
+  double *down = (double*)malloc(sizeof(double) * repetitions);
+
+  if (code == NULL) {
+    ac_set_engine(ac, engine);
+  }
+  ac_set_evidence(ac, NULL);
+  for (int r = 0; r < warmup + repetitions; r++) {
+    double start = now_ns();
+    if (code != NULL) {
+      ac_code_forward(code, ac);
+    }
+    else {
+      ac_forward(ac);
+    }
+    double middle = now_ns();
+    if (code != NULL) {
+      ac_code_backward(code, ac);
+    }
+    else {
+      ac_backward(ac);
+    }
+    double end = now_ns();
+    if (r >= warmup) {
+      up[r - warmup] = middle - start;
+      down[r - warmup] = end - middle;
+    }
+  }
+  *forwardNs = median(up, repetitions);
+  *backwardNs = median(down, repetitions);
+  free(down);
+  free(up);
+}
+
+/*
+ * Largest relative difference between the generated results and those of
+ * the cache engine, over every value and every derivative but those of
+ * the constants
+ */
+static double compare_results(struct circuit *ac, const struct circuit_code *code) {
+  double *vr = (double*)malloc(sizeof(double) * ac->numNodes);
+  double *dr = (double*)malloc(sizeof(double) * ac->numNodes);
+  double worst = 0;
+
+  ac_set_engine(ac, AC_ENGINE_CACHE);
+  ac_set_evidence(ac, NULL);
+  ac_forward(ac);
+  ac_backward(ac);
+  memcpy(vr, ac->vr, sizeof(double) * ac->numNodes);
+  memcpy(dr, ac->dr, sizeof(double) * ac->numNodes);
+  ac_code_forward(code, ac);
+  ac_code_backward(code, ac);
+
+  for (int i = 0; i < ac->numNodes; i++) {
+    double scale = fmax(fabs(vr[i]), fabs(ac->vr[i]));
+    if (scale > 0) {
+      worst = fmax(worst, fabs(vr[i] - ac->vr[i]) / scale);
+    }
+    scale = fmax(fabs(dr[i]), fabs(ac->dr[i]));
+    if (ac->nodeType[i] != 'n' && scale > 0) {
+      worst = fmax(worst, fabs(dr[i] - ac->dr[i]) / scale);
+    }
+  }
+  free(dr);
+  free(vr);
+  return worst;
+}
+
+/*
+ * Benchmark one circuit, EXIT_FAILURE if it can not be read, compiled or
+ * loaded
+ */
+static int bench_circuit(const char *filename, int warmup, int repetitions, const char *compiler,
+			 bool keep) {
+  char directory[] = "/tmp/ac_codegenXXXXXX";
+  char source[sizeof(directory) + 16], library[sizeof(directory) + 16];
+  char command[MAX_COMMAND_LENGTH];
+  static const char *engineName[NUM_ENGINES] = { "cache", "bit", "generated" };
+  double forwardNs[NUM_ENGINES], backwardNs[NUM_ENGINES];
+  struct circuit_code *code;
+  struct circuit *ac;
+  double start, generated, compiled;
+  double difference;
+
+  ac = ac_load(filename, 0);
+  if (ac == NULL) {
+    return (EXIT_FAILURE);
+  }
+  if (mkdtemp(directory) == NULL) {
+    fprintf(stderr, "Unable to create a directory for the generated code\n");
+    ac_free(ac);
+    return (EXIT_FAILURE);
+  }
+  snprintf(source, sizeof(source), "%s/circuit.c", directory);
+  snprintf(library, sizeof(library), "%s/circuit.so", directory);
+
+  start = now_ns();
+  if (ac_codegen(ac, PREFIX, source) != EXIT_SUCCESS) {
+    ac_free(ac);
+    return (EXIT_FAILURE);
+  }
+  generated = now_ns();
+  snprintf(command, sizeof(command), "%s -shared -fPIC -o %s %s", compiler, library, source);
+  if (system(command) != 0) {
+    fprintf(stderr, "Failed: %s\n", command);
+    ac_free(ac);
+    return (EXIT_FAILURE);
+  }
+  compiled = now_ns();
+  code = ac_code_load(library, PREFIX, ac);
+  if (code == NULL) {
+    ac_free(ac);
+    return (EXIT_FAILURE);
+  }
+
+  time_engine(ac, NULL, AC_ENGINE_CACHE, warmup, repetitions, &forwardNs[0], &backwardNs[0]);
+  time_engine(ac, NULL, AC_ENGINE_BIT, warmup, repetitions, &forwardNs[1], &backwardNs[1]);
+  time_engine(ac, code, 0, warmup, repetitions, &forwardNs[2], &backwardNs[2]);
+  difference = compare_results(ac, code);
+
+  printf("%s: %d nodes, %d edges, %d warmup, %d repetitions\n", filename, ac->numNodes, ac->numEdges,
+	 warmup, repetitions);
+  printf("  generated in %.1lf ms, compiled with \"%s\" in %.1lf s\n", (generated - start) / 1e6,
+	 compiler, (compiled - generated) / 1e9);
+  printf("  %-10s %12s %12s %12s %9s\n", "engine", "forward us", "backward us", "total us", "speedup");
+  for (int k = 0; k < NUM_ENGINES; k++) {
+    double total = forwardNs[k] + backwardNs[k];
+    printf("  %-10s %12.2lf %12.2lf %12.2lf %8.2lfx\n", engineName[k], forwardNs[k] / 1e3,
+	   backwardNs[k] / 1e3, total / 1e3, (forwardNs[0] + backwardNs[0]) / total);
+  }
+  if (difference == 0) {
+    printf("  generated results identical to the cache engine\n");
+  }
+  else {
+    printf("  generated results differ from the cache engine by up to %.3le (relative)\n", difference);
+  }
+
+  ac_code_free(code);
+  ac_free(ac);
+  if (keep) {
+    printf("  kept %s and %s\n", source, library);
+  }
+  else {
+    remove(library);
+    remove(source);
+    rmdir(directory);
+  }
+  return (EXIT_SUCCESS);
+}
+
+int main(int argc, char** argv) {
+  int warmup = DEFAULT_WARMUP;
+  int repetitions = DEFAULT_REPETITIONS;
+  const char *compiler = DEFAULT_COMPILER;
+  bool keep = false;
+  int status = EXIT_SUCCESS;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "w:r:c:k")) != -1) {
+    if (opt == 'w') {
+      warmup = atoi(optarg);
+    }
+    else if (opt == 'r') {
+      repetitions = atoi(optarg);
+    }
+    else if (opt == 'c') {
+      compiler = optarg;
+    }
+    else if (opt == 'k') {
+      keep = true;
+    }
+    else {
+      fprintf(stderr, "Usage: %s [-w warmup] [-r repetitions] [-c \"compiler command\"] [-k] [file.ac ...]\n", argv[0]);
+      return(EXIT_FAILURE);
+    }
+  }
+  if (repetitions < 1 || warmup < 0) {
+    fprintf(stderr, "Need at least one repetition\n");
+    return(EXIT_FAILURE);
+  }
+
+  int numFiles = (optind < argc) ? argc - optind : (int)(sizeof(sampleCircuits) / sizeof(sampleCircuits[0]));
+  for (int f = 0; f < numFiles; f++) {
+    const char *filename = (optind < argc) ? argv[optind + f] : sampleCircuits[f];
+    if (bench_circuit(filename, warmup, repetitions, compiler, keep) != EXIT_SUCCESS) {
+      status = EXIT_FAILURE;
+    }
+  }
+  return (status);
+}
@@ -0,0 +1,265 @@
+/*
+ * File:   gen_circuit.c
+ * Author: andrewchoi
+ *
+ * Writes a synthetic arithmetic circuit in the .ac format, for scaling
+ * studies of the evaluation engines. The leaves (one indicator per value
+ * of every variable, then the constants) form level 0; the operation
+ * nodes are split evenly over 'depth' levels above them, and the root
+ * joins the top level. Every node takes its first children round robin
+ * from the level below, so every node has a parent: one child, or on a
+ * level smaller than the one below an even share of it, which can exceed
+ * the drawn fan-in. Its other children are drawn at random from the level
+ * below or, with the long edge probability, from any earlier node.
+ *
+ * Usage: gen_circuit [-n nodes] [-v variables] [-k cardinality]
+ *                    [-c constants] [-d depth] [-f fan_in] [-F max_fan_in]
+ *                    [-D fixed|uniform|geometric] [-a pattern]
+ *                    [-l long_edges] [-z zeros] [-s seed] [-o out.ac]
+ * The pattern gives the node type per level bottom up and repeats, e.g.
+ * "+*" (the alternation bit-encoded propagation assumes), "*+", "++*";
+ * an "r" level picks every node type at random.
+ * -z is the fraction of constants that are 0.
+ *
+ * gcc -O2 -o test_bench/gen_circuit test_bench/gen_circuit.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#define DIST_FIXED 0
+#define DIST_UNIFORM 1
+#define DIST_GEOMETRIC 2
+
+/* Generator settings */
+struct generator {
+  long numNodes;
+  int numVars;
+  int card;
+  long numConstants;
+  int depth;
+  int fanIn;
+  int maxFanIn;
+  int distribution;
+  const char *pattern;
+  double longEdges;
+  double zeros;
+  uint64_t state;
+};
+
+/*
+ * xorshift64* random numbers, reproducible for a given seed
+ */
+static uint64_t next_random(struct generator *g) {
+  g->state ^= g->state >> 12;
+  g->state ^= g->state << 25;
+  g->state ^= g->state >> 27;
+  return g->state * 0x2545F4914F6CDD1DULL;
+}
+
+static double random_unit(struct generator *g) {
+  return (next_random(g) >> 11) * 0x1p-53;
+}
+
+static long random_below(struct generator *g, long n) {
+  return (long)(next_random(g) % (uint64_t)n);
+}
+
+/*
+ * Number of children of the next node
+ */
+static int draw_fan_in(struct generator *g) {
+  int w = g->fanIn;
+
+  if (g->distribution == DIST_UNIFORM) {
+    /*Uniform on [2, 2 * fanIn - 2], mean fanIn*/
+    w = (g->fanIn > 2) ? 2 + (int)random_below(g, 2 * g->fanIn - 3) : 2;
+  }
+  else if (g->distribution == DIST_GEOMETRIC) {
+    /*2 plus a geometric tail, mean fanIn*/
+    double stop = 1.0 / (g->fanIn - 1);
+    w = 2;
+    while (random_unit(g) >= stop) {
+      w++;
+    }
+  }
+  if (w > g->maxFanIn) {
+    w = g->maxFanIn;
+  }
+  return (w < 1) ? 1 : w;
+}
+
+/*
+ * Type of a node on 'level', 'r' in the pattern picks one at random
+ */
+static char node_type(struct generator *g, int level) {
+  char type = g->pattern[(level - 1) % strlen(g->pattern)];
+
+  if (type == 'r') {
+    return (next_random(g) & 1) ? '+' : '*';
+  }
+  return type;
+}
+
+/*
+ * Write one operation node with children from [prevStart, prevEnd), the
+ * first ones round robin at positions [slotStart, slotEnd)
+ */
+static void write_node(struct generator *g, FILE *out, char type, long prevStart, long prevEnd,
+		       long slotStart, long slotEnd, int fanIn) {
+  long prevSize = prevEnd - prevStart;
+
+  fputc(type, out);
+  for (long slot = slotStart; slot < slotEnd; slot++) {
+    fprintf(out, " %ld", prevStart + slot % prevSize);
+  }
+  for (long k = slotEnd - slotStart; k < fanIn; k++) {
+    long child;
+    if (random_unit(g) < g->longEdges) {
+      child = random_below(g, prevEnd);
+    }
+    else {
+      child = prevStart + random_below(g, prevSize);
+    }
+    fprintf(out, " %ld", child);
+  }
+  fputc('\n', out);
+}
+
+static void generate(struct generator *g, FILE *out) {
+  long numIndicators = (long)g->numVars * g->card;
+  long numLeaves = numIndicators + g->numConstants;
+  long numInternal = g->numNodes - numLeaves - 1;
+  long prevStart = 0;
+  long prevEnd = numLeaves;
+
+  if (numInternal < g->depth) {
+    numInternal = g->depth;
+  }
+
+  fputc('(', out);
+  for (int x = 0; x < g->numVars; x++) {
+    fprintf(out, (x == 0) ? "%d" : " %d", g->card);
+  }
+  fprintf(out, ")\n");
+
+  for (int x = 0; x < g->numVars; x++) {
+    for (int v = 0; v < g->card; v++) {
+      fprintf(out, "v %d %d\n", x, v);
+    }
+  }
+  for (long c = 0; c < g->numConstants; c++) {
+    double value = (random_unit(g) < g->zeros) ? 0 : 0.05 + 0.95 * random_unit(g);
+    fprintf(out, "n %.6f\n", value);
+  }
+
+  for (int level = 1; level <= g->depth; level++) {
+    long levelSize = numInternal / g->depth + (level <= numInternal % g->depth);
+    long start = prevEnd;
+    long prevSize = prevEnd - prevStart;
+    for (long j = 0; j < levelSize; j++) {
+      /*Split the level below evenly if it is larger, so none is left out*/
+      long slotStart = (levelSize >= prevSize) ? j : j * prevSize / levelSize;
+      long slotEnd = (levelSize >= prevSize) ? j + 1 : (j + 1) * prevSize / levelSize;
+      write_node(g, out, node_type(g, level), prevStart, prevEnd, slotStart, slotEnd, draw_fan_in(g));
+    }
+    prevStart = start;
+    prevEnd = start + levelSize;
+  }
+
+  /*Root over the whole top level*/
+  fputc(node_type(g, g->depth + 1), out);
+  for (long i = prevStart; i < prevEnd; i++) {
+    fprintf(out, " %ld", i);
+  }
+  fprintf(out, "\nEOF\n");
+  fprintf(stderr, "%ld nodes, %ld leaves, %d levels\n", prevEnd + 1, numLeaves, g->depth + 1);
+}
+
+int main(int argc, char** argv) {
+  struct generator g = { 100000, 100, 2, 1000, 10, 3, 64, DIST_FIXED, "+*", 0.0, 0.0, 1 };
+  char *outFile = NULL;
+  FILE *out = stdout;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:v:k:c:d:f:F:D:a:l:z:s:o:")) != -1) {
+    if (opt == 'n') {
+      g.numNodes = atol(optarg);
+    }
+    else if (opt == 'v') {
+      g.numVars = atoi(optarg);
+    }
+    else if (opt == 'k') {
+      g.card = atoi(optarg);
+    }
+    else if (opt == 'c') {
+      g.numConstants = atol(optarg);
+    }
+    else if (opt == 'd') {
+      g.depth = atoi(optarg);
+    }
+    else if (opt == 'f') {
+      g.fanIn = atoi(optarg);
+    }
+    else if (opt == 'F') {
+      g.maxFanIn = atoi(optarg);
+    }
+    else if (opt == 'D') {
+      if (strcmp(optarg, "fixed") == 0) {
+	g.distribution = DIST_FIXED;
+      }
+      else if (strcmp(optarg, "uniform") == 0) {
+	g.distribution = DIST_UNIFORM;
+      }
+      else if (strcmp(optarg, "geometric") == 0) {
+	g.distribution = DIST_GEOMETRIC;
+      }
+      else {
+	fprintf(stderr, "Unknown fan-in distribution %s\n", optarg);
+	return(EXIT_FAILURE);
+      }
+    }
+    else if (opt == 'a') {
+      g.pattern = optarg;
+    }
+    else if (opt == 'l') {
+      g.longEdges = atof(optarg);
+    }
+    else if (opt == 'z') {
+      g.zeros = atof(optarg);
+    }
+    else if (opt == 's') {
+      g.state = strtoull(optarg, NULL, 10) * 0x9E3779B97F4A7C15ULL + 1;
+    }
+    else if (opt == 'o') {
+      outFile = optarg;
+    }
+    else {
+      fprintf(stderr, "Usage: %s [-n nodes] [-v variables] [-k cardinality] [-c constants] [-d depth] [-f fan_in] [-F max_fan_in] [-D fixed|uniform|geometric] [-a pattern] [-l long_edges] [-z zeros] [-s seed] [-o out.ac]\n", argv[0]);
+      return(EXIT_FAILURE);
+    }
+  }
+
+  if (g.numVars < 1 || g.card < 1 || g.numConstants < 0 || g.depth < 1 || g.fanIn < 1
+      || g.maxFanIn < 1 || g.pattern[0] == '\0' || strspn(g.pattern, "+*r") != strlen(g.pattern)) {
+    fprintf(stderr, "Invalid generator settings\n");
+    return(EXIT_FAILURE);
+  }
+
+  if (outFile != NULL) {
+    out = fopen(outFile, "w");
+    if (!out) {
+      fprintf(stderr, "Unable to write file %s\n", outFile);
+      return(EXIT_FAILURE);
+    }
+  }
+  generate(&g, out);
+  if (out != stdout && fclose(out) != 0) {
+    fprintf(stderr, "Unable to write file %s\n", outFile);
+    return(EXIT_FAILURE);
+  }
+  return (EXIT_SUCCESS);
+}
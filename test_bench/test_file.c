@@ -1,515 +1,324 @@
-/* 
- * File:   main.c
+/*
+ * File:   test_file.c
  * Author: andrewchoi
  *
- * Created on July 25, 2017, 10:30 AM
+ * Benchmark of the circuit pipeline. For every circuit the phases are
+ * timed separately: load (parse or map), compile, forward, backward and
+ * teardown. Every phase is run 'warmup' times untimed and 'repetitions'
+ * times timed; the median, the 99th percentile and the throughput in
+ * nodes per second are reported per phase. Without circuits the sample
+ * circuits of the repository are used.
+ *
+ * Usage: test_file [-w warmup] [-r repetitions] [-m engine] [-d order] [-s]
+ *                  [-o results.csv] [-c baseline.csv] [file.ac ...]
+ * -m auto times the engine main picks by default.
+ * -d renumbers the nodes (see ac_reorder.c) before the passes are timed.
+ * -s also times the scaled passes, as two more phases after the plain
+ *    ones, with their cost relative to the plain passes.
+ * -o writes one CSV row per circuit and phase.
+ * -c compares the medians against an earlier CSV and exits with a failure
+ *    if a phase got more than REGRESSION_TOLERANCE slower.
+ *
+ * gcc -O2 -I. -o test_bench/test_file test_bench/test_file.c ac_*.c -lm -lpthread -ldl
  */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
-#include <assert.h>
-#include <math.h>
-
 #include <time.h>
+#include <unistd.h>
 
-/* 
- * Reads an .ac file by argument and calculates the circuit output and 
- * partial derivatives for every node.
- * The circuit is stored in an adjacency list.
- * Each non-leaf node storess its children in a linked list.
- */
+#include "ac.h"
 
-/* 
- * GLOBAL VARIABLES 
- */
-struct node **circuit; //Arithmetic Circuit Structure
+#define DEFAULT_WARMUP 3
+#define DEFAULT_REPETITIONS 50
+#define REGRESSION_TOLERANCE 1.10 //A median 10% above the baseline is a regression
+#define NUM_PHASES 7 //The last two only with -s
 
-/* 
- * CONSTANTS
- */
-#define MAX_NODE_NUMBER 50000 //Program assumes max AC size of 50000 (if not specified)
-#define MAX_LINE_NUMBER 20000
-#define NODE_SAFETY_MARGIN 20 //Adds 20 to the AC size that user specified
+static const char *phaseName[NUM_PHASES] = { "load", "compile", "forward", "backward", "teardown",
+					     "scaled_forward", "scaled_backward" };
 
-/*
- * STRUCTURES
- */
-
-/* Node Structure
-   Children and flag only apply to non-leaf nodes */
-struct node {
-  /*Node type can be 'n' or 'v' for leaf nodes
-    Node type can be '+' or '-' for non-leaf nodes */
-  char nodeType; 
-  /*Node index, e.g. "Third variable: n=2*/
-  int index;
-  /*Value of the node*/
-  double vr; 
-  /*Derivative of the node*/
-  double dr;
-  /*Bit flag, true means there is exactly one child that is zero*/
-  bool flag;
-  /*Linked list of child nodes*/
-  struct childList *childHead;
-  //int numChildren; 
-  /*Product registers*/
-  double *prL;
-  double *prR;
-};
+static const char *sampleCircuits[] = { "example.ac", "verysimple.ac", "movie.ac", "voting.ac" };
 
-/* List of child nodes of a non-leaf node */
-struct childList {
-  int numChildren; //number of children nodes of the parent node
-  //int position; //Child node position, relative to other children. Left-most is position 1. 
-  int childIndex; //circuit index of child node
-  struct childList *next; 
+/* Timings of one phase in nanoseconds */
+struct phase_times {
+  double *ns;
+  int count;
 };
 
-
-/* 
- * FUNCTIONS
- */
-
-struct node* allocate_constant_node(char* line, struct node* n) {
-  n = (struct node*)malloc(sizeof(struct node));
-  sscanf(line, "%s %lf", &(n->nodeType), &(n->vr));
-  n->dr = 0;
-  n->flag = false;
-  n->childHead = NULL;
-  n->prL = NULL;
-  n->prR = NULL;
-  return n;
+static double now_ns(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e9 + t.tv_nsec;
 }
 
-struct node* allocate_variable_node(char* line, struct node* n) {
-  n = (struct node*)malloc(sizeof(struct node));
-  sscanf(line, "%s %d %lf", &(n->nodeType), &(n->index), &(n->vr));
-  n->dr = 0;
-  n->flag = false;
-  n->childHead = NULL;
-  n->prL = NULL;
-  n->prR = NULL;
-  return n;
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+  return (x > y) - (x < y);
 }
 
-void bit_forwardpropagation(struct node* n) {
-  if (n->flag) {
-    /* Multiply child if flag is down and is not zero */
-    struct childList *tempPtr = n->childHead;
-    n->childHead->numChildren = -1; //trivial, set it to -1 for convenience
+/*
+ * Value below which 'fraction' of the sorted timings lie
+ */
+static double percentile(const struct phase_times *times, double fraction) {
+  int rank = (int)(fraction * (times->count - 1) + 0.5);
+  return times->ns[rank];
+}
 
-    while (tempPtr != NULL) {
-      int cIndex = tempPtr->childIndex;
-      if (circuit[cIndex]->flag) {
-	n->vr = 0;
-	break;
-      }
-      else if (!circuit[cIndex]->flag && circuit[cIndex]->vr != 0) {
-	n->vr *= circuit[cIndex]->vr;
-      }
-      tempPtr = tempPtr->next;
-    }
+/*
+ * Load, compile and free the circuit, timing each step
+ */
+static bool time_loading(const char *filename, struct phase_times *load, struct phase_times *compile,
+			 struct phase_times *teardown, bool timed) {
+  double start = now_ns();
+  struct circuit *ac = ac_parse(filename, 0);
+  double parsed = now_ns();
+
+  if (ac == NULL) {
+    return false;
   }
-  else {
-    struct childList *tempPtr = n->childHead;
-
-    while (tempPtr != NULL) {
-      int cIndex = tempPtr->childIndex;
-      if (circuit[cIndex]->flag) {
-	n->vr = 0;
-	break;
-      }
-      else {
-	n->vr *= circuit[cIndex]->vr;
-      }
-      tempPtr = tempPtr->next;
-    }
+  if (ac->mapping == NULL) {
+    ac_compile(ac);
+  }
+  double compiled = now_ns();
+  ac_free(ac);
+  double freed = now_ns();
+
+  if (timed) {
+    load->ns[load->count++] = parsed - start;
+    compile->ns[compile->count++] = compiled - parsed;
+    teardown->ns[teardown->count++] = freed - compiled;
   }
+  return true;
 }
 
-void cache_forwardpropagation(struct node* n) {
-  //Initialize Product registers
-  int childCount = n->childHead->numChildren;  
-  double childvr[(childCount + 1)]; //start index from 1
-  int j = 0;
-  n->prL = (double*)calloc((childCount + 1), sizeof(double));
-  n->prR = (double*)calloc((childCount + 1), sizeof(double));
-  if (n->flag) {
-    /* Multiply child if flag is down and is not zero */
-    struct childList *tempPtr = n->childHead;
-    while (tempPtr != NULL) {
-      j++;
-      int cIndex = tempPtr->childIndex;
-      if (circuit[cIndex]->flag) {
-	n->vr = 0;
-	childvr[j] = 0;
-	//break;
-      }
-      else if (!circuit[cIndex]->flag && circuit[cIndex]->vr != 0) {
-	childvr[j] = circuit[cIndex]->vr;
-      }
-      tempPtr = tempPtr->next;
-    }
+/*
+ * Time the upward and downward passes of a loaded circuit, the scaled
+ * ones if 'scaled' is not NULL
+ */
+static void time_passes(struct circuit *ac, struct circuit_scaled *scaled,
+			struct phase_times *forward, struct phase_times *backward, bool timed) {
+  double start, middle, end;
+
+  ac_set_evidence(ac, NULL);
+  start = now_ns();
+  if (scaled != NULL) {
+    ac_scaled_forward(scaled);
   }
   else {
-    struct childList *tempPtr = n->childHead;
-    while (tempPtr != NULL) {
-      int cIndex = tempPtr->childIndex;
-      j++;
-      if (circuit[cIndex]->flag) {
-	n->vr = 0;
-	childvr[j] = 0;
-	//break;
-      }
-      else {
-	childvr[j] = circuit[cIndex]->vr;
-      }
-      tempPtr = tempPtr->next;
-    }
+    ac_forward(ac);
   }
-  /* Calculate products */
-  //j = childCount;
-  n->prL[0] = 1;
-  n->prR[0] = 1;
-  for (int k = 1, j = childCount; k <= childCount; k++, j--) {
-    n->prL[k] = childvr[k] * n->prL[(k-1)];
-    n->prR[k] = childvr[(j)] * n->prR[(k-1)];
-    //printf("index %d, l %d, r %d, prL: %lf prR: %lf\n", index, k, j, n->prL[k], n->prR[k]);
+  middle = now_ns();
+  if (scaled != NULL) {
+    ac_scaled_backward(scaled);
   }
-  n->vr = n->prL[childCount];
-}
-
-/*Function to perform bit-encoded backpropagation*/
-void bit_backpropagation(int index){
-  struct node *parent;
-  struct childList *tempPtr;
-  for (int i = index; i >= 0; i--) {
-    parent = circuit[i];
+  else {
+    ac_backward(ac);
+  }
+  end = now_ns();
 
-    /*Assign dr values depending on parent node*/
-    if (parent->nodeType == '+') {
-      tempPtr = parent->childHead;
-      while (tempPtr != NULL) {
-	int cIndex = tempPtr->childIndex;
-	circuit[cIndex]->dr += parent->dr;
-	tempPtr = tempPtr->next;
-      }
-    }
-    else if (parent->nodeType == '*') {
-      if (parent->vr != 0) {
-	if (!parent->flag) {
-	  tempPtr = parent->childHead;
-	  while (tempPtr != NULL) {
-	    int cIndex = tempPtr->childIndex;
-	    circuit[cIndex]->dr += (parent->dr)*(parent->vr)/(circuit[cIndex]->vr);
-	    tempPtr = tempPtr->next;
-	  }
-	}
-	else {
-	  //printf("parent %d flag 1\n", i);
-	  tempPtr = parent->childHead;
-	  while (tempPtr != NULL) {
-	    int cIndex = tempPtr->childIndex;
-	    //printf("child %d \n", cIndex);
-	    if (circuit[cIndex]->vr == 0) {
-	      circuit[cIndex]->dr += (parent->dr) * (parent->vr);
-	    }
-	    tempPtr = tempPtr->next;
-	  }
-	}
-      }
-    }
+  if (timed) {
+    forward->ns[forward->count++] = middle - start;
+    backward->ns[backward->count++] = end - middle;
   }
 }
 
-void cache_backpropagation(int index) {
-  struct node *parent;
-  struct childList *tempPtr;
-  for (int i = index; i >= 0; i--) {
-    parent = circuit[i];
+/*
+ * Median of a phase in an earlier CSV, 0 if it is not there
+ */
+static double baseline_median(const char *filename, const char *circuit, const char *phase) {
+  FILE *csv = fopen(filename, "r");
+  char line[1024];
+  double median = 0;
 
-    /*Assign dr values depending on parent node*/
-    if (parent->nodeType == '+') {
-      tempPtr = parent->childHead;
-      while (tempPtr != NULL) {
-	int cIndex = tempPtr->childIndex;
-	circuit[cIndex]->dr += parent->dr;
-	tempPtr = tempPtr->next;
-      }
-    }
-    /*Assign dr based on child position in cache*/
-    else if (parent->nodeType == '*') {
-      tempPtr = parent->childHead;
-      int pos = 1; //position of child
-      int w = tempPtr->numChildren;
-      /*Product: pr(pos) = prR(w-pos) * prL(pos-1)*/
-      while (tempPtr != NULL) {
-	int cIndex = tempPtr->childIndex;
-	circuit[cIndex]->dr += parent->dr * parent->prR[(w-pos)] * parent->prL[(pos-1)];
-	//printf("index %d r %d l %d\n", cIndex, (n-pos), pos-1);
-	tempPtr = tempPtr->next;
-	pos++;
-      }
+  if (!csv) {
+    return 0;
+  }
+  while (fgets(line, sizeof(line), csv)) {
+    char name[512], rowPhase[64];
+    double value;
+    if (sscanf(line, "%511[^,],%63[^,],%*d,%lf", name, rowPhase, &value) == 3
+	&& strcmp(name, circuit) == 0 && strcmp(rowPhase, phase) == 0) {
+      median = value;
     }
   }
+  fclose(csv);
+  return median;
 }
 
 /*
- * Function to free all nodes and print the backpropagated values in AC
+ * Benchmark one circuit. Returns the number of regressions against the
+ * baseline, or -1 if the circuit can not be read.
  */
-int free_nodes(int index) {
-  if (circuit == NULL) {
-    printf("Circuit is empty!\n");
-    return (EXIT_FAILURE);
+static int bench_circuit(const char *filename, int warmup, int repetitions, int engine, int nodeOrder,
+			 bool scaledMode, FILE *csv, const char *baseline) {
+  struct phase_times times[NUM_PHASES];
+  struct circuit *ac;
+  struct circuit_scaled *scaled = NULL;
+  int numPhases = scaledMode ? NUM_PHASES : NUM_PHASES - 2;
+  int regressions = 0;
+  int numNodes;
+
+  for (int p = 0; p < NUM_PHASES; p++) {
+    times[p].ns = (double*)malloc(sizeof(double) * repetitions);
+    times[p].count = 0;
   }
-  for (int i = 0; i <= index; i++) {
-    if (circuit[i] != NULL) {
-      /* Print out the values and partial derivatives for each node*/
-      /* printf("n%d t: %c, dr: %lf vr: %lf, flag: %d\n", */
-      /* 	     i, circuit[i]->nodeType, (circuit[i]->dr), circuit[i]->vr, circuit[i]->flag); */
 
-      /* Deallocate the list of child nodes (if it's a non-leaf node) */
-      if (circuit[i]->childHead != NULL) {
-	struct childList *childPtr = circuit[i]->childHead;
-	struct childList *next = childPtr; 
-	while (childPtr != NULL) {
-	  next = childPtr->next;
-	  free(childPtr);
-	  childPtr = next;
-	}
-	circuit[i]->childHead = NULL;
-      }
-      if (circuit[i]->prL != NULL && circuit[i]->prR != NULL) {
-      	free(circuit[i]->prL);
-      	circuit[i]->prL = NULL;
-      	free(circuit[i]->prR);
-      	circuit[i]->prR = NULL;
+  for (int r = 0; r < warmup + repetitions; r++) {
+    if (!time_loading(filename, &times[0], &times[1], &times[4], r >= warmup)) {
+      for (int p = 0; p < NUM_PHASES; p++) {
+	free(times[p].ns);
       }
-      /* Deallocate the node */
-      free(circuit[i]);
+      return -1;
     }
   }
-  return (EXIT_SUCCESS);
-}
 
-int main(int argc, char** argv) {
-  FILE *ac_file;
-  char lineToRead[MAX_LINE_NUMBER]; 
-  //struct node **circuit;
-  struct node *n; //temporary storage for nodes
-  int index = 0;
-  int size = 0;
-
-  printf("iterations? ");
-  int iter = 0;
-  scanf("%d", &iter);
-  
-  /*Try to open the AC file*/
-  if (argc < 2) {
-    /*No file has been passed - error*/
-    fprintf(stderr, "Must pass AC file\n");
-    return(EXIT_FAILURE);
+  ac = ac_load(filename, 0);
+  if (nodeOrder != AC_ORDER_FILE) {
+    struct circuit *reordered = ac_reorder(ac, nodeOrder, NULL);
+    ac_free(ac);
+    ac = reordered;
   }
-
-  /*If the size of AC is specified, allocate fixed amount of memory*/
-  if (argc > 2) {
-    size = atoi(argv[2]);
+  if (engine == AC_ENGINE_AUTO) {
+    struct circuit_stats stats;
+    ac_analyze(ac, &stats);
+    engine = ac_choose_engine(&stats, 1, NULL);
   }
-
-  /* Test by looping 1000 times and clocking performance*/
-  clock_t start, end;
-  double cpu_time_used;
-  start = clock();
-
-  for (int t = 0; t < iter; t++) {
-    index = 0;
-    
-    ac_file = fopen(argv[1], "r");
-    
-    if (!ac_file) {
-      /* File does not exist*/
-      fprintf(stderr, "Unable to read file %s\n", argv[1]);
-      return(EXIT_FAILURE);
+  ac_set_engine(ac, engine);
+  numNodes = ac->numNodes;
+  for (int r = 0; r < warmup + repetitions; r++) {
+    time_passes(ac, NULL, &times[2], &times[3], r >= warmup);
+  }
+  if (scaledMode) {
+    scaled = ac_scaled_create(ac);
+    for (int r = 0; r < warmup + repetitions; r++) {
+      time_passes(ac, scaled, &times[5], &times[6], r >= warmup);
     }
+    ac_scaled_free(scaled);
+  }
+  ac_free(ac);
 
-    
-    /*File was successfully read*/
-    while (fgets(lineToRead, MAX_LINE_NUMBER, ac_file) != NULL) {
-      //printf("index: %d, %s", index, lineToRead);
-        
-      if (*lineToRead == '(') {
-	printf("\t... reading file ...\n");
-
-	/*Allocate memory for the circuit*/
-	if (size > 0) {
-	  size += NODE_SAFETY_MARGIN;
-	  circuit = (struct node**)malloc(sizeof(struct node*) * size);
-	}
-	else {
-	  circuit = (struct node**)malloc(sizeof(struct node*) * MAX_NODE_NUMBER);
+  printf("%s: %d nodes, %s order, %s engine, %d warmup, %d repetitions\n", filename, numNodes,
+	 ac_order_name(nodeOrder), ac_engine_name(engine), warmup, repetitions);
+  printf("  %-15s %12s %12s %14s\n", "phase", "median us", "p99 us", "nodes/s");
+  for (int p = 0; p < numPhases; p++) {
+    qsort(times[p].ns, times[p].count, sizeof(double), compare_doubles);
+  }
+  for (int p = 0; p < numPhases; p++) {
+    double median = percentile(&times[p], 0.5);
+    double p99 = percentile(&times[p], 0.99);
+    double throughput = (median > 0) ? numNodes / (median * 1e-9) : 0;
+
+    printf("  %-15s %12.2lf %12.2lf %14.4le", phaseName[p], median / 1e3, p99 / 1e3, throughput);
+    if (p >= 5) {
+      /*Against the plain pass in the same direction*/
+      double plain = percentile(&times[p - 3], 0.5);
+      printf("  %5.1lfx plain", (plain > 0) ? median / plain : 0);
+    }
+    if (baseline != NULL) {
+      double before = baseline_median(baseline, filename, phaseName[p]);
+      if (before > 0) {
+	printf("  %+6.1lf%%", (median / before - 1) * 100);
+	if (median > before * REGRESSION_TOLERANCE) {
+	  printf(" REGRESSION");
+	  regressions++;
 	}
       }
-      else if (*lineToRead == 'E'){
-	printf("\t... done reading file ... \n");
-	index--;
-	n->dr = 1;
-	break;
-      }
-      else{
-	if (*lineToRead == 'n') {
-	  /*Leaf node (Constant)*/
-	  /*Insert node into circuit*/
-	  n = allocate_constant_node(lineToRead, n);
-	}
-      
-	else if (*lineToRead == 'v') {
-	  /*Leaf node (Variable)*/
-	  n = allocate_variable_node(lineToRead, n);
-	}
-      
-	else if (*lineToRead == '+') {
-	  /*Non-leaf (Operation)*/
-	  n = (struct node*)malloc(sizeof(struct node));
-	  /*"n->child" stores the index of the children nodes in the circuit*/
-	  sscanf(lineToRead, "%s", &(n->nodeType));
-	  n->flag = false;
-	  n->vr = 0;
-	  n->dr = 0;
-	  n->childHead = NULL;
-	  n->prL = NULL;
-	  n->prR = NULL;
-
-	  /*Read the sequence of child nodes*/
-	  char *nodeList = lineToRead;
-	  int childIndex;
-	  int offset;
-	  struct childList *children;
-	  struct childList *linking;
-	  nodeList += 2; /*Ignore the operator (first two characters) */
-	
-	  while (sscanf(nodeList, " %d%n", &childIndex, &offset) == 1) {
-	    children = (struct childList*)malloc(sizeof(struct childList));
-	    children->childIndex = childIndex;
-
-	    if (n->childHead == NULL) {
-	      n->childHead = children;
-	      linking = n->childHead;
-	    }
-	    else {
-	      linking->next = children;
-	      linking = linking->next;
-	    }
-	    nodeList += offset;
-	  }
-	  linking->next = NULL;
-
-	  /* Add the child node value only if the flag is down */
-	  struct childList *tempPtr = n->childHead;
-	
-	  while (tempPtr != NULL) {
-	    int cIndex = tempPtr->childIndex;
-	    //if (!circuit[cIndex]->flag) {
-	    n->vr += circuit[cIndex]->vr;
-	      //}
-	    tempPtr = tempPtr->next;
-	  }
-	}
-      
-	else if (*lineToRead == '*') {
-	  /*Non-leaf (Operation)*/
-	  n = (struct node*)malloc(sizeof(struct node));
-	  n->nodeType = '*';
-	  n->vr = 1;
-	  n->dr = 0;
-	  n->flag = false;
-	  n->childHead = NULL;
-	  n->prL = NULL;
-	  n->prR = NULL;
-	
-	  /*Read the sequence of child nodes*/
-	  char *nodeList = lineToRead;
-	  int childIndex = 0;
-	  int offset;
-	  int zeroCount = 0;
-	  int childCount = 0;
-	  struct childList *children;
-	  struct childList *linking;
-	  nodeList += 2; /*Ignore the operator (first two characters) */
-	
-	  while (sscanf(nodeList, " %d%n", &childIndex, &offset) == 1) {
-	    children = (struct childList*)malloc(sizeof(struct childList));
-	    children->childIndex = childIndex;
-
-	    /*Insert child node*/
-	    if (n->childHead == NULL) {
-	      n->childHead = children;
-	      linking = n->childHead;
-	    }
-	    else {
-	      linking->next = children;
-	      linking = linking->next;
-	    }
-	    nodeList += offset;
-	    /*Check if child node is zero*/
-	    //if (circuit[childIndex]->vr == 0) {
-	    //zeroCount++;
-	    //}
-	    childCount++;
-	    //children->position = childCount;
-	  }
-	  linking->next = NULL;
-
-	  //if (zeroCount == 1) {
-	  //n->flag = true;
-	  //}
-	
-	  //bit_forwardpropagation(n);
+    }
+    printf("\n");
+    if (csv != NULL) {
+      fprintf(csv, "%s,%s,%d,%.0lf,%.0lf,%.6le\n", filename, phaseName[p], times[p].count,
+	      median, p99, throughput);
+    }
+  }
+  for (int p = 0; p < NUM_PHASES; p++) {
+    free(times[p].ns);
+  }
+  return regressions;
+}
 
-	  /*Cache back-prop*/
-	  n->childHead->numChildren = childCount;
-	  cache_forwardpropagation(n);
-	}
-	circuit[index] = n;
-	index++;   
+int main(int argc, char** argv) {
+  int warmup = DEFAULT_WARMUP;
+  int repetitions = DEFAULT_REPETITIONS;
+  int engine = AC_ENGINE_CACHE;
+  int nodeOrder = AC_ORDER_FILE;
+  bool scaledMode = false;
+  char *csvFile = NULL;
+  char *baseline = NULL;
+  FILE *csv = NULL;
+  int regressions = 0;
+  int status = EXIT_SUCCESS;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "w:r:m:d:so:c:")) != -1) {
+    if (opt == 'w') {
+      warmup = atoi(optarg);
+    }
+    else if (opt == 'r') {
+      repetitions = atoi(optarg);
+    }
+    else if (opt == 'm') {
+      engine = ac_engine_by_name(optarg);
+      if (engine < 0) {
+	fprintf(stderr, "Unknown engine %s\n", optarg);
+	return(EXIT_FAILURE);
       }
     }
-
-    /*Print out circuit output*/
-    printf("output %lf for %d nodes\n", circuit[index]->vr, index);
-  
-    printf("log: %lf\n", log10(circuit[index]->vr));
-  
-    if (circuit[index]->vr == 0) {
-      assert(0);
+    else if (opt == 'd') {
+      nodeOrder = ac_order_by_name(optarg);
+      if (nodeOrder < 0) {
+	fprintf(stderr, "Unknown node order %s\n", optarg);
+	return(EXIT_FAILURE);
+      }
     }
+    else if (opt == 's') {
+      scaledMode = true;
+    }
+    else if (opt == 'o') {
+      csvFile = optarg;
+    }
+    else if (opt == 'c') {
+      baseline = optarg;
+    }
+    else {
+      fprintf(stderr, "Usage: %s [-w warmup] [-r repetitions] [-m engine] [-d order] [-s] [-o results.csv] [-c baseline.csv] [file.ac ...]\n", argv[0]);
+      return(EXIT_FAILURE);
+    }
+  }
+  if (repetitions < 1 || warmup < 0) {
+    fprintf(stderr, "Need at least one repetition\n");
+    return(EXIT_FAILURE);
+  }
 
-    printf("\t... starting backpropagation ...\n");
-
-    /*Bit-encoded backpropagation*/
-    //bit_backpropagation(index);
-  
-    /*Product cache backpropagation*/
-    cache_backpropagation(index);
-  
-    /*Free all nodes and circuit*/
-    free_nodes(index);
-    free(circuit);
-
-    printf("\t... done ... \n");
-  
-    /*Close file*/
-    if (ac_file != NULL) {
-      fclose(ac_file);
+  if (csvFile != NULL) {
+    csv = fopen(csvFile, "w");
+    if (!csv) {
+      fprintf(stderr, "Unable to write file %s\n", csvFile);
+      return(EXIT_FAILURE);
     }
+    fprintf(csv, "circuit,phase,repetitions,median_ns,p99_ns,nodes_per_second\n");
   }
 
-  end = clock();
-  cpu_time_used = ((double) (end - start)) / CLOCKS_PER_SEC;
-  printf ("Your calculations took %.5lf seconds to run.\n", cpu_time_used );
+  int numFiles = (optind < argc) ? argc - optind : (int)(sizeof(sampleCircuits) / sizeof(sampleCircuits[0]));
+  for (int f = 0; f < numFiles; f++) {
+    const char *filename = (optind < argc) ? argv[optind + f] : sampleCircuits[f];
+    int result = bench_circuit(filename, warmup, repetitions, engine, nodeOrder, scaledMode, csv, baseline);
+    if (result < 0) {
+      status = EXIT_FAILURE;
+    }
+    else {
+      regressions += result;
+    }
+  }
 
-  printf("\t... file closed successfully ...\n");
-  
-  return (EXIT_SUCCESS);
+  if (csv != NULL) {
+    fclose(csv);
+  }
+  if (regressions > 0) {
+    fprintf(stderr, "%d phases regressed by more than %.0lf%%\n", regressions, (REGRESSION_TOLERANCE - 1) * 100);
+    status = EXIT_FAILURE;
+  }
+  return (status);
 }
-  
@@ -0,0 +1,746 @@
+/*
+ * File:   test_units.c
+ * Author: andrewchoi
+ *
+ * Checks of single functions against small hand-written circuits and
+ * reference results, and of the engines against the cache engine on the
+ * sample circuits. Every check prints one line and the program exits
+ * with a failure if any check failed. Run it from the repository root.
+ *
+ * Usage: test_units
+ *
+ * gcc -O2 -I. -o test_bench/test_units test_bench/test_units.c ac_*.c -lm -lpthread -ldl
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "ac.h"
+
+#define TOLERANCE 1e-12 //Largest difference to the cache engine's marginals
+#define EVIDENCE_SHARE 0.7 //Share of the variables observed by random evidence
+
+static int numFailed = 0;
+
+static void report(const char *name, bool passed) {
+  printf("%-40s %s\n", name, passed ? "ok" : "FAILED");
+  if (!passed) {
+    numFailed++;
+  }
+}
+
+/*
+ * Load a circuit written out from 'text', NULL if it does not load
+ */
+static struct circuit* load_text(const char *text) {
+  char filename[] = "/tmp/ac_testXXXXXX";
+  int fd = mkstemp(filename);
+  struct circuit *ac;
+
+  if (fd < 0) {
+    return NULL;
+  }
+  if (write(fd, text, strlen(text)) != (ssize_t)strlen(text)) {
+    close(fd);
+    remove(filename);
+    return NULL;
+  }
+  close(fd);
+  ac = ac_load(filename, 0);
+  remove(filename);
+  return ac;
+}
+
+/*
+ * Random evidence observing about EVIDENCE_SHARE of the variables
+ */
+static void random_evidence(const struct circuit *ac, int *evidence) {
+  for (int x = 0; x < ac->numVars; x++) {
+    evidence[x] = (drand48() < EVIDENCE_SHARE) ? (int)(drand48() * ac->varCard[x]) : -1;
+  }
+}
+
+/*
+ * Output and marginals of 'evidence' on the cache engine, the reference
+ * for the other evaluators
+ */
+static double reference_marginals(struct circuit *ac, const int *evidence, double *marginals) {
+  ac_set_engine(ac, AC_ENGINE_CACHE);
+  ac_set_evidence(ac, evidence);
+  ac_forward(ac);
+  ac_backward(ac);
+  return ac_marginals(ac, marginals);
+}
+
+/*
+ * Whether a reference fits a double. The outputs of the sample circuits
+ * overflow unless most variables are observed, so the checks observe
+ * about EVIDENCE_SHARE of them; the few queries still out of range on
+ * the cache engine are not compared.
+ */
+static bool in_range(double output, const double *marginals, int count) {
+  if (output == 0 || !isfinite(output)) {
+    return false;
+  }
+  for (int k = 0; k < count; k++) {
+    if (!isfinite(marginals[k])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * Whether an output and its marginals match the reference ones
+ */
+static bool same_results(double output, const double *marginals, double refOutput, const double *refMarginals,
+			 int count) {
+  if (fabs(output - refOutput) > TOLERANCE * fabs(refOutput)) {
+    fprintf(stderr, "Output %.17g, cache engine %.17g\n", output, refOutput);
+    return false;
+  }
+  for (int k = 0; k < count; k++) {
+    if (!(fabs(marginals[k] - refMarginals[k]) <= TOLERANCE)) {
+      fprintf(stderr, "Marginal %d is %.17g, cache engine %.17g\n", k, marginals[k], refMarginals[k]);
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * Incremental re-evaluation after a sequence of evidence changes, a few
+ * variables at a time, must match full passes of the cache engine
+ */
+static bool check_incremental(const char *filename, int numChanges) {
+  struct circuit *ac = ac_load(filename, 0);
+  struct circuit *reference = ac_load(filename, 0);
+  struct incremental *inc;
+  int *evidence;
+  double *marginals, *refMarginals;
+  bool passed = (ac != NULL && reference != NULL);
+  int numCompared = 0;
+  int count;
+
+  if (!passed) {
+    return false;
+  }
+  count = ac_marginal_count(ac);
+  evidence = (int*)malloc(sizeof(int) * (ac->numVars + 1));
+  marginals = (double*)malloc(sizeof(double) * count);
+  refMarginals = (double*)malloc(sizeof(double) * count);
+  srand48(11);
+  random_evidence(ac, evidence);
+  inc = ac_incremental_create(ac, evidence);
+  for (int c = 0; passed && c < numChanges; c++) {
+    /*Observe, change or retract one to three variables*/
+    for (int k = 0; k <= c % 3; k++) {
+      int x = (int)(drand48() * ac->numVars);
+      evidence[x] = (drand48() < EVIDENCE_SHARE) ? (int)(drand48() * ac->varCard[x]) : -1;
+      ac_incremental_set_variable(inc, x, evidence[x]);
+    }
+    ac_incremental_forward(inc);
+    ac_incremental_backward(inc);
+    double refOutput = reference_marginals(reference, evidence, refMarginals);
+    if (in_range(refOutput, refMarginals, count)) {
+      passed = same_results(ac_marginals(ac, marginals), marginals, refOutput, refMarginals, count);
+      numCompared++;
+    }
+  }
+  if (numCompared < numChanges / 2) {
+    fprintf(stderr, "Only %d of %d queries of %s fit a double\n", numCompared, numChanges, filename);
+    passed = false;
+  }
+  ac_incremental_free(inc);
+  free(refMarginals);
+  free(marginals);
+  free(evidence);
+  ac_free(reference);
+  ac_free(ac);
+  return passed;
+}
+
+/*
+ * Every lane of a batch must match the cache engine on its own evidence:
+ * a batch with a partial last block, then its first instances reused
+ * with new evidence, evaluated without the rest
+ */
+static bool check_batch(const char *filename) {
+  struct circuit *ac = ac_load(filename, 0);
+  struct circuit *reference = ac_load(filename, 0);
+  int numInstances = 2 * AC_BLOCK_SIZE + 3;
+  int numReused = AC_BLOCK_SIZE + 1;
+  struct circuit_batch *batch;
+  int *evidence;
+  double *marginals, *refMarginals;
+  bool passed = (ac != NULL && reference != NULL);
+  int numCompared = 0;
+  int count;
+
+  if (!passed) {
+    return false;
+  }
+  count = ac_marginal_count(ac);
+  evidence = (int*)malloc(sizeof(int) * (ac->numVars + 1) * numInstances);
+  marginals = (double*)malloc(sizeof(double) * count);
+  refMarginals = (double*)malloc(sizeof(double) * count);
+  batch = ac_batch_create(ac, numInstances);
+  srand48(13);
+  for (int round = 0; passed && round < 2; round++) {
+    int numEvaluated = (round == 0) ? numInstances : numReused;
+    for (int k = 0; k < numEvaluated; k++) {
+      random_evidence(ac, evidence + k * (ac->numVars + 1));
+      ac_batch_set_evidence(batch, k, evidence + k * (ac->numVars + 1));
+    }
+    ac_batch_evaluate_instances(batch, numEvaluated);
+    for (int k = 0; passed && k < numEvaluated; k++) {
+      double refOutput = reference_marginals(reference, evidence + k * (ac->numVars + 1), refMarginals);
+      if (in_range(refOutput, refMarginals, count)) {
+	passed = same_results(ac_batch_marginals(batch, k, marginals), marginals, refOutput, refMarginals, count);
+	numCompared++;
+      }
+    }
+  }
+  if (numCompared < (numInstances + numReused) / 2) {
+    fprintf(stderr, "Only %d of %d queries of %s fit a double\n", numCompared, numInstances + numReused, filename);
+    passed = false;
+  }
+  ac_batch_free(batch);
+  free(refMarginals);
+  free(marginals);
+  free(evidence);
+  ac_free(reference);
+  ac_free(ac);
+  return passed;
+}
+
+/*
+ * Both passes on 'numThreads' threads with the dataflow schedule must
+ * match the serial cache engine, for every engine
+ */
+static bool check_dataflow(const char *filename, int numThreads, int numQueries) {
+  static const int engines[] = { AC_ENGINE_CACHE, AC_ENGINE_PULL, AC_ENGINE_BIT };
+  int numEngines = (int)(sizeof(engines) / sizeof(engines[0]));
+  struct circuit *ac = ac_load(filename, 0);
+  struct circuit *reference = ac_load(filename, 0);
+  int *evidence;
+  double *marginals, *refMarginals;
+  bool passed = (ac != NULL && reference != NULL);
+  int numCompared = 0;
+  int count;
+
+  if (!passed) {
+    return false;
+  }
+  count = ac_marginal_count(ac);
+  evidence = (int*)malloc(sizeof(int) * (ac->numVars + 1));
+  marginals = (double*)malloc(sizeof(double) * count);
+  refMarginals = (double*)malloc(sizeof(double) * count);
+  srand48(17);
+  for (int e = 0; passed && e < numEngines; e++) {
+    struct thread_pool *pool;
+    ac_set_engine(ac, engines[e]);
+    pool = ac_pool_create(ac, numThreads);
+    ac_pool_set_schedule(pool, AC_SCHEDULE_DATAFLOW);
+    for (int q = 0; passed && q < numQueries; q++) {
+      double refOutput;
+      random_evidence(ac, evidence);
+      ac_set_evidence(ac, evidence);
+      ac_parallel_forward(pool);
+      ac_parallel_backward(pool);
+      refOutput = reference_marginals(reference, evidence, refMarginals);
+      if (in_range(refOutput, refMarginals, count)) {
+	passed = same_results(ac_marginals(ac, marginals), marginals, refOutput, refMarginals, count);
+	numCompared++;
+      }
+    }
+    ac_pool_free(pool);
+  }
+  if (numCompared < numEngines * numQueries / 2) {
+    fprintf(stderr, "Only %d of %d queries of %s fit a double\n", numCompared, numEngines * numQueries, filename);
+    passed = false;
+  }
+  free(refMarginals);
+  free(marginals);
+  free(evidence);
+  ac_free(reference);
+  ac_free(ac);
+  return passed;
+}
+
+/*
+ * Compare a circuit rebuilt from 'reference' with it on 'evidence': the
+ * output, the marginals and the value of every node mapped by 'remap'.
+ * The marginals of the variables a specialized circuit was fixed on come
+ * from 'fixed' (NULL if it was not specialized). Returns -1 if the
+ * reference does not fit a double, 0 on a mismatch and 1 on a match.
+ */
+static int compare_rebuilt(struct circuit *rebuilt, const int *remap, const int *fixed,
+			   struct circuit *reference, const int *evidence, double *marginals,
+			   double *refMarginals) {
+  int count = ac_marginal_count(reference);
+  double refOutput = reference_marginals(reference, evidence, refMarginals);
+  double output;
+
+  if (!in_range(refOutput, refMarginals, count)) {
+    return -1;
+  }
+  ac_set_evidence(rebuilt, evidence);
+  ac_forward(rebuilt);
+  ac_backward(rebuilt);
+  output = ac_marginals(rebuilt, marginals);
+  if (fixed != NULL) {
+    ac_fixed_marginals(rebuilt, fixed, marginals);
+  }
+  if (!same_results(output, marginals, refOutput, refMarginals, count)) {
+    return 0;
+  }
+  for (int i = 0; i < reference->numNodes; i++) {
+    int j = remap[i];
+    if (j >= 0 && !(fabs(rebuilt->vr[j] - reference->vr[i]) <= TOLERANCE * fabs(reference->vr[i]))) {
+      fprintf(stderr, "Node %d, rebuilt as node %d, has value %.17g instead of %.17g\n",
+	      i, j, rebuilt->vr[j], reference->vr[i]);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+ * A simplified circuit must keep the variables, map every indicator leaf
+ * to a leaf of the same variable and value, and match the original's
+ * output, marginals and mapped node values
+ */
+static bool check_simplify(const char *filename, int maxFanIn, int numQueries) {
+  struct circuit *reference = ac_load(filename, 0);
+  struct circuit *simplified;
+  int *remap, *evidence;
+  double *marginals, *refMarginals;
+  bool passed = (reference != NULL);
+  int numCompared = 0;
+  int count;
+
+  if (!passed) {
+    return false;
+  }
+  remap = (int*)malloc(sizeof(int) * reference->numNodes);
+  simplified = ac_simplify(reference, maxFanIn, remap);
+  ac_set_engine(simplified, AC_ENGINE_CACHE);
+  passed = simplified->numVars == reference->numVars
+    && memcmp(simplified->varCard, reference->varCard, sizeof(int) * reference->numVars) == 0;
+  for (int l = 0; passed && l < reference->varLeafStart[reference->numVars]; l++) {
+    int leaf = reference->varLeaf[l];
+    int j = remap[leaf];
+    passed = j >= 0 && simplified->nodeType[j] == 'v' && simplified->varIndex[j] == reference->varIndex[leaf]
+      && simplified->varValue[j] == reference->varValue[leaf];
+    if (!passed) {
+      fprintf(stderr, "Indicator %d is not mapped to a leaf of its variable and value\n", leaf);
+    }
+  }
+
+  count = ac_marginal_count(reference);
+  evidence = (int*)malloc(sizeof(int) * (reference->numVars + 1));
+  marginals = (double*)malloc(sizeof(double) * count);
+  refMarginals = (double*)malloc(sizeof(double) * count);
+  srand48(19);
+  for (int q = 0; passed && q < numQueries; q++) {
+    int result;
+    random_evidence(reference, evidence);
+    result = compare_rebuilt(simplified, remap, NULL, reference, evidence, marginals, refMarginals);
+    passed = (result != 0);
+    numCompared += (result > 0);
+  }
+  if (passed && numCompared < numQueries / 2) {
+    fprintf(stderr, "Only %d of %d queries of %s fit a double\n", numCompared, numQueries, filename);
+    passed = false;
+  }
+  free(refMarginals);
+  free(marginals);
+  free(evidence);
+  free(remap);
+  ac_free(simplified);
+  ac_free(reference);
+  return passed;
+}
+
+/*
+ * A circuit specialized on random partial evidence must keep the leaves
+ * of the free variables, drop those of the fixed ones, and match the
+ * original's output, marginals and mapped node values under evidence
+ * that agrees with the fixed values
+ */
+static bool check_specialize(const char *filename, int numQueries) {
+  struct circuit *reference = ac_load(filename, 0);
+  struct circuit *specialized;
+  int *remap, *fixed, *evidence;
+  double *marginals, *refMarginals;
+  bool passed = (reference != NULL);
+  int numCompared = 0;
+  int count;
+
+  if (!passed) {
+    return false;
+  }
+  remap = (int*)malloc(sizeof(int) * reference->numNodes);
+  fixed = (int*)malloc(sizeof(int) * (reference->numVars + 1));
+  srand48(23);
+  /*Fix about half of the variables*/
+  for (int x = 0; x < reference->numVars; x++) {
+    fixed[x] = (drand48() < 0.5) ? (int)(drand48() * reference->varCard[x]) : -1;
+  }
+  specialized = ac_specialize(reference, fixed, 0, remap);
+  ac_set_engine(specialized, AC_ENGINE_CACHE);
+  passed = specialized->numVars == reference->numVars;
+  for (int x = 0; passed && x < reference->numVars; x++) {
+    int numLeaves = specialized->varLeafStart[x+1] - specialized->varLeafStart[x];
+    int numBefore = reference->varLeafStart[x+1] - reference->varLeafStart[x];
+    passed = (numLeaves == ((fixed[x] >= 0) ? 0 : numBefore));
+    for (int l = reference->varLeafStart[x]; passed && fixed[x] < 0 && l < reference->varLeafStart[x+1]; l++) {
+      int leaf = reference->varLeaf[l];
+      int j = remap[leaf];
+      passed = j >= 0 && specialized->nodeType[j] == 'v' && specialized->varIndex[j] == x
+	&& specialized->varValue[j] == reference->varValue[leaf];
+    }
+    if (!passed) {
+      fprintf(stderr, "The leaves of %s variable %d are not kept as they should\n",
+	      (fixed[x] >= 0) ? "fixed" : "free", x);
+    }
+  }
+
+  count = ac_marginal_count(reference);
+  evidence = (int*)malloc(sizeof(int) * (reference->numVars + 1));
+  marginals = (double*)malloc(sizeof(double) * count);
+  refMarginals = (double*)malloc(sizeof(double) * count);
+  for (int q = 0; passed && q < numQueries; q++) {
+    int result;
+    random_evidence(reference, evidence);
+    for (int x = 0; x < reference->numVars; x++) {
+      evidence[x] = (fixed[x] >= 0) ? fixed[x] : evidence[x];
+    }
+    result = compare_rebuilt(specialized, remap, fixed, reference, evidence, marginals, refMarginals);
+    passed = (result != 0);
+    numCompared += (result > 0);
+  }
+  if (passed && numCompared < numQueries / 2) {
+    fprintf(stderr, "Only %d of %d queries of %s fit a double\n", numCompared, numQueries, filename);
+    passed = false;
+  }
+  free(refMarginals);
+  free(marginals);
+  free(evidence);
+  free(fixed);
+  free(remap);
+  ac_free(specialized);
+  ac_free(reference);
+  return passed;
+}
+
+/*
+ * Every node order must keep the output of the file order, also when a
+ * subcircuit the root does not need reaches higher levels than the root
+ */
+static bool check_reorder(const char *text) {
+  struct circuit *ac = load_text(text);
+  bool passed = (ac != NULL);
+
+  if (!passed) {
+    return false;
+  }
+  ac_set_engine(ac, AC_ENGINE_CACHE);
+  ac_set_evidence(ac, NULL);
+  ac_forward(ac);
+  for (int order = 0; order < AC_NUM_ORDERS; order++) {
+    struct circuit *reordered = ac_reorder(ac, order, NULL);
+    int root = reordered->numNodes - 1;
+    ac_set_engine(reordered, AC_ENGINE_CACHE);
+    ac_set_evidence(reordered, NULL);
+    ac_forward(reordered);
+    passed = passed && reordered->nodeType[root] == ac->nodeType[ac->numNodes - 1]
+      && reordered->vr[root] == ac->vr[ac->numNodes - 1];
+    ac_free(reordered);
+  }
+  ac_free(ac);
+  return passed;
+}
+
+/*
+ * Write 'value' over the int32 at 'position' of a binary circuit file,
+ * load it, and put the old value back. True if the changed file was
+ * rejected.
+ */
+static bool rejects_change(const char *filename, long position, int32_t value) {
+  FILE *acb = fopen(filename, "r+b");
+  struct circuit *ac;
+  int32_t old;
+  bool rejected = true;
+
+  if (!acb) {
+    return false;
+  }
+  fseek(acb, position, SEEK_SET);
+  if (fread(&old, sizeof(old), 1, acb) != 1) {
+    fclose(acb);
+    return false;
+  }
+  fseek(acb, position, SEEK_SET);
+  fwrite(&value, sizeof(value), 1, acb);
+  fclose(acb);
+  ac = ac_load(filename, 0);
+  if (ac != NULL) {
+    rejected = false;
+    ac_free(ac);
+  }
+  acb = fopen(filename, "r+b");
+  fseek(acb, position, SEEK_SET);
+  fwrite(&old, sizeof(old), 1, acb);
+  fclose(acb);
+  return rejected;
+}
+
+/*
+ * Save a circuit as a binary file named after 'filename', false if it
+ * does not load or can not be written
+ */
+static bool save_binary_text(const char *text, char *filename) {
+  struct circuit *ac = load_text(text);
+  int fd = mkstemp(filename);
+  bool saved;
+
+  if (ac == NULL || fd < 0) {
+    if (ac != NULL) {
+      ac_free(ac);
+    }
+    return false;
+  }
+  close(fd);
+  saved = ac_save_binary(ac, filename) == EXIT_SUCCESS;
+  ac_free(ac);
+  return saved;
+}
+
+/*
+ * A binary circuit whose header counts do not match its sections must be
+ * rejected. The header holds magic, version and byte order, then the
+ * int32 counts of nodes, edges, variables, levels and registers.
+ */
+static bool check_binary_counts(const char *text) {
+  static const int countOffset[] = { 12, 16, 20, 24, 28 };
+  static const int32_t change[] = { 1, -1000 };
+  char filename[] = "/tmp/ac_testXXXXXX";
+  bool passed = save_binary_text(text, filename);
+  struct circuit *ac;
+
+  for (int c = 0; passed && c < (int)(sizeof(countOffset) / sizeof(countOffset[0])); c++) {
+    for (int k = 0; passed && k < (int)(sizeof(change) / sizeof(change[0])); k++) {
+      FILE *acb = fopen(filename, "rb");
+      int32_t count;
+      fseek(acb, countOffset[c], SEEK_SET);
+      passed = fread(&count, sizeof(count), 1, acb) == 1;
+      fclose(acb);
+      passed = passed && rejects_change(filename, countOffset[c], count + change[k]);
+    }
+  }
+  /*Unchanged, it still loads*/
+  ac = ac_load(filename, 0);
+  passed = passed && ac != NULL;
+  if (ac != NULL) {
+    ac_free(ac);
+  }
+  remove(filename);
+  return passed;
+}
+
+/*
+ * A binary circuit whose arrays refer to nodes, edges, leaves or
+ * registers that do not exist must be rejected. The section offsets
+ * follow the counts in the header, as uint64 in the order of the
+ * sections: cardinalities, node types, indicator variables and values,
+ * leaf values, child CSR, indicator CSR, parent CSR with positions,
+ * levels and register offsets.
+ */
+static bool check_binary_contents(const char *text) {
+  /*Section, int32 entry and the value written over it*/
+  static const struct { int section; int entry; int32_t value; } cases[] = {
+    { 0, 0, -1 },                     /*negative cardinality*/
+    { 1, 0, 0x78787878 },             /*node type 'x'*/
+    { 2, 0, 2 },                      /*indicator of a variable that does not exist*/
+    { 5, 8, 100 },                    /*child offsets past the edges*/
+    { 5, 7, 1 },                      /*decreasing child offsets*/
+    { 6, 0, 5 },                      /*child after its node*/
+    { 6, 0, -1 },                     /*negative child*/
+    { 7, 1, 5 },                      /*decreasing indicator offsets*/
+    { 8, 0, 7 },                      /*indicator list holding a '+' node*/
+    { 9, 8, 6 },                      /*parent offsets short of the edges*/
+    { 10, 0, 100 },                   /*parent that does not exist*/
+    { 11, 0, 7 },                     /*position past the parent's children*/
+    { 11, 0, 1 },                     /*position of another child*/
+    { 12, 1, 100 },                   /*level offsets past the nodes*/
+    { 13, 0, 1 },                     /*node on two levels*/
+    { 14, 5, 1000 },                  /*registers past the arena*/
+    { 14, 0, 0 }                      /*registers of a leaf*/
+  };
+  char filename[] = "/tmp/ac_testXXXXXX";
+  bool passed = save_binary_text(text, filename);
+  struct circuit *ac;
+
+  for (int k = 0; passed && k < (int)(sizeof(cases) / sizeof(cases[0])); k++) {
+    FILE *acb = fopen(filename, "rb");
+    uint64_t offset;
+    fseek(acb, 32 + sizeof(uint64_t) * cases[k].section, SEEK_SET);
+    passed = fread(&offset, sizeof(offset), 1, acb) == 1;
+    fclose(acb);
+    passed = passed && rejects_change(filename, (long)offset + 4 * cases[k].entry, cases[k].value);
+    if (!passed) {
+      fprintf(stderr, "Entry %d of section %d set to %d was not rejected\n", cases[k].entry,
+	      cases[k].section, cases[k].value);
+    }
+  }
+  ac = ac_load(filename, 0);
+  passed = passed && ac != NULL;
+  if (ac != NULL) {
+    ac_free(ac);
+  }
+  remove(filename);
+  return passed;
+}
+
+/*
+ * Node lines with a missing, malformed or out of range field must be
+ * rejected; blanks and CRLF line ends are fine
+ */
+static bool check_parse_errors(void) {
+  static const char *invalid[] = {
+    "(2)\nv 0 0\nn\n* 0 1\nEOF\n",
+    "(2)\nv 0 0\nn x\n* 0 1\nEOF\n",
+    "(2)\nv 0 0\nn 0.5x\n* 0 1\nEOF\n",
+    "(2)\nv 0\nv 0 1\n* 0 1\nEOF\n",
+    "(2)\nv\nv 0 1\n* 0 1\nEOF\n",
+    "(2)\nv 0 x\nv 0 1\n* 0 1\nEOF\n",
+    "(2)\nv 0 0\nv 0 99999999999\n* 0 1\nEOF\n",
+    "(2)\nv 0 0\nv 0 1\n* 0 4294967297\nEOF\n",
+    "(2)\nv 0 0\nv 0 1\n* 0 x\nEOF\n",
+    "(2)\nv 0 0\nv 0 1\n* 0 2\nEOF\n",
+    "(2 99999999999)\nv 0 0\nv 0 1\n* 0 1\nEOF\n",
+    "(2 x)\nv 0 0\nv 0 1\n* 0 1\nEOF\n"
+  };
+  bool passed = true;
+  struct circuit *ac;
+
+  for (int k = 0; k < (int)(sizeof(invalid) / sizeof(invalid[0])); k++) {
+    ac = load_text(invalid[k]);
+    if (ac != NULL) {
+      fprintf(stderr, "Circuit %d was not rejected\n", k);
+      passed = false;
+      ac_free(ac);
+    }
+  }
+  ac = load_text("(2)\r\nv 0 0 \r\nn 0.5\t\r\n* 0 1  \r\n+ 2\r\n 0\r\nEOF\r\n");
+  passed = passed && ac != NULL && ac->numNodes == 4 && ac->numEdges == 3 && ac->vr[1] == 0.5;
+  if (ac != NULL) {
+    ac_free(ac);
+  }
+  return passed;
+}
+
+/*
+ * Evidence lines must hold one value per variable, each a number below
+ * the cardinality or '*'
+ */
+static bool check_evidence(void) {
+  static const struct { const char *line; int status; } cases[] = {
+    { "1,2", 1 }, { " * , 0 \n", 1 }, { "", 0 }, { "  \n", 0 },
+    { "2,0", -1 }, { "0,3", -1 }, { "-1,0", -1 }, { "0", -1 }, { "0,1,1", -1 },
+    { "x,0", -1 }, { "0,1x", -1 }, { "0,,1", -1 }, { "0 1", -1 }, { "0,1,", -1 }
+  };
+  struct circuit *ac = load_text("(2 3)\nv 0 0\nv 0 1\nv 1 0\nv 1 1\nv 1 2\n* 0 2\nEOF\n");
+  int evidence[3];
+  bool passed = (ac != NULL);
+
+  for (int k = 0; passed && k < (int)(sizeof(cases) / sizeof(cases[0])); k++) {
+    if (ac_parse_evidence(cases[k].line, ac, evidence) != cases[k].status) {
+      fprintf(stderr, "Evidence \"%s\" not parsed as %d\n", cases[k].line, cases[k].status);
+      passed = false;
+    }
+  }
+  passed = passed && ac_parse_evidence("*,2", ac, evidence) == 1 && evidence[0] == -1 && evidence[1] == 2;
+  if (ac != NULL) {
+    ac_free(ac);
+  }
+  return passed;
+}
+
+/*
+ * ac_format_double must write what printf("%.15g") writes, over random
+ * doubles of every magnitude and in particular around 1e-4, where "%g"
+ * switches to scientific notation
+ */
+static bool check_format_double(int count) {
+  char fast[AC_MAX_NUMBER_LENGTH + 1];
+  char reference[AC_MAX_NUMBER_LENGTH + 1];
+  int numMismatches = 0;
+
+  srand48(7);
+  for (int k = 0; k < count; k++) {
+    double x;
+    if (k % 3 == 0) {
+      x = (1 + 9 * drand48()) * pow(10, -6 + (k / 3) % 3);
+    }
+    else if (k % 3 == 1) {
+      x = pow(10, -320 + 630 * drand48());
+    }
+    else {
+      x = drand48();
+    }
+    if (k % 2 == 1) {
+      x = -x;
+    }
+    fast[ac_format_double(fast, x)] = '\0';
+    snprintf(reference, sizeof(reference), "%.15g", x);
+    if (strcmp(fast, reference) != 0) {
+      if (numMismatches++ < 5) {
+	fprintf(stderr, "ac_format_double wrote %s, printf %s\n", fast, reference);
+      }
+    }
+  }
+  return numMismatches == 0;
+}
+
+int main(void) {
+  /*Unreachable '*' node one level above the root*/
+  report("reorder, unreachable node above root",
+	 check_reorder("(2)\nv 0 0\nv 0 1\n* 0 1\n+ 2 0\n* 3 1\n+ 0 1\nEOF\n"));
+  /*Unreachable chain four levels above the root*/
+  report("reorder, deep unreachable subcircuit",
+	 check_reorder("(2 2)\nv 0 0\nv 0 1\nv 1 0\nv 1 1\nn 0.5\n* 0 2\n+ 5 1\n* 6 3\n+ 7 4\n* 8 0\n"
+		       "+ 0 1\n* 10 4\n+ 2 3\n* 11 12\nEOF\n"));
+  report("binary circuit with wrong counts",
+	 check_binary_counts("(2 2)\nv 0 0\nv 0 1\nv 1 0\nv 1 1\nn 0.5\n* 0 2 4\n* 1 3\n+ 5 6\nEOF\n"));
+  report("binary circuit with corrupt arrays",
+	 check_binary_contents("(2 2)\nv 0 0\nv 0 1\nv 1 0\nv 1 1\nn 0.5\n* 0 2 4\n* 1 3\n+ 5 6\nEOF\n"));
+  report("malformed node lines", check_parse_errors());
+  report("evidence parsing", check_evidence());
+  report("format_double against printf", check_format_double(3000000));
+  report("incremental, movie.ac", check_incremental("movie.ac", 300));
+  report("incremental, voting.ac", check_incremental("voting.ac", 300));
+  report("batch, movie.ac", check_batch("movie.ac"));
+  report("batch, voting.ac", check_batch("voting.ac"));
+  report("dataflow on 4 threads, movie.ac", check_dataflow("movie.ac", 4, 20));
+  report("dataflow on 4 threads, voting.ac", check_dataflow("voting.ac", 4, 20));
+  report("simplify, movie.ac", check_simplify("movie.ac", 0, 20));
+  report("simplify to fan-in 2, movie.ac", check_simplify("movie.ac", 2, 20));
+  report("simplify, voting.ac", check_simplify("voting.ac", 0, 20));
+  report("simplify to fan-in 2, voting.ac", check_simplify("voting.ac", 2, 20));
+  report("specialize, movie.ac", check_specialize("movie.ac", 20));
+  report("specialize, voting.ac", check_specialize("voting.ac", 20));
+
+  if (numFailed > 0) {
+    fprintf(stderr, "%d checks failed\n", numFailed);
+    return (EXIT_FAILURE);
+  }
+  return (EXIT_SUCCESS);
+}